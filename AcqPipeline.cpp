@@ -0,0 +1,309 @@
+//=================================================================================================
+// AcqPipeline.cpp - Implements a three-stage acquisition pipeline: poll -> process -> sink
+//=================================================================================================
+#include <stdio.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdexcept>
+#include "AcqPipeline.h"
+#include "Util.h"
+using namespace std;
+
+
+//=================================================================================================
+// relax() - Called by a stage that found nothing to do
+//=================================================================================================
+static inline void relax()
+{
+    sched_yield();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// start() - Starts the pipeline
+//
+// Passed: buffers        = the DMA buffers, in the order the FPGA fills them
+//         completionReg  = the register in which the FPGA counts the buffers it has filled
+//         releaseReg     = the register in which we count the buffers we've finished with
+//         process        = called from a processing thread with each filled buffer
+//         sink           = called from the sink thread with each buffer, in order
+//         processThreads = the number of processing threads
+//         cpuList        = the CPUs to pin the threads to
+//
+// The completion register is a free-running count, so whatever it holds right now is taken as
+// the starting point, and the release register is set to match it (i.e., every buffer is free).
+// The FPGA's next buffer after start() must be buffers[0]
+//=================================================================================================
+void AcqPipeline::start(vector<DmaPool::buffer_t> buffers, FpgaReg* completionReg,
+                        FpgaReg* releaseReg, stage_fn process, stage_fn sink,
+                        int processThreads, vector<int> cpuList)
+{
+    // If we're already running, stop
+    stop();
+
+    // Check the caller's parameters
+    if (buffers.size() < 2) throwRuntime("AcqPipeline: need at least 2 buffers");
+    if (processThreads < 1) throwRuntime("AcqPipeline: invalid thread count %i", processThreads);
+    if (completionReg == nullptr || releaseReg == nullptr)
+    {
+        throwRuntime("AcqPipeline: missing register");
+    }
+
+    // Save the caller's configuration
+    buffer_        = buffers;
+    completionReg_ = completionReg;
+    releaseReg_    = releaseReg;
+    process_       = process;
+    sink_          = sink;
+
+    // Create the queues.  Each one is big enough to hold every buffer
+    toProcess_.clear();
+    toSink_.clear();
+    for (int i=0; i<processThreads; ++i)
+    {
+        toProcess_.emplace_back(new SpscQueue<item_t>(buffers.size()));
+        toSink_.emplace_back(new SpscQueue<item_t>(buffers.size()));
+    }
+
+    // Reset the counters
+    polled_         = 0;
+    processed_      = 0;
+    sunk_           = 0;
+    stalls_         = 0;
+    quit_           = false;
+    pollerDone_     = false;
+    processorsDone_ = 0;
+    failed_         = false;
+    error_.clear();
+
+    // Take the FPGA's current count as our starting point, and tell it every buffer is free.  The
+    // FPGA changes the completion register, so it's always read from the FPGA, never the shadow
+    base_ = completionReg_->fetch();
+    releaseReg_->write(base_);
+
+    // This returns the CPU to pin thread "n" to
+    auto cpu = [&](int n) {return cpuList.empty() ? -1 : cpuList[n % cpuList.size()];};
+
+    // Start the threads
+    thread_.push_back(thread(&AcqPipeline::pollLoop, this, cpu(0)));
+    for (int i=0; i<processThreads; ++i)
+    {
+        thread_.push_back(thread(&AcqPipeline::processLoop, this, i, cpu(i + 1)));
+    }
+    thread_.push_back(thread(&AcqPipeline::sinkLoop, this, cpu(processThreads + 1)));
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// setCompletionWait() - Tells the poller to sleep on a CompletionWait instead of spinning
+//=================================================================================================
+void AcqPipeline::setCompletionWait(CompletionWait* waiter)
+{
+    if (!thread_.empty()) throwRuntime("AcqPipeline: can't change the waiter while running");
+    waiter_ = waiter;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// stop() - Stops polling, lets every polled buffer drain through the pipeline, and stops the
+//          threads
+//=================================================================================================
+void AcqPipeline::stop()
+{
+    // If we're not running, there's nothing to do
+    if (thread_.empty()) return;
+
+    // Tell the poller to stop.  The other stages stop once everything upstream has drained
+    quit_ = true;
+
+    // Wait for the threads to exit
+    for (auto& t : thread_) t.join();
+    thread_.clear();
+
+    // If a stage ran into trouble, tell the caller
+    if (failed_) throwRuntime("%s", error_.c_str());
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// setError() - Records the first error that a stage runs into, and tells the poller to stop
+//=================================================================================================
+void AcqPipeline::setError(string error)
+{
+    lock_guard<mutex> lock(mutex_);
+    if (!failed_) error_ = error;
+    failed_ = true;
+    quit_   = true;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// runStage() - Calls one of the caller's stage functions with a buffer
+//
+// If the function throws, the buffer still moves on down the pipeline, so that every buffer
+// that was polled reaches the sink and stop() can drain the pipeline
+//=================================================================================================
+void AcqPipeline::runStage(stage_fn& fn, item_t& item)
+{
+    if (!fn || failed_) return;
+
+    try
+    {
+        fn(item);
+    }
+    catch (const exception& e)
+    {
+        setError(string("AcqPipeline: ") + e.what());
+    }
+    catch (...)
+    {
+        setError("AcqPipeline: unknown exception");
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// stats() - Returns the counters
+//=================================================================================================
+AcqPipeline::stats_t AcqPipeline::stats()
+{
+    return {polled_, processed_, sunk_, stalls_};
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// pollLoop() - Watches the completion register, and hands each newly filled buffer to the
+//              processing threads
+//=================================================================================================
+void AcqPipeline::pollLoop(int cpu)
+{
+    const size_t bufferCount  = buffer_.size();
+    const size_t processCount = toProcess_.size();
+    uint64_t     polled       = 0;
+    bool         stalled      = false;
+
+    // Pin ourselves to our CPU
+    pinThread(cpu);
+
+    while (!quit_)
+    {
+        // Find out how many buffers the FPGA has filled since we last looked
+        uint32_t fresh = completionReg_->fetch() - (uint32_t)(base_ + polled);
+
+        // Don't let any reads of the buffers be hoisted above the register read
+        atomic_thread_fence(memory_order_acquire);
+
+        // Hand each of them to a processing thread
+        for (uint32_t i=0; i<fresh; ++i)
+        {
+            uint64_t sequence = polled + i;
+            item_t   item     = {buffer_[sequence % bufferCount], sequence};
+            while (!toProcess_[sequence % processCount]->push(item)) relax();
+        }
+        polled += fresh;
+        polled_.store(polled, memory_order_release);
+
+        // If every buffer is filled and unreleased, the FPGA has nowhere to write
+        bool full = (polled - sunk_.load(memory_order_acquire) >= bufferCount);
+        if (full && !stalled) ++stalls_;
+        stalled = full;
+
+        // If there was nothing new, either sleep until the FPGA signals a completion, or give
+        // the other stages a chance to run.  The timeout is so that we notice stop()
+        if (fresh == 0 && waiter_)
+        {
+            uint32_t expected = (uint32_t)(base_ + polled);
+            waiter_->wait([&]{return quit_ || completionReg_->fetch() != expected;}, 10);
+        }
+        else if (fresh == 0) relax();
+    }
+
+    // Tell the processing threads we're done
+    pollerDone_ = true;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// processLoop() - Runs the caller's process function on each buffer handed to this thread, and
+//                 passes it on to the sink
+//=================================================================================================
+void AcqPipeline::processLoop(int index, int cpu)
+{
+    auto&  input  = *toProcess_[index];
+    auto&  output = *toSink_[index];
+    item_t item;
+
+    // Pin ourselves to our CPU
+    pinThread(cpu);
+
+    while (true)
+    {
+        // If there's a buffer waiting, process it and pass it on
+        if (input.pop(item))
+        {
+            runStage(process_, item);
+            while (!output.push(item)) relax();
+            ++processed_;
+            continue;
+        }
+
+        // If the poller is done and there's nothing left for us, so are we
+        if (pollerDone_ && input.size() == 0) break;
+
+        // Otherwise, wait for something to arrive
+        relax();
+    }
+
+    // Tell the sink that one more processing thread is done
+    ++processorsDone_;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// sinkLoop() - Runs the caller's sink function on each buffer in the order the FPGA filled
+//              them, and releases them back to the FPGA
+//
+// Buffer "n" always goes through processing thread n % processCount, so pulling from the
+// queues in rotation puts the buffers back in order
+//=================================================================================================
+void AcqPipeline::sinkLoop(int cpu)
+{
+    const int processCount = (int)toSink_.size();
+    uint64_t  sunk         = 0;
+    item_t    item;
+
+    // Pin ourselves to our CPU
+    pinThread(cpu);
+
+    while (true)
+    {
+        auto& input = *toSink_[sunk % processCount];
+
+        // If the next buffer in sequence is ready, sink it and hand it back to the FPGA
+        if (input.pop(item))
+        {
+            runStage(sink_, item);
+            ++sunk;
+            sunk_.store(sunk, memory_order_release);
+            releaseReg_->write((uint32_t)(base_ + sunk));
+            continue;
+        }
+
+        // If every processing thread is done and the next buffer never arrived, we're done
+        if (processorsDone_ == processCount && input.size() == 0) break;
+
+        // Otherwise, wait for something to arrive
+        relax();
+    }
+}
+//=================================================================================================
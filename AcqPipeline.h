@@ -0,0 +1,152 @@
+//=================================================================================================
+// AcqPipeline.h - Defines a three-stage acquisition pipeline: poll -> process -> sink
+//
+// The FPGA fills a fixed set of DMA buffers in round-robin order, and counts the buffers it has
+// filled in a "completion" register.  The host counts the buffers it has finished with in a
+// "release" register.  The FPGA may fill buffer "n" once the host has released buffer n-N
+// (where N is the number of buffers), so with two or more buffers the FPGA is filling one while
+// the host works on the others.
+//
+//    poller    - Watches the completion register and hands each newly filled buffer to the
+//                processing threads, round-robin
+//    process   - Each processing thread runs the caller's "process" function on its buffers
+//    sink      - Runs the caller's "sink" function on every buffer in the order they were filled,
+//                then releases them back to the FPGA
+//
+// The stages are joined by lock-free single-producer/single-consumer queues, one per processing
+// thread in each direction, so no stage ever takes a lock.  Every queue can hold every buffer,
+// so the poller never waits for a downstream stage: the FPGA only stalls if the host as a whole
+// falls N buffers behind, and the "stalls" statistic counts how often that has happened.
+//
+// By default the poller spins on the completion register.  Given a CompletionWait, it sleeps
+// until the FPGA signals instead.
+//
+// If the process or sink function throws, the pipeline records the error and stops polling.
+// Buffers already polled still drain through to the sink (without being passed to the caller's
+// functions), and stop() then throws the error.
+//
+// If the buffers are in cached memory, the process function should PhysMem::invalidate() each
+// buffer before reading it.
+//=================================================================================================
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <functional>
+#include "DmaPool.h"
+#include "FpgaReg.h"
+#include "SpscQueue.h"
+#include "CompletionWait.h"
+
+class AcqPipeline
+{
+public:
+
+    // One filled buffer, as it passes down the pipeline
+    struct item_t
+    {
+        DmaPool::buffer_t buffer;   // The buffer the FPGA filled
+        uint64_t          sequence; // How many buffers the FPGA filled before this one
+    };
+
+    // The caller's processing and sink functions
+    typedef std::function<void(item_t&)> stage_fn;
+
+    // Describes how the pipeline is doing
+    struct stats_t
+    {
+        uint64_t polled;            // Buffers the poller has seen completed
+        uint64_t processed;         // Buffers the processing threads have finished
+        uint64_t sunk;              // Buffers the sink has finished and released
+        uint64_t stalls;            // Times the poller found every buffer filled and unreleased
+    };
+
+    // Constructor
+    AcqPipeline() {};
+
+    // No copy or assignment constructor - objects of this class can't be copied
+    AcqPipeline (const AcqPipeline&) = delete;
+    AcqPipeline& operator= (const AcqPipeline&) = delete;
+
+    // Destructor - Stops the pipeline.  Call stop() first to find out whether a stage failed
+    ~AcqPipeline() {try {stop();} catch (...) {}}
+
+    // Starts the pipeline.  From here on, the FPGA fills buffers[n % buffers.size()] with the
+    // n'th buffer of data.  The poller is pinned to cpuList[0], processing thread "n" to
+    // cpuList[n+1], and the sink to the CPU after that (all modulo cpuList.size()).  An empty
+    // cpuList means "don't pin"
+    void    start(std::vector<DmaPool::buffer_t> buffers, FpgaReg* completionReg,
+                  FpgaReg* releaseReg, stage_fn process, stage_fn sink,
+                  int processThreads = 1, std::vector<int> cpuList = {});
+
+    // When the poller finds nothing new, it sleeps on this instead of spinning.  Call this
+    // before start().  A null pointer means "spin"
+    void    setCompletionWait(CompletionWait* waiter);
+
+    // Stops polling, waits for every buffer already polled to reach the sink, then stops the
+    // threads.  Throws if the process or sink function threw
+    void    stop();
+
+    // Returns the counters
+    stats_t stats();
+
+protected:
+
+    // The loops that each stage runs
+    void    pollLoop(int cpu);
+    void    processLoop(int index, int cpu);
+    void    sinkLoop(int cpu);
+
+    // Calls a stage function, and if it throws, records the error and stops polling.  Once a
+    // stage has failed, the functions aren't called again
+    void    runStage(stage_fn& fn, item_t& item);
+
+    // Records the first error a stage runs into
+    void    setError(std::string error);
+
+    // The buffers the FPGA fills, in the order it fills them
+    std::vector<DmaPool::buffer_t> buffer_;
+
+    // The registers that count filled and released buffers
+    FpgaReg* completionReg_ = nullptr;
+    FpgaReg* releaseReg_    = nullptr;
+
+    // What the completion register held when we started
+    uint32_t base_ = 0;
+
+    // If this isn't null, the poller sleeps on it when there's nothing to do
+    CompletionWait* waiter_ = nullptr;
+
+    // The caller's stage functions
+    stage_fn process_;
+    stage_fn sink_;
+
+    // toProcess_[n] carries buffers from the poller to processing thread "n", and toSink_[n]
+    // carries them from processing thread "n" to the sink
+    std::vector<std::unique_ptr<SpscQueue<item_t>>> toProcess_;
+    std::vector<std::unique_ptr<SpscQueue<item_t>>> toSink_;
+
+    // The counters
+    alignas(64) std::atomic<uint64_t> polled_;
+    alignas(64) std::atomic<uint64_t> processed_;
+    alignas(64) std::atomic<uint64_t> sunk_;
+    alignas(64) std::atomic<uint64_t> stalls_;
+
+    // Each stage exits once the stage before it is done and its queues are empty
+    std::atomic<bool> quit_;
+    std::atomic<bool> pollerDone_;
+    std::atomic<int>  processorsDone_;
+
+    // The first error a stage ran into, and whether there's been one
+    std::mutex        mutex_;
+    std::string       error_;
+    std::atomic<bool> failed_;
+
+    // The threads
+    std::vector<std::thread> thread_;
+};
@@ -0,0 +1,256 @@
+//=================================================================================================
+// BarWriter.cpp - Implements a class that writes large buffers to a PCI BAR with a pool of threads
+//=================================================================================================
+#include <stdio.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdexcept>
+#include "BarWriter.h"
+#include "MmioCopy.h"
+#include "Mmio.h"
+#include "Util.h"
+using namespace std;
+
+// If the caller doesn't specify a chunk size, chunks are never smaller than this
+static const size_t MIN_CHUNK = 64 * 1024;
+
+// Chunk sizes are always a multiple of this
+static const size_t CHUNK_ALIGN = 4096;
+
+
+//=================================================================================================
+// allowedCpus() - Returns the list of CPUs that this process is allowed to run on
+//=================================================================================================
+static vector<int> allowedCpus()
+{
+    vector<int> result;
+    cpu_set_t   cpuSet;
+
+    // Find out which CPUs we're allowed to run on
+    if (sched_getaffinity(0, sizeof(cpuSet), &cpuSet) == 0)
+    {
+        for (int cpu=0; cpu<CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &cpuSet)) result.push_back(cpu);
+        }
+    }
+
+    // If that failed for some reason, we won't pin the threads
+    if (result.empty()) result.push_back(-1);
+
+    // Hand the caller the list of CPUs
+    return result;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// start() - Starts the pool of worker threads
+//
+// Passed: threadCount = the number of worker threads to create
+//         cpuList     = the list of CPUs to pin the threads to
+//=================================================================================================
+void BarWriter::start(int threadCount, vector<int> cpuList)
+{
+    // If we already have threads running, stop them
+    stop();
+
+    // We need at least one worker
+    if (threadCount < 1) throwRuntime("BarWriter: invalid thread count %i", threadCount);
+
+    // If the caller didn't give us a list of CPUs, use every CPU we're allowed to run on
+    if (cpuList.empty()) cpuList = allowedCpus();
+
+    // Start the worker threads, each pinned to its own CPU
+    for (int i=0; i<threadCount; ++i)
+    {
+        int cpu = cpuList[i % cpuList.size()];
+        thread_.push_back(thread(&BarWriter::workerLoop, this, cpu));
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// stop() - Waits for any job in progress, then stops the worker threads
+//=================================================================================================
+void BarWriter::stop()
+{
+    // If there are no threads running, there's nothing to do
+    if (thread_.empty()) return;
+
+    // Wait for any job that's still in progress
+    wait();
+
+    // Tell the workers to quit
+    {
+        lock_guard<mutex> lock(mutex_);
+        quit_ = true;
+    }
+    jobReady_.notify_all();
+
+    // And wait for them to do so
+    for (auto& t : thread_) t.join();
+
+    // We no longer have any workers
+    thread_.clear();
+    quit_ = false;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// writeAsync() - Hands a new job to the worker threads and returns immediately
+//
+// Passed: bar       = the BAR we're writing to
+//         offset    = byte offset within the BAR
+//         src       = the host buffer to be copied
+//         bytes     = the number of bytes to copy
+//         chunkSize = the size of the chunks the job is split into (0 = choose automatically)
+//=================================================================================================
+void BarWriter::writeAsync(PciDevice::resource_t& bar, size_t offset, const void* src,
+                           size_t bytes, size_t chunkSize)
+{
+    // If there is no thread pool, complain
+    if (thread_.empty()) throwRuntime("BarWriter: not started");
+
+    // Make sure the caller isn't trying to write past the end of the BAR
+    if (offset + bytes > bar.size)
+    {
+        throwRuntime("BarWriter: write of 0x%zx bytes at 0x%zx overflows BAR %i",
+                     bytes, offset, bar.barIndex);
+    }
+
+    // Wait for any previous job to complete
+    wait();
+
+    // If there's nothing to write, we're done
+    if (bytes == 0) return;
+
+    // If the caller didn't specify a chunk size, split the job evenly among the workers
+    if (chunkSize == 0)
+    {
+        chunkSize = (bytes + thread_.size() - 1) / thread_.size();
+        if (chunkSize < MIN_CHUNK) chunkSize = MIN_CHUNK;
+    }
+
+    // Chunks are always a multiple of the page size, so that every chunk but the last starts
+    // and ends on a nicely aligned boundary
+    chunkSize = (chunkSize + CHUNK_ALIGN - 1) & ~(CHUNK_ALIGN - 1);
+
+    // Post the job and wake up the workers
+    {
+        lock_guard<mutex> lock(mutex_);
+        job_.dst        = bar.baseAddr + offset;
+        job_.src        = (const uint8_t*)src;
+        job_.bytes      = bytes;
+        job_.chunkSize  = chunkSize;
+        job_.chunkCount = (bytes + chunkSize - 1) / chunkSize;
+        nextChunk_      = 0;
+        busyWorkers_    = (int)thread_.size();
+        pending_        = true;
+        ++generation_;
+    }
+    jobReady_.notify_all();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// wait() - Waits for the job in progress to complete
+//
+// Passed: readBack = if true, read back from the BAR after the job completes, which forces all
+//                    of the posted writes to arrive at the device before we return
+//=================================================================================================
+void BarWriter::wait(bool readBack)
+{
+    unique_lock<mutex> lock(mutex_);
+
+    // If there's no job outstanding, there's nothing to wait for
+    if (!pending_) return;
+
+    // Wait for all of the workers to finish with this job
+    jobDone_.wait(lock, [this]{return busyWorkers_ == 0;});
+
+    // There is no longer a job pending
+    pending_ = false;
+
+    // A read from the device can't pass the posted writes ahead of it
+    if (readBack)
+    {
+        uint8_t* last = job_.dst + ((job_.bytes - 1) & ~(size_t)3);
+        Mmio::read32(last);
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// write() - Copies a buffer to a BAR and waits for the copy to complete
+//=================================================================================================
+void BarWriter::write(PciDevice::resource_t& bar, size_t offset, const void* src, size_t bytes,
+                      bool readBack, size_t chunkSize)
+{
+    writeAsync(bar, offset, src, bytes, chunkSize);
+    wait(readBack);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// processChunks() - Claims chunks of the current job and copies them, until none are left
+//=================================================================================================
+void BarWriter::processChunks()
+{
+    while (true)
+    {
+        // Claim the next chunk
+        size_t chunk = nextChunk_.fetch_add(1, memory_order_relaxed);
+
+        // If there are no chunks left, we're done
+        if (chunk >= job_.chunkCount) return;
+
+        // Compute the offset and length of this chunk
+        size_t offset = chunk * job_.chunkSize;
+        size_t length = job_.bytes - offset;
+        if (length > job_.chunkSize) length = job_.chunkSize;
+
+        // And copy it to the BAR
+        MmioCopy::toDevice(job_.dst + offset, job_.src + offset, length);
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// workerLoop() - Each worker thread waits for a job, helps to complete it, then waits again
+//=================================================================================================
+void BarWriter::workerLoop(int cpu)
+{
+    uint64_t lastGeneration = 0;
+
+    // Pin ourselves to our CPU
+    pinThread(cpu);
+
+    while (true)
+    {
+        // Wait for either a new job or for the signal to quit
+        {
+            unique_lock<mutex> lock(mutex_);
+            jobReady_.wait(lock, [&]{return quit_ || generation_ != lastGeneration;});
+            if (quit_) return;
+            lastGeneration = generation_;
+        }
+
+        // Help copy the chunks of this job
+        processChunks();
+
+        // Tell wait() when the last worker is done
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (--busyWorkers_ == 0) jobDone_.notify_all();
+        }
+    }
+}
+//=================================================================================================
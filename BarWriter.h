@@ -0,0 +1,102 @@
+//=================================================================================================
+// BarWriter.h - Defines a class that writes large buffers to a PCI BAR with a pool of threads
+//
+// A single thread issuing posted writes can't saturate a wide PCIe link.  A BarWriter splits a
+// large host buffer into chunks, and a pool of persistent worker threads (each pinned to its
+// own CPU) copies those chunks into the BAR concurrently.
+//=================================================================================================
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include "PciDevice.h"
+
+class BarWriter
+{
+public:
+
+    // Constructor
+    BarWriter() {};
+
+    // No copy or assignment constructor - objects of this class can't be copied
+    BarWriter (const BarWriter&) = delete;
+    BarWriter& operator= (const BarWriter&) = delete;
+
+    // Destructor - Stops the worker threads
+    ~BarWriter() {stop();}
+
+    // Starts the worker threads.  Worker "n" is pinned to cpuList[n % cpuList.size()].  If the
+    // cpu-list is empty, the workers are spread across the CPUs this process is allowed to use
+    void    start(int threadCount, std::vector<int> cpuList = {});
+
+    // Starts the worker threads, pinned to the CPUs that are local to the specified device
+    void    start(int threadCount, PciDevice& device) {start(threadCount, device.localCpus());}
+
+    // Stops the worker threads
+    void    stop();
+
+    // Returns the number of worker threads
+    int     threadCount() {return (int)thread_.size();}
+
+    // Starts copying "bytes" bytes from "src" to "offset" within a BAR, and returns immediately.
+    // A chunkSize of 0 means "pick a sensible chunk size"
+    void    writeAsync(PciDevice::resource_t& bar, size_t offset, const void* src, size_t bytes,
+                       size_t chunkSize = 0);
+
+    // Waits for the write started by writeAsync() to complete.  If "readBack" is true, the BAR is
+    // read after the last chunk is written, which ensures that every posted write has arrived
+    void    wait(bool readBack = false);
+
+    // Convenience method: writeAsync() followed by wait()
+    void    write(PciDevice::resource_t& bar, size_t offset, const void* src, size_t bytes,
+                  bool readBack = false, size_t chunkSize = 0);
+
+protected:
+
+    // The loop that each worker thread runs
+    void    workerLoop(int cpu);
+
+    // Copies chunks of the current job until there are no chunks left
+    void    processChunks();
+
+    // Describes the transfer that is currently in progress
+    struct job_t
+    {
+        uint8_t*       dst;
+        const uint8_t* src;
+        size_t         bytes;
+        size_t         chunkSize;
+        size_t         chunkCount;
+    } job_;
+
+    // The index of the next chunk of the current job to be claimed by a worker
+    std::atomic<size_t> nextChunk_;
+
+    // Guards everything below
+    std::mutex              mutex_;
+
+    // Workers wait on this for a new job to arrive
+    std::condition_variable jobReady_;
+
+    // wait() waits on this for the workers to finish the current job
+    std::condition_variable jobDone_;
+
+    // Incremented every time a new job is posted
+    uint64_t                generation_ = 0;
+
+    // The number of workers still working on the current job
+    int                     busyWorkers_ = 0;
+
+    // True when the worker threads should exit
+    bool                    quit_ = false;
+
+    // True while there is a job that nobody has wait()'ed for
+    bool                    pending_ = false;
+
+    // The worker threads
+    std::vector<std::thread> thread_;
+};
@@ -0,0 +1,338 @@
+//=================================================================================================
+// CaptureWriter.cpp - Implements a class that streams filled DMA buffers to a file on disk
+//=================================================================================================
+#include <unistd.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <stdexcept>
+#include "CaptureWriter.h"
+#include "MmioCopy.h"
+#include "Util.h"
+using namespace std;
+using namespace std::chrono;
+
+
+//=================================================================================================
+// writeFully() - Calls pwritev() until every byte described by "iov" has been written
+//
+// Returns: 0 on success, otherwise an errno value
+//=================================================================================================
+static int writeFully(int fd, iovec* iov, int count, uint64_t offset)
+{
+    while (count > 0)
+    {
+        ssize_t n = pwritev(fd, iov, count, offset);
+
+        // If the write failed, tell the caller why
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return errno;
+        if (n == 0) return EIO;
+
+        // Skip over the iovecs that were completely written
+        offset += n;
+        while (count > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+
+        // And the part of the next one that was
+        if (count > 0)
+        {
+            iov->iov_base = (uint8_t*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// start() - Creates the capture file and starts the writer threads
+//
+// Passed: filename    = the name of the file to capture to
+//         threadCount = the number of writer threads to create
+//         recycle     = called with each buffer once it's on disk
+//         batchSize   = the maximum number of buffers to write with a single pwritev()
+//         cpuList     = the list of CPUs to pin the writers to (empty = don't pin)
+//=================================================================================================
+void CaptureWriter::start(string filename, int threadCount, recycle_fn recycle,
+                          size_t batchSize, vector<int> cpuList)
+{
+    // If we're already capturing, stop
+    stop();
+
+    // Check the caller's parameters
+    if (threadCount < 1) throwRuntime("CaptureWriter: invalid thread count %i", threadCount);
+    if (batchSize < 1) batchSize = 1;
+    if (batchSize > IOV_MAX) batchSize = IOV_MAX;
+
+    // Create the file.  O_DIRECT keeps the data out of the page cache
+    fd_ = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (fd_ < 0) throwRuntime("Can't create %s (%s)", filename.c_str(), strerror(errno));
+
+    // Start out with an empty queue
+    filename_      = filename;
+    recycle_       = recycle;
+    batchSize_     = batchSize;
+    bytesWritten_  = 0;
+    useBounce_     = false;
+    inFlight_      = 0;
+    maxQueueDepth_ = 0;
+    nextOffset_    = 0;
+    error_.clear();
+    startTime_     = steady_clock::now();
+
+    // Start the writer threads
+    for (int i=0; i<threadCount; ++i)
+    {
+        int cpu = cpuList.empty() ? -1 : cpuList[i % cpuList.size()];
+        thread_.push_back(thread(&CaptureWriter::writerLoop, this, cpu));
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// stop() - Waits for the queue to drain, then stops the writer threads and closes the file
+//=================================================================================================
+void CaptureWriter::stop()
+{
+    // If we're not capturing, there's nothing to do
+    if (thread_.empty()) return;
+
+    // Wait for every buffer to be written, then tell the writers to quit
+    {
+        unique_lock<mutex> lock(mutex_);
+        queueDrained_.wait(lock, [this]{return queue_.empty() && inFlight_ == 0;});
+        quit_ = true;
+    }
+    queueReady_.notify_all();
+
+    // And wait for them to do so
+    for (auto& t : thread_) t.join();
+
+    // We no longer have any writers
+    thread_.clear();
+    quit_ = false;
+
+    // Make sure the file's metadata (i.e., its size) is on disk too, and close it
+    if (fdatasync(fd_) < 0)
+    {
+        setError("CaptureWriter: sync of " + filename_ + " failed (" + strerror(errno) + ")");
+    }
+    ::close(fd_);
+    fd_ = -1;
+
+    // If a writer ran into trouble, tell the caller
+    checkError();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// submit() - Queues a filled buffer to be written to the file
+//
+// Passed: buffer = the buffer, as allocated from a DmaPool
+//         bytes  = the number of bytes at the start of the buffer to write
+//=================================================================================================
+void CaptureWriter::submit(const DmaPool::buffer_t& buffer, size_t bytes)
+{
+    // If there are no writers, complain
+    if (thread_.empty()) throwRuntime("CaptureWriter: not started");
+
+    // If a writer ran into trouble, tell the caller
+    checkError();
+
+    // O_DIRECT is picky about alignment
+    if (((uintptr_t)buffer.ptr | bytes) & (ALIGN - 1))
+    {
+        throwRuntime("CaptureWriter: 0x%zx bytes at %p are not %zu-byte aligned",
+                     bytes, buffer.ptr, ALIGN);
+    }
+
+    // Add the buffer to the queue, in the next slot in the file
+    {
+        lock_guard<mutex> lock(mutex_);
+        queue_.push_back({buffer, bytes, nextOffset_});
+        nextOffset_ += bytes;
+        size_t depth = queue_.size() + inFlight_;
+        if (depth > maxQueueDepth_) maxQueueDepth_ = depth;
+    }
+    queueReady_.notify_one();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// stats() - Returns the throughput and queue depth
+//=================================================================================================
+CaptureWriter::stats_t CaptureWriter::stats()
+{
+    stats_t result;
+
+    lock_guard<mutex> lock(mutex_);
+    result.bytes         = bytesWritten_;
+    result.seconds       = duration<double>(steady_clock::now() - startTime_).count();
+    result.mbps          = result.seconds > 0 ? result.bytes / result.seconds / 1e6 : 0;
+    result.queueDepth    = queue_.size() + inFlight_;
+    result.maxQueueDepth = maxQueueDepth_;
+    return result;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// setError() - Records the first error that a writer thread runs into
+//=================================================================================================
+void CaptureWriter::setError(string error)
+{
+    lock_guard<mutex> lock(mutex_);
+    if (error_.empty()) error_ = error;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// checkError() - Throws the error that a writer thread ran into, if there was one
+//=================================================================================================
+void CaptureWriter::checkError()
+{
+    string error;
+
+    {
+        lock_guard<mutex> lock(mutex_);
+        error = error_;
+    }
+
+    if (!error.empty()) throwRuntime("%s", error.c_str());
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// writeBatch() - Writes a batch of consecutive entries to the file with a single pwritev()
+//
+// Passed: batch  = the entries to write.  Their file offsets are consecutive
+//         bounce = this thread's bounce buffer
+//
+// If the kernel won't do O_DIRECT from the buffers themselves (EFAULT), the batch is copied into
+// the bounce buffer and written from there, and so is every batch after it
+//
+// Returns: true if the batch was written
+//=================================================================================================
+bool CaptureWriter::writeBatch(vector<entry_t>& batch, NumaBuffer& bounce)
+{
+    iovec    iov[IOV_MAX];
+    size_t   total  = 0;
+    uint64_t offset = batch[0].offset;
+    int      err    = 0;
+
+    // Try writing straight from the DMA buffers
+    if (!useBounce_)
+    {
+        for (size_t i=0; i<batch.size(); ++i)
+        {
+            iov[i].iov_base = batch[i].buffer.ptr;
+            iov[i].iov_len  = batch[i].bytes;
+        }
+
+        err = writeFully(fd_, iov, (int)batch.size(), offset);
+        if (err == 0) return true;
+        if (err == EFAULT) useBounce_ = true;
+    }
+
+    // If the buffers can't be used for O_DIRECT, copy them into our bounce buffer
+    if (useBounce_)
+    {
+        for (auto& entry : batch) total += entry.bytes;
+        if (bounce.size() < total) bounce.alloc(total, -1);
+
+        uint8_t* dst = bounce.bptr();
+        for (auto& entry : batch)
+        {
+            MmioCopy::fromDevice(dst, entry.buffer.ptr, entry.bytes);
+            dst += entry.bytes;
+        }
+
+        iov[0].iov_base = bounce.bptr();
+        iov[0].iov_len  = total;
+        err = writeFully(fd_, iov, 1, offset);
+        if (err == 0) return true;
+    }
+
+    // If we get here, the write failed
+    setError("CaptureWriter: write to " + filename_ + " failed (" + strerror(err) + ")");
+    return false;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// writerLoop() - Each writer thread takes a batch of buffers from the queue, writes them, and
+//                recycles them
+//=================================================================================================
+void CaptureWriter::writerLoop(int cpu)
+{
+    vector<entry_t> batch;
+    NumaBuffer      bounce;
+
+    // Pin ourselves to our CPU
+    pinThread(cpu);
+
+    while (true)
+    {
+        // Wait for buffers to arrive, then take as many as a batch will hold
+        {
+            unique_lock<mutex> lock(mutex_);
+            queueReady_.wait(lock, [this]{return quit_ || !queue_.empty();});
+            if (queue_.empty()) return;
+
+            batch.clear();
+            while (!queue_.empty() && batch.size() < batchSize_)
+            {
+                batch.push_back(queue_.front());
+                queue_.pop_front();
+            }
+            inFlight_ += batch.size();
+        }
+
+        // If there's more in the queue, let another writer have it
+        queueReady_.notify_one();
+
+        // Write the batch.  After a failure, we still recycle the buffers so the producer
+        // doesn't run dry, but we don't try to write any more
+        bool failed;
+        {
+            lock_guard<mutex> lock(mutex_);
+            failed = !error_.empty();
+        }
+
+        // Count the bytes that made it to disk
+        if (!failed && writeBatch(batch, bounce))
+        {
+            for (auto& entry : batch) bytesWritten_ += entry.bytes;
+        }
+
+        // Hand the buffers back to the producer
+        if (recycle_) for (auto& entry : batch) recycle_(entry.buffer);
+
+        // Tell stop() when the queue has drained
+        {
+            lock_guard<mutex> lock(mutex_);
+            inFlight_ -= batch.size();
+            if (queue_.empty() && inFlight_ == 0) queueDrained_.notify_all();
+        }
+    }
+}
+//=================================================================================================
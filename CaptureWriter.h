@@ -0,0 +1,149 @@
+//=================================================================================================
+// CaptureWriter.h - Defines a class that streams filled DMA buffers to a file on disk
+//
+// The producer submit()s each buffer as the FPGA fills it.  Every buffer is assigned the next
+// slot in the file at the moment it's submitted, so the file always holds the buffers in the
+// order they were submitted.  A pool of writer threads drains the queue, each one gathering a
+// batch of consecutive buffers into a single pwritev().  The file is opened with O_DIRECT, so
+// the data goes from the DMA buffers to the disk without passing through the page cache.  Once
+// a buffer is on disk, it's handed back to the producer through the "recycle" callback.
+//
+// O_DIRECT requires that every buffer's address and length be a multiple of ALIGN bytes.  The
+// kernel also refuses O_DIRECT from some kinds of mapping (a /dev/mem mapping of the memmap=
+// region is one).  When that happens, the writers fall back to copying each batch into a
+// bounce buffer of their own, which is another reason to map the region cached.
+//=================================================================================================
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include "DmaPool.h"
+#include "NumaBuffer.h"
+
+class CaptureWriter
+{
+public:
+
+    // Buffer addresses and lengths must be a multiple of this
+    static const size_t ALIGN = 4096;
+
+    // Called from a writer thread once a buffer has been written to disk
+    typedef std::function<void(const DmaPool::buffer_t&)> recycle_fn;
+
+    // Describes how the capture is going
+    struct stats_t
+    {
+        uint64_t bytes;             // The number of bytes written to disk so far
+        double   seconds;           // The number of seconds since start()
+        double   mbps;              // Sustained throughput, in MB/s
+        size_t   queueDepth;        // Buffers submitted but not yet recycled
+        size_t   maxQueueDepth;     // The deepest the queue has been
+    };
+
+    // Constructor
+    CaptureWriter() {};
+
+    // No copy or assignment constructor - objects of this class can't be copied
+    CaptureWriter (const CaptureWriter&) = delete;
+    CaptureWriter& operator= (const CaptureWriter&) = delete;
+
+    // Destructor - Drains the queue and closes the file.  Call stop() first to find out whether
+    // every buffer was written successfully
+    ~CaptureWriter() {try {stop();} catch (...) {}}
+
+    // Creates the file and starts the writer threads.  Each pwritev() gathers up to "batchSize"
+    // buffers.  Writer "n" is pinned to cpuList[n % cpuList.size()], if cpuList isn't empty
+    void    start(std::string filename, int threadCount, recycle_fn recycle,
+                  size_t batchSize = 16, std::vector<int> cpuList = {});
+
+    // Queues the first "bytes" bytes of a filled buffer to be written to the file
+    void    submit(const DmaPool::buffer_t& buffer, size_t bytes);
+
+    // Waits for every submitted buffer to reach the disk, then stops the writer threads and
+    // closes the file.  Throws if any buffer couldn't be written
+    void    stop();
+
+    // Returns the throughput and queue depth
+    stats_t stats();
+
+protected:
+
+    // One buffer waiting to be written
+    struct entry_t
+    {
+        DmaPool::buffer_t buffer;   // The buffer
+        size_t            bytes;    // How many bytes of it to write
+        uint64_t          offset;   // Where in the file they go
+    };
+
+    // The loop that each writer thread runs
+    void    writerLoop(int cpu);
+
+    // Writes a batch of consecutive entries to the file.  Returns false on failure
+    bool    writeBatch(std::vector<entry_t>& batch, NumaBuffer& bounce);
+
+    // Records the first error a writer thread runs into
+    void    setError(std::string error);
+
+    // Throws the error a writer thread ran into, if there was one
+    void    checkError();
+
+    // The file descriptor of the capture file
+    int     fd_ = -1;
+
+    // The name of the capture file
+    std::string filename_;
+
+    // Called to hand each buffer back to the producer
+    recycle_fn recycle_;
+
+    // The maximum number of buffers in a single pwritev()
+    size_t  batchSize_ = 0;
+
+    // When start() was called
+    std::chrono::steady_clock::time_point startTime_;
+
+    // The number of bytes written so far
+    std::atomic<uint64_t> bytesWritten_;
+
+    // True once we've discovered that the buffers can't be handed to O_DIRECT as-is
+    std::atomic<bool> useBounce_;
+
+    // Guards everything below
+    std::mutex              mutex_;
+
+    // Writers wait on this for buffers to arrive
+    std::condition_variable queueReady_;
+
+    // stop() waits on this for the queue to drain
+    std::condition_variable queueDrained_;
+
+    // Buffers waiting for a writer
+    std::deque<entry_t>     queue_;
+
+    // The number of buffers that writers have taken from the queue but not yet recycled
+    size_t                  inFlight_ = 0;
+
+    // The deepest the queue has been
+    size_t                  maxQueueDepth_ = 0;
+
+    // The file offset where the next submitted buffer goes
+    uint64_t                nextOffset_ = 0;
+
+    // The first error a writer ran into
+    std::string             error_;
+
+    // True when the writer threads should exit
+    bool                    quit_ = false;
+
+    // The writer threads
+    std::vector<std::thread> thread_;
+};
@@ -0,0 +1,317 @@
+//=================================================================================================
+// CompletionWait.cpp - Implements a class that waits for an FPGA completion without burning a core
+//=================================================================================================
+#include <unistd.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <chrono>
+#include <stdexcept>
+#include "CompletionWait.h"
+#include "Util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+#endif
+using namespace std;
+using namespace std::chrono;
+
+
+//=================================================================================================
+// cpuRelax() - Tells the CPU we're in a spin-loop
+//=================================================================================================
+static inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield" ::: "memory");
+#endif
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// remainingMs() - Returns the number of milliseconds until "deadline", or -1 if there's no
+//                 timeout
+//=================================================================================================
+static int remainingMs(int timeoutMs, steady_clock::time_point deadline)
+{
+    if (timeoutMs < 0) return -1;
+    auto ms = duration_cast<milliseconds>(deadline - steady_clock::now()).count();
+    return ms > 0 ? (int)ms : 0;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// open() - Opens a UIO device file
+//=================================================================================================
+void CompletionWait::open(string filename)
+{
+    // Close any descriptor we already have
+    close();
+
+    // Open the UIO device
+    int fd = ::open(filename.c_str(), O_RDWR);
+    if (fd < 0) throwRuntime("Can't open %s (%s)", filename.c_str(), strerror(errno));
+
+    // We own this descriptor
+    fd_       = fd;
+    owned_    = true;
+    kind_     = KIND_UIO;
+    uioValid_ = false;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// attach() - Attaches to a descriptor that the caller owns
+//=================================================================================================
+void CompletionWait::attach(int fd, kind_t kind)
+{
+    // Close any descriptor we already have
+    close();
+
+    // Use the caller's descriptor
+    fd_       = fd;
+    owned_    = false;
+    kind_     = kind;
+    uioValid_ = false;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// close() - Closes the descriptor if we opened it
+//=================================================================================================
+void CompletionWait::close()
+{
+    if (owned_ && fd_ >= 0) ::close(fd_);
+    fd_    = -1;
+    owned_ = false;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// setMode() - Selects how wait() waits
+//=================================================================================================
+void CompletionWait::setMode(mode_t mode, uint32_t spinNs)
+{
+    mode_   = mode;
+    spinNs_ = spinNs;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// arm() - Re-enables the interrupt
+//
+// A UIO driver disables the interrupt each time it fires, and it's re-enabled by writing a 1 to
+// the device file.  Drivers that don't need that reject the write, which is harmless.  An
+// eventfd needs nothing
+//=================================================================================================
+void CompletionWait::arm()
+{
+    if (kind_ == KIND_UIO)
+    {
+        uint32_t enable = 1;
+        (void)::write(fd_, &enable, sizeof enable);
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// consume() - Reads the pending event count without blocking
+//
+// Returns: the number of events that arrived since the last consume(), or 0 if none did
+//
+// A UIO device reads as a 32-bit running total of interrupts since the device was loaded, and
+// an eventfd reads as a 64-bit count of the events since it was last read.  A UIO device only
+// becomes readable once an interrupt has arrived since it was opened, but the first total we
+// read includes every interrupt before that too, so it's taken as the baseline and counts as
+// a single event
+//=================================================================================================
+uint64_t CompletionWait::consume()
+{
+    pollfd   pfd = {fd_, POLLIN, 0};
+    uint64_t events = 0;
+
+    // If there's nothing to read, don't block trying
+    if (fd_ < 0 || ::poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLIN)) return 0;
+
+    if (kind_ == KIND_UIO)
+    {
+        uint32_t total;
+        if (::read(fd_, &total, sizeof total) != sizeof total) return 0;
+        events    = (uioValid_ && total != uioCount_) ? (uint32_t)(total - uioCount_) : 1;
+        uioCount_ = total;
+        uioValid_ = true;
+    }
+    else
+    {
+        if (::read(fd_, &events, sizeof events) != sizeof events) return 0;
+    }
+
+    // Keep track of how many events we've seen, and tell the caller how many just arrived
+    events_ += events;
+    return events;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// sleep() - Sleeps until the descriptor becomes readable
+//
+// Returns: false on timeout
+//=================================================================================================
+bool CompletionWait::sleep(int timeoutMs)
+{
+    pollfd pfd = {fd_, POLLIN, 0};
+    int    rc;
+
+    ++sleeps_;
+
+    do rc = ::poll(&pfd, 1, timeoutMs); while (rc < 0 && errno == EINTR);
+
+    if (rc < 0) throwRuntime("CompletionWait: poll failed (%s)", strerror(errno));
+    return rc > 0;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// wait() - Waits for an event on the descriptor
+//
+// Passed: timeoutMs = how long to wait in milliseconds (-1 = forever)
+//
+// Returns: the number of events that arrived, or 0 on timeout
+//=================================================================================================
+uint64_t CompletionWait::wait(int timeoutMs)
+{
+    uint64_t events;
+
+    // There must be something to wait on
+    if (fd_ < 0) throwRuntime("CompletionWait: no descriptor");
+
+    auto start    = steady_clock::now();
+    auto deadline = start + milliseconds(timeoutMs < 0 ? 0 : timeoutMs);
+
+    // In spin or hybrid mode, start out by spinning
+    if (mode_ != MODE_BLOCK)
+    {
+        auto spinEnd = start + nanoseconds(spinNs_);
+        while (mode_ == MODE_SPIN || steady_clock::now() < spinEnd)
+        {
+            if ((events = consume()) != 0) return events;
+            if (mode_ == MODE_SPIN && timeoutMs >= 0 && steady_clock::now() >= deadline)
+            {
+                return 0;
+            }
+            cpuRelax();
+        }
+    }
+
+    // Now sleep until an event arrives
+    while (true)
+    {
+        arm();
+        if ((events = consume()) != 0) return events;
+        if (!sleep(remainingMs(timeoutMs, deadline))) return 0;
+        if ((events = consume()) != 0) return events;
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// wait() - Waits for "ready()" to return true
+//
+// Passed: ready     = checks whether the completion has happened (usually by reading a register)
+//         timeoutMs = how long to wait in milliseconds (-1 = forever)
+//
+// Returns: false on timeout
+//
+// Before each sleep, stale events are discarded, the interrupt is re-armed, and ready() is
+// checked one last time.  A completion that happens after that check will wake us up
+//=================================================================================================
+bool CompletionWait::wait(ready_fn ready, int timeoutMs)
+{
+    // If it's already happened, we're done
+    if (ready()) return true;
+
+    auto start    = steady_clock::now();
+    auto deadline = start + milliseconds(timeoutMs < 0 ? 0 : timeoutMs);
+
+    // In spin or hybrid mode, start out by spinning
+    if (mode_ != MODE_BLOCK)
+    {
+        auto spinEnd = start + nanoseconds(spinNs_);
+        while (mode_ == MODE_SPIN || steady_clock::now() < spinEnd)
+        {
+            if (ready()) return true;
+            if (mode_ == MODE_SPIN && timeoutMs >= 0 && steady_clock::now() >= deadline)
+            {
+                return false;
+            }
+            cpuRelax();
+        }
+    }
+
+    // There must be something to sleep on
+    if (fd_ < 0) throwRuntime("CompletionWait: no descriptor");
+
+    // Now sleep until ready() says we're done
+    while (true)
+    {
+        consume();
+        arm();
+        if (ready()) return true;
+        if (!sleep(remainingMs(timeoutMs, deadline))) return ready();
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// waitAny() - Sleeps until at least one of the waiters has an event
+//
+// Returns: the index of the first waiter with an event (whose events have been consumed), or
+//          -1 on timeout
+//=================================================================================================
+int CompletionWait::waitAny(vector<CompletionWait*>& waiters, int timeoutMs)
+{
+    vector<pollfd> pfd(waiters.size());
+    auto deadline = steady_clock::now() + milliseconds(timeoutMs < 0 ? 0 : timeoutMs);
+
+    while (true)
+    {
+        // Arm every waiter, and if one already has an event, we're done
+        for (size_t i=0; i<waiters.size(); ++i)
+        {
+            waiters[i]->arm();
+            if (waiters[i]->consume()) return (int)i;
+            pfd[i] = {waiters[i]->fd_, POLLIN, 0};
+        }
+
+        // Sleep until one of them becomes readable
+        int rc = ::poll(pfd.data(), pfd.size(), remainingMs(timeoutMs, deadline));
+        if (rc < 0 && errno != EINTR)
+        {
+            throwRuntime("CompletionWait: poll failed (%s)", strerror(errno));
+        }
+        if (rc == 0) return -1;
+
+        // Find the first one that has an event
+        for (size_t i=0; i<waiters.size(); ++i)
+        {
+            if ((pfd[i].revents & POLLIN) && waiters[i]->consume()) return (int)i;
+        }
+    }
+}
+//=================================================================================================
@@ -0,0 +1,107 @@
+//=================================================================================================
+// CompletionWait.h - Defines a class that waits for an FPGA completion without burning a core
+//
+// A CompletionWait is attached to a file descriptor that becomes readable when the device
+// signals: a UIO device file (/dev/uioN) or any eventfd-style descriptor.  It can wait in one of
+// three ways:
+//
+//    MODE_SPIN   - Spin until the completion arrives.  Lowest latency, costs a whole core
+//    MODE_BLOCK  - Sleep in poll() until the descriptor becomes readable
+//    MODE_HYBRID - Spin for a short while, then sleep.  Fast completions are caught with spin
+//                  latency, and slow ones cost no CPU
+//
+// The caller can also pass a "ready" function that checks a completion register.  It's checked
+// while spinning, and again after the interrupt is re-armed and before sleeping, so a completion
+// that arrives in between is never missed.
+//
+// waitAny() sleeps on many CompletionWaits at once, so one thread can service several cards.
+//=================================================================================================
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <functional>
+
+class CompletionWait
+{
+public:
+
+    // The ways we can wait
+    enum mode_t {MODE_SPIN, MODE_BLOCK, MODE_HYBRID};
+
+    // The kinds of descriptor we can wait on.  They differ in how events are read and re-armed
+    enum kind_t {KIND_UIO, KIND_EVENTFD};
+
+    // Returns true when the awaited completion has happened
+    typedef std::function<bool()> ready_fn;
+
+    // Constructor
+    CompletionWait() {};
+
+    // No copy or assignment constructor - objects of this class can't be copied
+    CompletionWait (const CompletionWait&) = delete;
+    CompletionWait& operator= (const CompletionWait&) = delete;
+
+    // Destructor - Closes the descriptor if we opened it
+    ~CompletionWait() {close();}
+
+    // Opens a UIO device file such as /dev/uio0
+    void    open(std::string filename);
+
+    // Attaches to a descriptor the caller owns (an eventfd, for instance)
+    void    attach(int fd, kind_t kind = KIND_EVENTFD);
+
+    // Closes the descriptor if we opened it, and detaches from it
+    void    close();
+
+    // Selects how wait() waits.  In MODE_HYBRID, wait() spins for "spinNs" nanoseconds
+    void    setMode(mode_t mode, uint32_t spinNs = 20000);
+
+    // Waits for an event.  Returns the number of events that arrived, or 0 on timeout.  A
+    // timeout of -1 means "wait forever"
+    uint64_t wait(int timeoutMs = -1);
+
+    // Waits for "ready()" to return true, sleeping on the descriptor in between checks.  Returns
+    // false on timeout
+    bool    wait(ready_fn ready, int timeoutMs = -1);
+
+    // Sleeps until at least one of the waiters has an event.  Returns the index of the first one
+    // that does, or -1 on timeout
+    static int waitAny(std::vector<CompletionWait*>& waiters, int timeoutMs = -1);
+
+    // Returns the descriptor we're attached to
+    int     fd() {return fd_;}
+
+    // Returns the number of times wait() went to sleep, and the number of events consumed
+    uint64_t sleeps() {return sleeps_;}
+    uint64_t events() {return events_;}
+
+protected:
+
+    // Re-enables the interrupt, for descriptors that need it
+    void    arm();
+
+    // Reads and returns the pending event count without blocking (0 = none pending)
+    uint64_t consume();
+
+    // Sleeps until the descriptor is readable.  Returns false on timeout
+    bool    sleep(int timeoutMs);
+
+    // The descriptor, and whether we're responsible for closing it
+    int     fd_ = -1;
+    bool    owned_ = false;
+    kind_t  kind_ = KIND_EVENTFD;
+
+    // For a UIO device, the interrupt total as of the last consume(), and whether we've read it
+    // yet.  Until we have, we don't know how many interrupts happened before we opened it
+    uint32_t uioCount_ = 0;
+    bool     uioValid_ = false;
+
+    // How wait() waits
+    mode_t   mode_ = MODE_HYBRID;
+    uint32_t spinNs_ = 20000;
+
+    // Statistics
+    uint64_t sleeps_ = 0;
+    uint64_t events_ = 0;
+};
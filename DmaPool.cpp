@@ -0,0 +1,234 @@
+//=================================================================================================
+// DmaPool.cpp - Implements a lock-free allocator for DMA buffers in reserved physical memory
+//=================================================================================================
+#include <stdio.h>
+#include <stdarg.h>
+#include <algorithm>
+#include <stdexcept>
+#include "DmaPool.h"
+#include "Util.h"
+using namespace std;
+
+
+//=================================================================================================
+// alignUp() - Rounds a value up to the next multiple of "alignment" (a power of 2)
+//=================================================================================================
+static inline uint64_t alignUp(uint64_t value, uint64_t alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// init() - Carves every region mapped by a PhysMem into buffers
+//=================================================================================================
+void DmaPool::init(PhysMem& mem, vector<class_t> classes, size_t alignment)
+{
+    init(mem.regions(), classes, alignment);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// init() - Carves a single mapped region into buffers
+//=================================================================================================
+void DmaPool::init(uint8_t* userspaceAddr, uint64_t physAddr, size_t size,
+                   vector<class_t> classes, size_t alignment)
+{
+    init({{userspaceAddr, physAddr, size, '$'}}, classes, alignment);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// init() - Carves a set of mapped regions into buffers
+//
+// Passed: regions   = the mapped regions to carve up
+//         classes   = the size classes to create
+//         alignment = the alignment of every buffer (a power of 2)
+//
+// The buffers of each class are dealt out to the regions round-robin, so that every class is
+// spread evenly across the regions (and therefore across NUMA nodes, when there is a region
+// on each node).  If a region fills up, its share goes to the next region with room.
+//
+// Alignment is applied to physical addresses, since that's what the FPGA cares about
+//=================================================================================================
+void DmaPool::init(vector<PhysMem::region_t> regions, vector<class_t> classes, size_t alignment)
+{
+    // Throw away any size classes we already have
+    class_.clear();
+
+    // Check the caller's parameters
+    if (regions.empty()) throwRuntime("DmaPool: no regions");
+    if (alignment == 0 || (alignment & (alignment - 1))) throwRuntime("DmaPool: bad alignment");
+    for (auto& region : regions)
+    {
+        if (region.userspaceAddr == nullptr) throwRuntime("DmaPool: region is not mapped");
+    }
+
+    // This is the physical address in each region where the next buffer will go
+    vector<uint64_t> cursor;
+    for (auto& region : regions) cursor.push_back(alignUp(region.physAddr, alignment));
+
+    // Lay the classes out from largest to smallest, so small buffers fill in the leftovers
+    sort(classes.begin(), classes.end(), [](const class_t& a, const class_t& b)
+    {
+        return a.size > b.size;
+    });
+
+    // The region the next buffer should come from
+    size_t nextRegion = 0;
+
+    for (auto& c : classes)
+    {
+        // A class must contain something
+        if (c.size == 0 || c.count == 0 || c.count >= NIL) throwRuntime("DmaPool: bad size class");
+
+        // Create the bookkeeping for this class
+        auto sc = unique_ptr<sizeClass_t>(new sizeClass_t);
+        sc->size  = c.size;
+        sc->count = c.count;
+        sc->userspaceAddr.reset(new uint8_t*[c.count]);
+        sc->physAddr.reset(new uint64_t[c.count]);
+
+        // Each buffer takes up this much room in a region
+        uint64_t stride = alignUp(c.size, alignment);
+
+        for (uint32_t i=0; i<c.count; ++i)
+        {
+            // Find a region with room for this buffer, starting with the next one in turn
+            size_t tries;
+            for (tries = 0; tries < regions.size(); ++tries)
+            {
+                auto& region = regions[nextRegion];
+                if (cursor[nextRegion] + stride <= region.physAddr + region.size) break;
+                nextRegion = (nextRegion + 1) % regions.size();
+            }
+
+            // If no region has room, the caller asked for too much
+            if (tries == regions.size())
+            {
+                class_.clear();
+                throwRuntime("DmaPool: size classes don't fit (0x%zx x %u)", c.size, c.count);
+            }
+
+            // Carve the buffer out of that region
+            auto& region = regions[nextRegion];
+            sc->physAddr[i]      = cursor[nextRegion];
+            sc->userspaceAddr[i] = region.userspaceAddr + (cursor[nextRegion] - region.physAddr);
+            cursor[nextRegion]  += stride;
+
+            // The next buffer comes from the next region
+            nextRegion = (nextRegion + 1) % regions.size();
+        }
+
+        // Initially, every buffer is on the free-stack, with buffer 0 on top
+        sc->next.reset(new atomic<uint32_t>[c.count]);
+        for (uint32_t i=0; i<c.count; ++i) sc->next[i] = (i + 1 < c.count) ? i + 1 : NIL;
+        sc->head = 0;
+
+        class_.push_back(move(sc));
+    }
+
+    // Keep the classes sorted from smallest to largest, so alloc() finds the best fit first
+    reverse(class_.begin(), class_.end());
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// pop() - Pops a buffer index from the free-stack of a size class
+//=================================================================================================
+uint32_t DmaPool::pop(sizeClass_t& sc)
+{
+    uint64_t head = sc.head.load(memory_order_acquire);
+
+    while (true)
+    {
+        uint32_t index = (uint32_t)head;
+
+        // If the stack is empty, tell the caller
+        if (index == NIL) return NIL;
+
+        // The new top of the stack is the buffer below this one.  Popping doesn't change the tag
+        uint64_t newHead = (head & 0xFFFFFFFF00000000ULL) | sc.next[index].load(memory_order_relaxed);
+
+        // Try to swap in the new head.  If someone else got there first, "head" is reloaded
+        if (sc.head.compare_exchange_weak(head, newHead, memory_order_acquire,
+                                          memory_order_acquire)) return index;
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// push() - Pushes a buffer index onto the free-stack of a size class
+//=================================================================================================
+void DmaPool::push(sizeClass_t& sc, uint32_t index)
+{
+    uint64_t head = sc.head.load(memory_order_relaxed);
+
+    while (true)
+    {
+        // This buffer goes on top of the current top-of-stack
+        sc.next[index].store((uint32_t)head, memory_order_relaxed);
+
+        // Bump the tag so that a stale pop() can't succeed
+        uint64_t newHead = ((head + 0x100000000ULL) & 0xFFFFFFFF00000000ULL) | index;
+
+        // Try to swap in the new head.  If someone else got there first, "head" is reloaded
+        if (sc.head.compare_exchange_weak(head, newHead, memory_order_release,
+                                          memory_order_relaxed)) return;
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// alloc() - Allocates a buffer from the smallest size class that can hold "bytes" bytes and
+//           has a buffer free
+//
+// Returns: true if a buffer was allocated, false if none was available
+//=================================================================================================
+bool DmaPool::alloc(size_t bytes, buffer_t& buffer)
+{
+    for (uint32_t c=0; c<class_.size(); ++c)
+    {
+        auto& sc = *class_[c];
+
+        // If buffers in this class are too small, try the next class
+        if (sc.size < bytes) continue;
+
+        // Try to pop a buffer from this class
+        uint32_t index = pop(sc);
+        if (index == NIL) continue;
+
+        // Fill in the caller's buffer descriptor
+        buffer.ptr       = sc.userspaceAddr[index];
+        buffer.physAddr  = sc.physAddr[index];
+        buffer.size      = sc.size;
+        buffer.sizeClass = c;
+        buffer.index     = index;
+        return true;
+    }
+
+    // If we get here, there's no buffer big enough available
+    return false;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// free() - Returns a buffer to the pool
+//=================================================================================================
+void DmaPool::free(const buffer_t& buffer)
+{
+    if (buffer.sizeClass >= class_.size() || buffer.index >= class_[buffer.sizeClass]->count)
+    {
+        throwRuntime("DmaPool: freeing invalid buffer %u:%u", buffer.sizeClass, buffer.index);
+    }
+
+    push(*class_[buffer.sizeClass], buffer.index);
+}
+//=================================================================================================
@@ -0,0 +1,93 @@
+//=================================================================================================
+// DmaPool.h - Defines a lock-free allocator that carves a reserved physical memory region
+//             into aligned DMA buffers
+//
+// The region (or set of regions) is divided into size classes, each of which holds a fixed
+// number of equal-sized buffers.  When there are several regions, the buffers of each class are
+// dealt out to the regions round-robin.  Each class keeps its free buffers on a lock-free stack,
+// so alloc() and free() are constant-time and safe to call from any number of threads at once.
+//=================================================================================================
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include "PhysMem.h"
+
+class DmaPool
+{
+public:
+
+    // Describes one size class: "count" buffers of "size" bytes each
+    struct class_t {size_t size; uint32_t count;};
+
+    // Describes an allocated DMA buffer
+    struct buffer_t
+    {
+        uint8_t* ptr;           // The user-space address of the buffer
+        uint64_t physAddr;      // The physical address of the buffer, for handing to the FPGA
+        size_t   size;          // The size of the buffer (the size of its class)
+        uint32_t sizeClass;     // Which size class the buffer came from
+        uint32_t index;         // Which buffer within that size class
+    };
+
+    // Constructor
+    DmaPool() {};
+
+    // No copy or assignment constructor - objects of this class can't be copied
+    DmaPool (const DmaPool&) = delete;
+    DmaPool& operator= (const DmaPool&) = delete;
+
+    // Carves every region mapped by a PhysMem into buffers.  Every buffer is aligned to
+    // "alignment" bytes, which must be a power of 2
+    void    init(PhysMem& mem, std::vector<class_t> classes, size_t alignment = 4096);
+
+    // Carves an arbitrary mapped region into buffers
+    void    init(uint8_t* userspaceAddr, uint64_t physAddr, size_t size,
+                 std::vector<class_t> classes, size_t alignment = 4096);
+
+    // Carves a set of mapped regions into buffers
+    void    init(std::vector<PhysMem::region_t> regions, std::vector<class_t> classes,
+                 size_t alignment = 4096);
+
+    // Allocates a buffer of at least "bytes" bytes from the smallest class that has one free.
+    // Returns false if no buffer is available
+    bool    alloc(size_t bytes, buffer_t& buffer);
+
+    // Returns a buffer to the pool
+    void    free(const buffer_t& buffer);
+
+    // Returns the number of size classes
+    int     classCount() {return (int)class_.size();}
+
+protected:
+
+    // Marks the end of a free-list
+    static const uint32_t NIL = 0xFFFFFFFF;
+
+    // The bookkeeping for one size class
+    struct sizeClass_t
+    {
+        size_t   size;                              // The size of each buffer in this class
+        uint32_t count;                             // The number of buffers in this class
+        std::unique_ptr<uint8_t*[]> userspaceAddr;  // User-space address of each buffer
+        std::unique_ptr<uint64_t[]> physAddr;       // Physical address of each buffer
+
+        // Top of the free-stack: the low 32 bits are a buffer index, the high 32 bits are a
+        // tag that changes on every push, to defeat the ABA problem
+        alignas(64) std::atomic<uint64_t> head;
+
+        // next[i] is the buffer below buffer "i" on the free-stack
+        std::unique_ptr<std::atomic<uint32_t>[]> next;
+    };
+
+    // Pops a buffer index from a class's free-stack, or returns NIL if the stack is empty
+    uint32_t pop(sizeClass_t& sc);
+
+    // Pushes a buffer index onto a class's free-stack
+    void     push(sizeClass_t& sc, uint32_t index);
+
+    // The size classes, sorted from smallest to largest
+    std::vector<std::unique_ptr<sizeClass_t>> class_;
+};
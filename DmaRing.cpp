@@ -0,0 +1,204 @@
+//=================================================================================================
+// DmaRing.cpp - Implements a lock-free ring of FPGA-to-host records in reserved physical memory
+//=================================================================================================
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdexcept>
+#include "DmaRing.h"
+#include "Util.h"
+using namespace std;
+
+
+//=================================================================================================
+// init() - Sets up a ring inside of the first region of a mapped PhysMem
+//=================================================================================================
+void DmaRing::init(PhysMem& mem, size_t offset, size_t recordSize, uint32_t recordCount,
+                   FpgaReg* writePtrReg, FpgaReg* readPtrReg)
+{
+    // Make sure the ring fits in the region
+    if (offset + recordSize * recordCount > mem.size())
+    {
+        throwRuntime("DmaRing: ring doesn't fit in a region of 0x%zx bytes", mem.size());
+    }
+
+    init(mem.bptr() + offset, mem.physAddr() + offset, recordSize, recordCount,
+         writePtrReg, readPtrReg, mem.cached());
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// init() - Sets up a ring
+//
+// Passed: userspaceAddr = where the ring is mapped in user-space
+//         physAddr      = the physical address of the ring
+//         recordSize    = the size of each record, in bytes
+//         recordCount   = the number of records in the ring
+//         writePtrReg   = the register where the FPGA publishes its write pointer
+//         readPtrReg    = the register where the host publishes its read pointer
+//         cached        = true if the ring is mapped cached
+//
+// The read pointer register is written with 0 to tell the FPGA the ring is empty
+//=================================================================================================
+void DmaRing::init(uint8_t* userspaceAddr, uint64_t physAddr, size_t recordSize,
+                   uint32_t recordCount, FpgaReg* writePtrReg, FpgaReg* readPtrReg,
+                   bool cached)
+{
+    // Check the caller's parameters
+    if (userspaceAddr == nullptr) throwRuntime("DmaRing: ring is not mapped");
+    if (recordSize == 0 || recordCount < 2) throwRuntime("DmaRing: bad ring geometry");
+    if (writePtrReg == nullptr || readPtrReg == nullptr) throwRuntime("DmaRing: missing register");
+
+    // Save the geometry of the ring and the registers that control it
+    userspaceAddr_ = userspaceAddr;
+    physAddr_      = physAddr;
+    recordSize_    = recordSize;
+    recordCount_   = recordCount;
+    writePtrReg_   = writePtrReg;
+    readPtrReg_    = readPtrReg;
+    cached_        = cached;
+
+    // The ring starts out empty
+    writeSeq_   = 0;
+    claimSeq_   = 0;
+    readSeq_    = 0;
+    refreshing_ = false;
+    advancing_  = false;
+    released_.reset(new atomic<uint8_t>[recordCount]);
+    for (uint32_t i=0; i<recordCount; ++i) released_[i] = 0;
+
+    // Tell the FPGA where our read pointer is
+    readPtrReg_->write(0);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// refresh() - Reads the write pointer register and converts it into a free-running sequence
+//             number
+//
+// Returns: false if another thread was already refreshing
+//
+// The FPGA's write pointer can never be more than recordCount-1 records ahead of readSeq_, which
+// is never ahead of writeSeq_, so the distance the write pointer has moved since the last
+// refresh is always less than recordCount and can be computed modulo recordCount
+//=================================================================================================
+bool DmaRing::refresh()
+{
+    // If another thread is already reading the register, let it
+    if (refreshing_.exchange(true, memory_order_acquire)) return false;
+
+    // Read the FPGA's write pointer.  It changes behind our back, so the shadow is no help
+    uint32_t hwWrite = writePtrReg_->fetch();
+
+    // Don't let any reads of the records be hoisted above the register read
+    atomic_thread_fence(memory_order_acquire);
+
+    // Compute how far the write pointer has moved, and update the sequence number
+    uint64_t oldSeq = writeSeq_.load(memory_order_relaxed);
+    uint32_t oldIdx = (uint32_t)(oldSeq % recordCount_);
+    uint32_t delta  = (hwWrite % recordCount_ + recordCount_ - oldIdx) % recordCount_;
+    writeSeq_.store(oldSeq + delta, memory_order_release);
+
+    // We're done refreshing
+    refreshing_.store(false, memory_order_release);
+    return true;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// acquire() - Claims a batch of up to "maxRecords" available records
+//
+// The batch never wraps around the end of the ring, so the records in it are contiguous
+//=================================================================================================
+DmaRing::span_t DmaRing::acquire(uint32_t maxRecords)
+{
+    bool refreshed = false;
+
+    while (true)
+    {
+        uint64_t claim = claimSeq_.load(memory_order_acquire);
+        uint64_t write = writeSeq_.load(memory_order_acquire);
+
+        // If every record we know about has been claimed, ask the FPGA for more.  If we already
+        // asked (or another thread is asking), there's nothing for us
+        if (claim >= write)
+        {
+            if (refreshed || !refresh()) return {nullptr, 0, claim};
+            refreshed = true;
+            continue;
+        }
+
+        // Claim as many as we can, without wrapping around the end of the ring
+        uint64_t available = write - claim;
+        uint32_t index     = (uint32_t)(claim % recordCount_);
+        uint32_t count     = (uint32_t)min<uint64_t>(available, maxRecords);
+        if (index + count > recordCount_) count = recordCount_ - index;
+
+        // Try to claim them.  If another consumer got there first, try again
+        if (!claimSeq_.compare_exchange_weak(claim, claim + count, memory_order_acq_rel)) continue;
+
+        // The records are ours.  If the ring is cached, make sure we don't see stale data
+        uint8_t* data = userspaceAddr_ + index * recordSize_;
+        if (cached_) PhysMem::invalidate(data, count * recordSize_);
+        return {data, count, claim};
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// release() - Hands the records in a span back to the FPGA
+//
+// Consumers can release their spans in any order.  The read pointer only moves past records
+// once every record before them has been released too.
+//=================================================================================================
+void DmaRing::release(const span_t& span)
+{
+    // Mark each record in the span as released
+    for (uint32_t i=0; i<span.count; ++i)
+    {
+        released_[(span.sequence + i) % recordCount_].store(1, memory_order_release);
+    }
+
+    // And move the read pointer as far as we can
+    advance();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// advance() - Moves readSeq_ past every contiguously released record, and tells the FPGA
+//=================================================================================================
+void DmaRing::advance()
+{
+    while (true)
+    {
+        // If another thread is already advancing the read pointer, let it
+        if (advancing_.exchange(true, memory_order_acquire)) return;
+
+        // Walk past every released record
+        uint64_t read  = readSeq_.load(memory_order_relaxed);
+        uint64_t start = read;
+        while (released_[read % recordCount_].load(memory_order_acquire))
+        {
+            released_[read % recordCount_].store(0, memory_order_relaxed);
+            ++read;
+        }
+
+        // If we moved, tell the FPGA
+        if (read != start)
+        {
+            readSeq_.store(read, memory_order_release);
+            readPtrReg_->write((uint32_t)(read % recordCount_));
+        }
+
+        // We're done advancing
+        advancing_.store(false, memory_order_release);
+
+        // If a record was released while we held the flag, we may have missed it, so go again
+        if (!released_[read % recordCount_].load(memory_order_acquire)) return;
+    }
+}
+//=================================================================================================
@@ -0,0 +1,106 @@
+//=================================================================================================
+// DmaRing.h - Defines a lock-free ring of FPGA-to-host records in reserved physical memory
+//
+// The FPGA writes fixed-size records into a ring in the memmap= region, and publishes the index
+// of the next record it will write through a "write pointer" register.  The host consumes the
+// records in place and publishes the index of the next record it will consume through a "read
+// pointer" register.  The ring is full when the write pointer is one record behind the read
+// pointer, so it holds at most recordCount-1 records.
+//
+// Any number of consumer threads can call acquire() and release() concurrently.  Consumers are
+// handed contiguous batches of records (spans) that point directly into the mapped ring.  The
+// write pointer register is only read when the records already known to be available have all
+// been handed out, so a consumer pays for one register read per batch rather than per record.
+//
+// If the ring is in cached memory, acquire() invalidates each batch before handing it out.
+//=================================================================================================
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <memory>
+#include "PhysMem.h"
+#include "FpgaReg.h"
+
+class DmaRing
+{
+public:
+
+    // A batch of records handed to a consumer.  The records are contiguous in memory
+    struct span_t
+    {
+        uint8_t* data;          // Points to the first record, in the mapped ring
+        uint32_t count;         // The number of records in the batch. 0 = nothing was available
+        uint64_t sequence;      // The sequence number of the first record since init()
+    };
+
+    // Constructor
+    DmaRing() {};
+
+    // No copy or assignment constructor - objects of this class can't be copied
+    DmaRing (const DmaRing&) = delete;
+    DmaRing& operator= (const DmaRing&) = delete;
+
+    // Sets up a ring at "offset" bytes into the first region of a mapped PhysMem
+    void    init(PhysMem& mem, size_t offset, size_t recordSize, uint32_t recordCount,
+                 FpgaReg* writePtrReg, FpgaReg* readPtrReg);
+
+    // Sets up a ring in an arbitrary mapped region
+    void    init(uint8_t* userspaceAddr, uint64_t physAddr, size_t recordSize,
+                 uint32_t recordCount, FpgaReg* writePtrReg, FpgaReg* readPtrReg,
+                 bool cached = false);
+
+    // Claims up to "maxRecords" of the available records.  Returns a span with a count of 0 if
+    // there are no records available
+    span_t  acquire(uint32_t maxRecords);
+
+    // Hands the records in a span back to the FPGA
+    void    release(const span_t& span);
+
+    // Returns the physical address of the ring, for programming into the FPGA
+    uint64_t physAddr() {return physAddr_;}
+
+    // Returns the size of each record and the number of records in the ring
+    size_t   recordSize()  {return recordSize_;}
+    uint32_t recordCount() {return recordCount_;}
+
+protected:
+
+    // Reads the write pointer register, and updates writeSeq_.  Returns false if another
+    // thread was already doing that
+    bool    refresh();
+
+    // Advances the read pointer past every released record, and tells the FPGA
+    void    advance();
+
+    // The ring, in user-space and physical address space
+    uint8_t*  userspaceAddr_ = nullptr;
+    uint64_t  physAddr_      = 0;
+
+    // The geometry of the ring
+    size_t    recordSize_    = 0;
+    uint32_t  recordCount_   = 0;
+
+    // True if the ring is in cached memory
+    bool      cached_        = false;
+
+    // The registers through which the FPGA and host exchange pointers
+    FpgaReg*  writePtrReg_   = nullptr;
+    FpgaReg*  readPtrReg_    = nullptr;
+
+    // Free-running sequence numbers:
+    //    writeSeq_ = the number of records the FPGA has written, as of the last refresh()
+    //    claimSeq_ = the number of records that have been handed to consumers
+    //    readSeq_  = the number of records that have been released back to the FPGA
+    alignas(64) std::atomic<uint64_t> writeSeq_;
+    alignas(64) std::atomic<uint64_t> claimSeq_;
+    alignas(64) std::atomic<uint64_t> readSeq_;
+
+    // Only one thread at a time reads the write pointer register, or writes the read pointer
+    alignas(64) std::atomic<bool> refreshing_;
+    alignas(64) std::atomic<bool> advancing_;
+
+    // released_[i] is true when record "i" has been released but the read pointer hasn't
+    // moved past it yet
+    std::unique_ptr<std::atomic<uint8_t>[]> released_;
+};
@@ -7,48 +7,174 @@
 #include <vector>
 #include <cstring>
 #include "FpgaReg.h"
+#include "MmioCopy.h"
+#include "Util.h"
 using namespace std;
 
 // This is the userspace base address where AXI registers are mapped to
 uint8_t* FpgaReg::userspaceBaseAddress_;
 
-// This maps a REG_xxxx constant to an AXI address
-map<fpgareg_t, int32_t> FpgaReg::regMap_;
+// This maps a REG_xxxx constant to an AXI address.  It starts out as the compiled-in map
+array<uint32_t, REG_COUNT> FpgaReg::regMap_ = fpgaRegAddr;
 
-// This maps a FLD_xxxx constant to a field-descriptor
-std::map<fpgafld_t, FpgaReg::field_desc_t> FpgaReg::fldMap_;
+// This maps a FLD_xxxx constant to a field-descriptor.  It starts out as the compiled-in map
+array<FpgaReg::field_desc_t, FLD_COUNT> FpgaReg::fldMap_ = fpgaFldInfo;
 
-// Indicates that we don't yet know the AXI address of a register
-static const uint32_t UNMAPPED = 0xFFFFFFFF;
+// This maps a REG_xxxx constant to its access policy.  It starts out as the compiled-in map
+array<fpgapolicy_t, REG_COUNT> FpgaReg::policyMap_ = fpgaRegPolicy;
 
+// The shadowed value of every register, and whether it's valid.  Nothing is known yet
+array<uint32_t, REG_COUNT> FpgaReg::shadow_;
+array<bool, REG_COUNT>     FpgaReg::shadowValid_;
+
+// Every register and field by name, and the index that finds them.  They start out describing
+// the compiled-in map
+vector<FpgaReg::named_t> FpgaReg::named_     = FpgaReg::compiledNames();
+PerfectHash              FpgaReg::nameIndex_ = FpgaReg::makeIndex(FpgaReg::named_);
+
+
+
+//=================================================================================================
+// setUserspaceAddress() - Sets the base address (in user-space) where all AXI registers are 
+//                         mapped to.
+//=================================================================================================
+void FpgaReg::setUserspaceAddr(uint8_t* userspaceAddress)
+{    
+    userspaceBaseAddress_= userspaceAddress;
+}
+//=================================================================================================
 
 
 //=================================================================================================
-// throw_runtime() - Throws a std::runtime_error exception
+// invalidateShadow() - Forgets every shadowed register value
+//
+// A "wo" register keeps its shadow: it's the only record of what was written to it
 //=================================================================================================
-static void throw_runtime(const char* fmt, ...)
+void FpgaReg::invalidateShadow()
 {
-    char message[1024];
-    va_list ap;
+    shadowValid_.fill(false);
+}
+//=================================================================================================
 
-    va_start(ap, fmt);
-    vsprintf(message, fmt, ap);
-    va_end(ap);
 
-    throw runtime_error(message);
+//=================================================================================================
+// compiledNames() - Returns the descriptors of every register and field in the compiled-in map
+//=================================================================================================
+vector<FpgaReg::named_t> FpgaReg::compiledNames()
+{
+    vector<named_t> result;
+
+    for (int i=0; i<REG_COUNT; ++i)
+    {
+        result.push_back({fpgaRegName[i], false, fpgaRegAddr[i], 0xFFFFFFFF, 0, 32,
+                          fpgaRegPolicy[i], i});
+    }
+
+    for (int i=0; i<FLD_COUNT; ++i)
+    {
+        auto& fd = fpgaFldInfo[i];
+        result.push_back({fpgaFldName[i], true, fd.axiAddr, fd.mask, fd.bitPos, fd.width,
+                          fpgaRegPolicy[fd.reg], fd.reg});
+    }
+
+    return result;
 }
 //=================================================================================================
 
 
+//=================================================================================================
+// makeIndex() - Builds the index that finds each descriptor by name
+//
+// On return, the names in the descriptors no longer depend on whatever they pointed to before
+//=================================================================================================
+PerfectHash FpgaReg::makeIndex(vector<named_t>& named)
+{
+    vector<string_view> names(named.size());
+    PerfectHash         index;
+
+    for (size_t i=0; i<named.size(); ++i) names[i] = named[i].name;
+    index.build(names);
+    for (size_t i=0; i<named.size(); ++i) named[i].name = index.key(i);
+    return index;
+}
+//=================================================================================================
 
 
 //=================================================================================================
-// setUserspaceAddress() - Sets the base address (in user-space) where all AXI registers are 
-//                         mapped to.
+// lookup() - Looks up a register or field by name
+//
+// Returns: the descriptor, or nullptr if there's no such name
 //=================================================================================================
-void FpgaReg::setUserspaceAddr(uint8_t* userspaceAddress)
-{    
-    userspaceBaseAddress_= userspaceAddress;
+const FpgaReg::named_t* FpgaReg::lookup(string_view name)
+{
+    int index = nameIndex_.find(name);
+    return (index < 0) ? nullptr : &named_[index];
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// readByName() - Reads a register or field by name
+//
+// A register in the compiled-in map is read through an FpgaReg, so its access policy and shadow
+// work as usual.  Any other register is read straight from the FPGA
+//=================================================================================================
+uint32_t FpgaReg::readByName(string_view name)
+{
+    uint32_t value;
+
+    // Find out what we're reading
+    const named_t* n = lookup(name);
+    if (n == nullptr) throwRuntime("Unknown register or field %s", string(name).c_str());
+
+    // Fetch the register
+    if (n->reg >= 0)
+        value = FpgaReg((fpgareg_t)n->reg).read();
+    else if (n->policy == POLICY_WO)
+        throwRuntime("%s is write-only", string(name).c_str());
+    else
+        value = Mmio::read32(userspaceBaseAddress_ + n->axiAddr);
+
+    // And extract the bits we're interested in
+    return (value & n->mask) >> n->bitPos;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// writeByName() - Writes a register or field by name
+//
+// Writing a field is a read-modify-write of its register
+//=================================================================================================
+void FpgaReg::writeByName(string_view name, uint32_t value)
+{
+    // Find out what we're writing
+    const named_t* n = lookup(name);
+    if (n == nullptr) throwRuntime("Unknown register or field %s", string(name).c_str());
+
+    // A register in the compiled-in map gets its policy enforced and its shadow kept up to date
+    if (n->reg >= 0)
+    {
+        FpgaReg reg((fpgareg_t)n->reg);
+        if (n->isField) reg.read();
+        reg.regValue_ = (reg.regValue_ & ~n->mask) | ((value << n->bitPos) & n->mask);
+        reg.flush();
+        return;
+    }
+
+    // Any other register has no shadow, so a field of a write-only register can't be changed
+    if (n->policy == POLICY_RO || n->policy == POLICY_STATIC)
+    {
+        throwRuntime("%s is read-only", string(name).c_str());
+    }
+    if (n->isField && n->policy == POLICY_WO)
+    {
+        throwRuntime("%s is write-only", string(name).c_str());
+    }
+
+    uint8_t* addr    = userspaceBaseAddress_ + n->axiAddr;
+    uint32_t current = n->isField ? Mmio::read32(addr) : 0;
+    Mmio::write32(addr, (current & ~n->mask) | ((value << n->bitPos) & n->mask));
 }
 //=================================================================================================
 
@@ -58,10 +184,6 @@ void FpgaReg::setUserspaceAddr(uint8_t* userspaceAddress)
 //=================================================================================================
 FpgaReg::FpgaReg(fpgareg_t regIndex)
 {
-    // If the registerMap has entries, look up this register-index, otherwise, mark
-    // this register as unmapped.
-    axiAddress_ = regMap_.empty() ? UNMAPPED : regMap_[regIndex];
-    
     // Save the index of this register for posterity
     regIndex_   = regIndex;
 
@@ -76,11 +198,8 @@ FpgaReg::FpgaReg(fpgareg_t regIndex)
 //=================================================================================================
 uint32_t FpgaReg::axiAddress()
 {
-    // If we don't have an address yet, look it up
-    if (axiAddress_ == UNMAPPED) axiAddress_ = regMap_[regIndex_];
-
-    // Hand the caller the AXI address of this register
-    return axiAddress_;
+    // Look it up every time, in case readDefinitions() has changed the register map
+    return regMap_[regIndex_];
 }
 //=================================================================================================
 
@@ -90,8 +209,36 @@ uint32_t FpgaReg::axiAddress()
 //=================================================================================================
 uint32_t FpgaReg::read()
 {
+    fpgapolicy_t policy = policyMap_[regIndex_];
+
+    // If we know the value and the policy says it can't have changed, don't ask the FPGA
+    if (shadowValid_[regIndex_] || policy == POLICY_WO) return regValue_ = shadow_[regIndex_];
+
+    // Otherwise, ask the FPGA
+    return fetch();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// fetch() - Reads this AXI register from the FPGA, whether or not its value is shadowed
+//=================================================================================================
+uint32_t FpgaReg::fetch()
+{
+    fpgapolicy_t policy = policyMap_[regIndex_];
+
+    // A write-only register has nothing to read
+    if (policy == POLICY_WO) throwRuntime("Register %s is write-only", fpgaRegName[regIndex_]);
+
     // Read the AXI register from the FPGA and save its value
-    regValue_ =  *(uint32_t*)(userspaceBaseAddress_ + axiAddress()); 
+    regValue_ = Mmio::read32(userspaceBaseAddress_ + axiAddress());
+
+    // If the FPGA can't change this register behind our back, remember its value
+    if (policy == POLICY_RW || policy == POLICY_STATIC)
+    {
+        shadow_[regIndex_]      = regValue_;
+        shadowValid_[regIndex_] = true;
+    }
 
     // Hand the saved value to the caller
     return regValue_;  
@@ -99,6 +246,59 @@ uint32_t FpgaReg::read()
 //=================================================================================================
 
 
+//=================================================================================================
+// readMany() - Reads a list of AXI registers via the PCIe bus in a single pass
+//
+// Passed: reg      = array of pointers to the registers to read
+//         count    = the number of registers in the array
+//         coalesce = if true, registers that share a 64-byte block are fetched with a single
+//                    wide read.  Don't use this if any register in the block has side-effects
+//                    when it's read
+//
+// Registers that read() would answer from the shadow are answered from the shadow here too, and
+// only the rest are fetched from the FPGA
+//=================================================================================================
+void FpgaReg::readMany(FpgaReg* reg[], size_t count, bool coalesce)
+{
+    vector<uint32_t> offset, value;
+    vector<FpgaReg*> fetch;
+
+    // Answer what we can from the shadow, and fetch the AXI address of everything else
+    for (size_t i=0; i<count; ++i)
+    {
+        FpgaReg* r = reg[i];
+        if (shadowValid_[r->regIndex_] || r->policy() == POLICY_WO)
+        {
+            r->regValue_ = shadow_[r->regIndex_];
+            continue;
+        }
+        fetch.push_back(r);
+        offset.push_back(r->axiAddress());
+    }
+
+    // If the shadow answered everything, we're done
+    if (fetch.empty()) return;
+
+    // Read all of the remaining registers at once
+    value.resize(fetch.size());
+    MmioCopy::gather(value.data(), userspaceBaseAddress_, offset.data(), fetch.size(), coalesce);
+
+    // And save the value of each register, shadowing the ones that the policy allows
+    for (size_t i=0; i<fetch.size(); ++i)
+    {
+        FpgaReg*     r      = fetch[i];
+        fpgapolicy_t policy = r->policy();
+        r->regValue_ = value[i];
+        if (policy == POLICY_RW || policy == POLICY_STATIC)
+        {
+            shadow_[r->regIndex_]      = value[i];
+            shadowValid_[r->regIndex_] = true;
+        }
+    }
+}
+//=================================================================================================
+
+
 
 //=================================================================================================
 // write() - Writes a value to the AXI register via the PCIe bus
@@ -109,7 +309,7 @@ void FpgaReg::write(uint32_t value)
     regValue_ = value;
 
     // Write this value to the AXI register in the FPGA
-    *(uint32_t*)(userspaceBaseAddress_ + axiAddress()) = regValue_; 
+    writeToFpga(regValue_);
 }
 //=================================================================================================
 
@@ -120,45 +320,103 @@ void FpgaReg::write(uint32_t value)
 void FpgaReg::flush()
 {
     // Write this value to the AXI register in the FPGA
-    *(uint32_t*)(userspaceBaseAddress_ + axiAddress()) = regValue_; 
+    writeToFpga(regValue_);
 }
 //=================================================================================================
 
 
+//=================================================================================================
+// writeToFpga() - Writes a value to the AXI register, and shadows it if the policy allows
+//
+// Passed: value = the value to write
+//         batch = if not null, the write is posted as part of this batch rather than being
+//                 ordered on its own
+//=================================================================================================
+void FpgaReg::writeToFpga(uint32_t value, MmioBatch* batch)
+{
+    fpgapolicy_t policy = policyMap_[regIndex_];
 
+    // Read-only registers can't be written
+    if (policy == POLICY_RO || policy == POLICY_STATIC)
+    {
+        throwRuntime("Register %s is read-only", fpgaRegName[regIndex_]);
+    }
 
+    // Write this value to the AXI register in the FPGA
+    uint8_t* addr = userspaceBaseAddress_ + axiAddress();
+    if (batch)
+        batch->write32(addr, value);
+    else
+        Mmio::write32(addr, value);
+
+    // If the FPGA can't change this register behind our back, remember what we wrote
+    if (policy == POLICY_RW || policy == POLICY_WO)
+    {
+        shadow_[regIndex_]      = value;
+        shadowValid_[regIndex_] = true;
+    }
+}
+//=================================================================================================
 
-void FpgaReg::setField(fpgafld_t fieldIndex, uint32_t value, bool auto_flush)
-{
-    auto it = fldMap_.find(fieldIndex); 
 
-    // If we can't find this field index, it's a problem
-    if (it == fldMap_.end())
+//=================================================================================================
+// fieldDesc() - Returns the descriptor of a bit-field, after making sure it's in this register
+//=================================================================================================
+const FpgaReg::field_desc_t& FpgaReg::fieldDesc(fpgafld_t fieldIndex)
+{
+    // If this isn't a valid field index, it's a problem
+    if ((uint32_t)fieldIndex >= FLD_COUNT)
     {
-        throw_runtime("Missing AXI field index %u", fieldIndex);
+        throwRuntime("Missing AXI field index %u", fieldIndex);
     }
 
     // Get a convenient reference to the field-descriptor that matches this index
-    auto& fd = it->second;
+    auto& fd = fldMap_[fieldIndex];
 
-    // If the AXI address of the field descriptor doesn't match this register, complain!
-    if (fd.axiAddr != axiAddress())
+    // If the field doesn't belong to this register, complain!
+    if (fd.reg != regIndex_)
     {
-        throw_runtime("Field idx %i: axi address mistmatch", fieldIndex);        
+        throwRuntime("Field idx %i: axi address mismatch", fieldIndex);
     }
 
-    printf("Before: regValue_ = 0x%x\n", regValue_);
-    printf("bitpos=%u  width = %u\n", fd.bitPos, fd.width);
+    return fd;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// setField() - Sets the value of a bit-field in our copy of the register, and optionally writes
+//              the register to the FPGA
+//=================================================================================================
+void FpgaReg::setField(fpgafld_t fieldIndex, uint32_t value, bool auto_flush)
+{
+    // Get a convenient reference to the field-descriptor that matches this index
+    auto& fd = fieldDesc(fieldIndex);
 
-    // Mask off the appropriate bits from our current register value
-    regValue_ &= ~(fd.mask << fd.bitPos);
+    // Mask off the appropriate bits from our current register value.  The mask is already
+    // shifted into position
+    regValue_ &= ~fd.mask;
 
     // And "or in" the value of this bit-field
     regValue_ |= (value << fd.bitPos) & fd.mask;
 
     if (auto_flush) flush();
+}
+//=================================================================================================
 
-    printf("After: regValue_ = 0x%x\n", regValue_);
 
+//=================================================================================================
+// getField() - Fetches the value of a bit-field, optionally reading the register first
+//=================================================================================================
+uint32_t FpgaReg::getField(fpgafld_t fieldIndex, bool auto_read)
+{
+    // Get a convenient reference to the field-descriptor that matches this index
+    auto& fd = fieldDesc(fieldIndex);
+
+    // If we've been asked to, fetch the current value of the register
+    if (auto_read) read();
 
+    // And extract the bit-field from it
+    return (regValue_ & fd.mask) >> fd.bitPos;
 }
+//=================================================================================================
@@ -4,30 +4,16 @@
 //=================================================================================================
 #pragma once
 #include <stdint.h>
-#include <map>
 #include <string>
+#include <string_view>
+#include <array>
+#include <vector>
+#include <functional>
+#include "PerfectHash.h"
+#include "Mmio.h"
 
-
-
-//=================================================================================================
-// The AXI address of every FPGA register in the system
-//=================================================================================================
-enum fpgareg_t
-{
-    REG_PCIPROXY_ADDRH,
-    REG_PCIPROXY_ADDRL,
-    REG_PCIPROXY_DATA,
-    REG_COUNT
-};
-
-enum fpgafld_t
-{
-    FLD_PCIPROXY_ADDRH_top,
-    FLD_PCIPROXY_ADDRH_btm,
-    FLD_PCIPROXY_ADDRH_mid,
-    FLD_COUNT
-};
-//=================================================================================================
+// The fpgareg_t and fpgafld_t constants, and the register map, generated from register.def
+#include "FpgaRegDefs.h"
 
 
 
@@ -35,11 +21,67 @@ class FpgaReg
 {
 public:
 
+    // Describes a register or a bit-field, as looked up by name.  A register is described as a
+    // field that spans all 32 bits.  Like the descriptor itself, the name is only valid until the
+    // next call to readDefinitions()
+    struct named_t
+    {
+        std::string_view name;      // <IP_NAME>_<REG_NAME> or <IP_NAME>_<REG_NAME>_<FIELD_NAME>
+        bool         isField;       // True if this is a bit-field rather than a whole register
+        uint32_t     axiAddr;       // The AXI address of the register
+        uint32_t     mask;          // The bits of the register, already shifted into position
+        uint32_t     bitPos;
+        uint32_t     width;
+        fpgapolicy_t policy;        // The access policy of the register
+        int          reg;           // The register's fpgareg_t, or -1 if it isn't compiled in
+    };
+
     // Set the base address of the PCI region as mapped into user-space
     static void setUserspaceAddr(uint8_t* userspaceAddress);
 
-    // Reads the file that defines the addresses and field info about AXI registers
-    static void readDefinitions(std::string filename);
+    // Reads a file that defines the addresses and field info about AXI registers.  This is
+    // optional: until it's called, the register map that was compiled in is used.  Every
+    // compiled-in register must be defined exactly as it was compiled in (same address, policy,
+    // and fields), since read<REG>(), write<REG>(), and TypedReg resolve them at compile time;
+    // the file may add registers and fields of its own.  Throws on any mismatch.  Unless
+    // "useCache" is false, the result is cached in <filename>.cache, and later calls use the
+    // cache for as long as the file (and every file it includes) is unchanged
+    static void readDefinitions(std::string filename, bool useCache = true);
+
+    // Forgets every shadowed register value, so that the next read of each register goes to the
+    // FPGA.  Call this after the FPGA has been reset or reprogrammed
+    static void invalidateShadow();
+
+    // Looks up a register or field by name, in constant time.  Returns nullptr if there's no
+    // such name.  After readDefinitions(), every name in the file can be found, including
+    // registers and fields that aren't in the compiled-in register map
+    static const named_t* lookup(std::string_view name);
+
+    // Reads or writes a register or field by name.  Writing a field reads the register, changes
+    // the field, and writes the register back.  Both throw if there's no such name
+    static uint32_t readByName(std::string_view name);
+    static void     writeByName(std::string_view name, uint32_t value);
+
+    // How long waitForField() calls have taken.  histogram[i] counts the waits that succeeded
+    // after 2^i to 2^(i+1)-1 nanoseconds (and histogram[0] includes those that took no time)
+    static const int WAIT_BUCKETS = 40;
+    struct wait_stats_t
+    {
+        uint64_t waits;                     // Waits that succeeded
+        uint64_t timeouts;                  // Waits that timed out
+        uint64_t spun;                      // Waits that succeeded while still spinning
+        uint64_t yielded;                   // Waits that succeeded while yielding the CPU
+        uint64_t slept;                     // Waits that succeeded after sleeping
+        uint64_t histogram[WAIT_BUCKETS];
+    };
+
+    // Sets how waitForField() backs off: it spins for "spinNs", then yields the CPU until
+    // "yieldNs" have passed, then sleeps between reads, doubling the sleep up to "maxSleepNs"
+    static void setWaitBackoff(uint32_t spinNs, uint32_t yieldNs, uint32_t maxSleepNs);
+
+    // Returns or resets the statistics of every waitForField() call so far
+    static wait_stats_t waitStats();
+    static void         resetWaitStats();
 
     // Constructor requires the AXI address of the register
     FpgaReg(fpgareg_t axiRegister);
@@ -50,10 +92,21 @@ public:
     // Allow "uint32_t variableName = regVariableName"
     operator uint32_t() {return read();}
 
-    // Reads the register (and internally saves the returned value);
+    // Reads the register (and internally saves the returned value).  Depending on the register's
+    // access policy, the value may come from the shadow rather than the FPGA
     uint32_t    read();
 
-    // Writes a value to the register
+    // Reads the register from the FPGA whatever its access policy says, saves the value, and
+    // shadows it if the policy allows.  Use this to poll a register the FPGA changes, such as a
+    // completion count, no matter how it was declared.  Throws if the register is write-only
+    uint32_t    fetch();
+
+    // Reads many registers in a single pass (and internally saves each returned value).  If
+    // "coalesce" is true, registers that share a 64-byte block are fetched with one wide read.
+    // Registers whose value is in the shadow aren't fetched at all
+    static void readMany(FpgaReg* reg[], size_t count, bool coalesce = false);
+
+    // Writes a value to the register.  Throws if the register is read-only
     void        write(uint32_t value);
 
     // After "setField()" operations, this will write the register to the FPGA
@@ -65,31 +118,185 @@ public:
     // Fetches the value of a bit-field
     uint32_t    getField(fpgafld_t idx, bool auto_read=true);
 
+    // Returns true if a bit-field holds the value being waited for
+    typedef std::function<bool(uint32_t)> field_test_fn;
+
+    // Waits for a bit-field to hold "value", or for "test" to return true of its value.  Every
+    // check reads the register from the FPGA, whatever its access policy.  Returns false if
+    // "timeoutMs" passes first.  A timeout of -1 means "wait forever"
+    bool        waitForField(fpgafld_t idx, uint32_t value, int timeoutMs = -1);
+    bool        waitForField(fpgafld_t idx, field_test_fn test, int timeoutMs = -1);
+
     // Returns the AXI address of this register
     uint32_t    axiAddress();
 
+    // Returns the access policy of this register
+    fpgapolicy_t policy() {return policyMap_[regIndex_];}
+
+    // Reads or writes a register that's known at compile time, at its address and with the
+    // access policy in the compiled-in register map.  Each of these compiles down to one access
+    // at a constant offset from the base, plus whatever shadowing the policy calls for.
+    // readDefinitions() refuses any file that would move a compiled-in register
+    template <fpgareg_t REG> static uint32_t read()
+    {
+        constexpr fpgapolicy_t policy = fpgaRegPolicy[REG];
+
+        // A write-only register reads as whatever was last written to it
+        if constexpr (policy == POLICY_WO) return shadow_[REG];
+
+        // If the policy allows it and we know the value, we don't need to ask the FPGA
+        if constexpr (policy == POLICY_RW || policy == POLICY_STATIC)
+        {
+            if (shadowValid_[REG]) return shadow_[REG];
+        }
+
+        uint32_t value = Mmio::read32(userspaceBaseAddress_ + fpgaRegAddr[REG]);
+
+        if constexpr (policy == POLICY_RW || policy == POLICY_STATIC)
+        {
+            shadow_[REG]      = value;
+            shadowValid_[REG] = true;
+        }
+
+        return value;
+    }
+
+    template <fpgareg_t REG> static void write(uint32_t value)
+    {
+        constexpr fpgapolicy_t policy = fpgaRegPolicy[REG];
+        static_assert(policy != POLICY_RO && policy != POLICY_STATIC, "That register is read-only");
+
+        Mmio::write32(userspaceBaseAddress_ + fpgaRegAddr[REG], value);
+
+        if constexpr (policy == POLICY_RW || policy == POLICY_WO)
+        {
+            shadow_[REG]      = value;
+            shadowValid_[REG] = true;
+        }
+    }
+
 
 protected:
 
+    // A transaction updates our copy of the value and decides when to write it
+    friend class FpgaRegTxn;
+
     // Field descriptor, describes a bit-field within a register
-    struct field_desc_t {uint32_t axiAddr; uint32_t mask; uint32_t bitPos; uint32_t width;};
+    typedef fpgafld_info_t field_desc_t;
 
     // The base address of registers, as mapped into userspace
     static uint8_t* userspaceBaseAddress_;
 
     // This maps a REG_xxxx constant to an AXI address
-    static std::map<fpgareg_t, int32_t> regMap_;
+    static std::array<uint32_t, REG_COUNT> regMap_;
 
     // This maps a FLD_xxxx constant to a field-descriptor
-    static std::map<fpgafld_t, field_desc_t> fldMap_;
+    static std::array<field_desc_t, FLD_COUNT> fldMap_;
+
+    // This maps a REG_xxxx constant to its access policy
+    static std::array<fpgapolicy_t, REG_COUNT> policyMap_;
+
+    // Every register and field by name, and the index that finds them
+    static std::vector<named_t> named_;
+    static PerfectHash          nameIndex_;
+
+    // Returns the descriptors of every register and field in the compiled-in register map
+    static std::vector<named_t> compiledNames();
+
+    // Builds the index that finds each of these descriptors by name, and points each name at
+    // the index's own copy of it.  Throws on duplicate names
+    static PerfectHash makeIndex(std::vector<named_t>& named);
+
+    // Restores the register map from the cache for a definitions file, or saves it there.
+    // loadCache() returns false if there's no cache, or it's out of date
+    static bool loadCache(const std::string& filename);
+    static void saveCache(const std::string& filename, const std::vector<std::string>& files);
+
+    // The last value read from or written to each register, and whether that value can be used
+    // in place of reading the FPGA.  Only "rw" and "static" registers are ever marked valid: a
+    // "wo" register always reads from the shadow
+    static std::array<uint32_t, REG_COUNT> shadow_;
+    static std::array<bool, REG_COUNT>     shadowValid_;
+
+    // Returns the descriptor of a bit-field of this register.  Throws if there's no such field,
+    // or it belongs to some other register
+    const field_desc_t& fieldDesc(fpgafld_t idx);
+
+    // Writes "value" to this register in the FPGA, and shadows it if the policy allows.  If
+    // "batch" isn't null, the write is posted as part of that batch
+    void        writeToFpga(uint32_t value, MmioBatch* batch = nullptr);
 
     // The REG_xxxx constant that programmers use to identify a register
     fpgareg_t regIndex_;
 
-    // This is the AXI address of this register
-    uint32_t axiAddress_;
-
     // This is the value after the last read() or setField()
     uint32_t regValue_;
 
-};
\ No newline at end of file
+};
+//=================================================================================================
+
+
+
+//=================================================================================================
+// TypedReg - An FPGA register whose identity is part of its type
+//
+// Fields are named by template parameter, so using a field that belongs to some other register
+// is a compile error rather than a run-time exception.  Everything resolves against the
+// compiled-in register map: every access is at a constant offset from the base address, and
+// every field update compiles down to a constant mask-and-shift.  readDefinitions() refuses any
+// file that would move one of them.
+//
+// Example:    TypedReg<REG_PCIPROXY_ADDRH> addrH;
+//             addrH.setField<FLD_PCIPROXY_ADDRH_mid>(0x1234);
+//=================================================================================================
+template <fpgareg_t REG> class TypedReg
+{
+public:
+
+    // The AXI address of this register
+    static constexpr uint32_t axiAddress = fpgaRegAddr[REG];
+
+    // Allow "regVariableName = <value>"
+    TypedReg&   operator=(uint32_t value) {write(value); return *this;}
+
+    // Allow "uint32_t variableName = regVariableName"
+    operator uint32_t() {return read();}
+
+    // Reads the register (and internally saves the returned value)
+    uint32_t    read() {return regValue_ = FpgaReg::read<REG>();}
+
+    // Writes a value to the register
+    void        write(uint32_t value) {regValue_ = value; FpgaReg::write<REG>(value);}
+
+    // After "setField()" operations, this will write the register to the FPGA
+    void        flush() {FpgaReg::write<REG>(regValue_);}
+
+    // Sets the value of a bit-field
+    template <fpgafld_t FLD> void setField(uint32_t value, bool auto_flush = true)
+    {
+        static_assert(fpgaFldInfo[FLD].reg == REG, "That field isn't in this register");
+        constexpr uint32_t mask   = fpgaFldInfo[FLD].mask;
+        constexpr uint32_t bitPos = fpgaFldInfo[FLD].bitPos;
+        regValue_ = (regValue_ & ~mask) | ((value << bitPos) & mask);
+        if (auto_flush) flush();
+    }
+
+    // Fetches the value of a bit-field
+    template <fpgafld_t FLD> uint32_t getField(bool auto_read = true)
+    {
+        static_assert(fpgaFldInfo[FLD].reg == REG, "That field isn't in this register");
+        constexpr uint32_t mask   = fpgaFldInfo[FLD].mask;
+        constexpr uint32_t bitPos = fpgaFldInfo[FLD].bitPos;
+        if (auto_read) read();
+        return (regValue_ & mask) >> bitPos;
+    }
+
+    // Returns the value after the last read(), write(), or setField()
+    uint32_t    value() {return regValue_;}
+
+protected:
+
+    // This is the value after the last read(), write(), or setField()
+    uint32_t regValue_ = 0;
+};
+//=================================================================================================
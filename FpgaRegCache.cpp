@@ -0,0 +1,319 @@
+//=================================================================================================
+// FpgaRegCache.cpp - Saves the register map that readDefinitions() builds, and restores it
+//
+// Parsing a big definitions file every time a program starts is wasted work when the file hasn't
+// changed.  After readDefinitions() parses <file>, it saves the resulting register map in
+// <file>.cache, and from then on it restores the map from there instead of parsing <file>, for as
+// long as the cache was made by this build of the program from files with the same contents.
+//
+// A cache is an image of the register map, in this machine's byte order:
+//
+//    header_t
+//    The name of each file that was read, each followed by a 0
+//    regMap_, fldMap_, and policyMap_
+//    A record_t for each entry of named_
+//    The name index
+//
+// A cache is only ever an optimization: a cache that's missing, malformed, or out of date is
+// ignored, and if a cache can't be written, it just isn't.  The source hash only proves that
+// the definitions haven't changed, not that the cache itself is intact, so every entry is
+// range-checked the way RegDefParser checks the file.
+//=================================================================================================
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include "FpgaReg.h"
+#include "FileDes.h"
+using namespace std;
+
+// This identifies a cache file, and changes whenever the layout of one does
+static const char MAGIC[8] = {'F', 'P', 'G', 'A', 'R', 'M', 'C', '1'};
+
+// The start of every cache file
+struct header_t
+{
+    char     magic[8];
+    uint64_t layoutHash;    // Identifies the compiled-in register map the cache is for
+    uint64_t sourceHash;    // The hash of the files the cache was made from
+    uint32_t fileCount;     // How many files were read
+    uint32_t fileBytes;     // The size of their names, including the 0 after each one
+    uint32_t namedCount;    // How many entries there are in named_
+    uint32_t reserved;
+};
+
+// How a named_t is stored.  Its name is in the name index
+struct record_t
+{
+    uint32_t isField, axiAddr, mask, bitPos, width, policy;
+    int32_t  reg;
+};
+
+
+//=================================================================================================
+// hashBytes() - Folds a block of bytes into a running hash
+//
+// This takes 8 bytes at a time, since big definitions files are hashed on every run.  Each step
+// is reversible, so changing any one 8-byte word of the input is guaranteed to change the hash
+//=================================================================================================
+static uint64_t hashBytes(uint64_t h, const void* data, size_t size)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    uint64_t       word;
+
+    for (; size >= 8; size -= 8, p += 8)
+    {
+        memcpy(&word, p, 8);
+        h  = (h ^ word) * 0x100000001B3ULL;
+        h ^= h >> 29;
+    }
+
+    while (size--) h = (h ^ *p++) * 0x100000001B3ULL;
+
+    return h;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// hashFiles() - Computes the hash of the names and contents of a list of files
+//
+// Returns: false if one of them can't be read
+//=================================================================================================
+static bool hashFiles(const vector<string>& files, uint64_t& hash)
+{
+    struct stat sb;
+
+    hash = 0xCBF29CE484222325ULL;
+
+    for (auto& filename : files)
+    {
+        FileDes fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0 || fstat(fd, &sb) < 0) return false;
+
+        hash = hashBytes(hash, filename.c_str(), filename.size() + 1);
+        hash = hashBytes(hash, &sb.st_size, sizeof sb.st_size);
+
+        // An empty file has nothing to map
+        if (sb.st_size == 0) continue;
+
+        void* data = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) return false;
+        hash = hashBytes(hash, data, sb.st_size);
+        munmap(data, sb.st_size);
+    }
+
+    return true;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// layoutHash() - Returns a hash that identifies the compiled-in register map
+//
+// regMap_, fldMap_, and policyMap_ are indexed by the fpgareg_t and fpgafld_t constants, so a
+// cache made by a program with some other compiled-in register map can't be used
+//=================================================================================================
+static uint64_t layoutHash()
+{
+    static const uint64_t hash = []
+    {
+        uint64_t h = hashBytes(0xCBF29CE484222325ULL, MAGIC, sizeof MAGIC);
+        for (auto name : fpgaRegName) h = hashBytes(h, name, strlen(name) + 1);
+        for (auto name : fpgaFldName) h = hashBytes(h, name, strlen(name) + 1);
+        return h;
+    }();
+
+    return hash;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// validBits() - Returns true if a bit-field is one RegDefParser would accept: at least one bit
+//               wide, inside 32 bits, and with a mask that matches its position and width
+//=================================================================================================
+static bool validBits(uint32_t bitPos, uint32_t width, uint32_t mask)
+{
+    if (width == 0 || bitPos >= 32 || width > 32 - bitPos) return false;
+    return mask == (uint32_t)(((1ULL << width) - 1) << bitPos);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// get() - Copies the next "size" bytes of an image
+//
+// Returns: false if the image ends first
+//=================================================================================================
+static bool get(const char*& p, const char* end, void* dest, size_t size)
+{
+    if ((size_t)(end - p) < size) return false;
+    memcpy(dest, p, size);
+    p += size;
+    return true;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// loadCache() - Restores the register map from the cache for a definitions file
+//
+// Passed: filename = the name of the definitions file
+//
+// Returns: true if the register map was restored, false if there's no usable cache
+//
+// Nothing changes unless the entire cache is good
+//=================================================================================================
+bool FpgaReg::loadCache(const string& filename)
+{
+    struct stat sb;
+    header_t    header;
+    uint64_t    sourceHash;
+
+    // The register map we're restoring
+    array<uint32_t, REG_COUNT>     regMap;
+    array<field_desc_t, FLD_COUNT> fldMap;
+    array<fpgapolicy_t, REG_COUNT> policyMap;
+    vector<named_t>                named;
+    PerfectHash                    nameIndex;
+
+    // Map the cache into memory
+    FileDes fd = ::open((filename + ".cache").c_str(), O_RDONLY);
+    if (fd < 0 || fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof header) return false;
+    void* data = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) return false;
+
+    const char* p   = (const char*)data;
+    const char* end = p + sb.st_size;
+
+    // This is true if the cache is good
+    bool ok = [&]
+    {
+        // Is this a cache for our compiled-in register map?
+        get(p, end, &header, sizeof header);
+        if (memcmp(header.magic, MAGIC, sizeof MAGIC) != 0) return false;
+        if (header.layoutHash != layoutHash()) return false;
+
+        // Fetch the names of the files it was made from.  The first must be this one
+        if ((size_t)(end - p) < header.fileBytes) return false;
+        if (header.fileBytes == 0 || p[header.fileBytes - 1] != 0) return false;
+        vector<string> files;
+        for (const char* name = p; name < p + header.fileBytes; name += files.back().size() + 1)
+        {
+            files.push_back(name);
+        }
+        p += header.fileBytes;
+        if (files.size() != header.fileCount || files[0] != filename) return false;
+
+        // Are those files still what they were when the cache was made?
+        if (!hashFiles(files, sourceHash) || sourceHash != header.sourceHash) return false;
+
+        // Fetch the register map
+        if (!get(p, end, regMap.data(),    sizeof regMap))    return false;
+        if (!get(p, end, fldMap.data(),    sizeof fldMap))    return false;
+        if (!get(p, end, policyMap.data(), sizeof policyMap)) return false;
+
+        // Every compiled-in register and field must be where it was compiled in, just as
+        // readDefinitions() insists.  That also proves every entry of fldMap is in range
+        if (regMap != fpgaRegAddr || policyMap != fpgaRegPolicy) return false;
+        for (int i=0; i<FLD_COUNT; ++i)
+        {
+            auto& f = fldMap[i];
+            auto& c = fpgaFldInfo[i];
+            if (f.reg != c.reg || f.axiAddr != c.axiAddr || f.mask != c.mask ||
+                f.bitPos != c.bitPos || f.width != c.width) return false;
+        }
+
+        // Fetch every register and field
+        named.resize(header.namedCount);
+        for (auto& n : named)
+        {
+            record_t r;
+            if (!get(p, end, &r, sizeof r)) return false;
+            if (r.policy >= POLICY_COUNT || r.reg < -1 || r.reg >= REG_COUNT) return false;
+            if (r.isField > 1 || !validBits(r.bitPos, r.width, r.mask)) return false;
+            if (!r.isField && (r.bitPos != 0 || r.width != 32)) return false;
+            n = {{}, r.isField != 0, r.axiAddr, r.mask, r.bitPos, r.width,
+                 (fpgapolicy_t)r.policy, r.reg};
+        }
+
+        // Fetch the index, and point every name into it
+        if (!nameIndex.load(p, end) || nameIndex.size() != named.size()) return false;
+        for (size_t i=0; i<named.size(); ++i) named[i].name = nameIndex.key(i);
+
+        return p == end;
+    }();
+
+    munmap(data, sb.st_size);
+    if (!ok) return false;
+
+    // The cache is good, so start using the register map it describes
+    regMap_    = regMap;
+    fldMap_    = fldMap;
+    policyMap_ = policyMap;
+    named_.swap(named);
+    nameIndex_ = move(nameIndex);
+    invalidateShadow();
+    return true;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// saveCache() - Saves the register map in the cache for a definitions file
+//
+// Passed: filename = the name of the definitions file
+//         files    = the names of every file that was read to build the register map
+//
+// The cache is written under a temporary name and then renamed, so a program that's starting up
+// at the same moment sees either the old cache or the new one, and never half of one
+//=================================================================================================
+void FpgaReg::saveCache(const string& filename, const vector<string>& files)
+{
+    header_t header = {};
+    string   image;
+
+    // Build the header
+    memcpy(header.magic, MAGIC, sizeof MAGIC);
+    header.layoutHash = layoutHash();
+    if (!hashFiles(files, header.sourceHash)) return;
+    header.fileCount  = files.size();
+    header.namedCount = named_.size();
+    for (auto& name : files) header.fileBytes += name.size() + 1;
+
+    // Build the image of the register map
+    image.append((const char*)&header, sizeof header);
+    for (auto& name : files) image.append(name.c_str(), name.size() + 1);
+    image.append((const char*)regMap_.data(),    sizeof regMap_);
+    image.append((const char*)fldMap_.data(),    sizeof fldMap_);
+    image.append((const char*)policyMap_.data(), sizeof policyMap_);
+    for (auto& n : named_)
+    {
+        record_t r = {n.isField, n.axiAddr, n.mask, n.bitPos, n.width, (uint32_t)n.policy, n.reg};
+        image.append((const char*)&r, sizeof r);
+    }
+    nameIndex_.save(image);
+
+    // Write it to a temporary file
+    string cacheName = filename + ".cache";
+    string tempName  = cacheName + "." + to_string(getpid());
+    FileDes fd = ::open(tempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return;
+
+    const char* p = image.data();
+    size_t      remaining = image.size();
+    while (remaining)
+    {
+        ssize_t n = ::write(fd, p, remaining);
+        if (n <= 0) break;
+        p         += n;
+        remaining -= n;
+    }
+
+    // If it was written in full, it becomes the cache
+    if (remaining || rename(tempName.c_str(), cacheName.c_str()) != 0) unlink(tempName.c_str());
+}
+//=================================================================================================
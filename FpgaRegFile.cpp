@@ -1,4 +1,3 @@
-
 //=================================================================================================
 // FpgaRegFile.cpp - Contains code for reading the FPGA register definitions file
 //
@@ -6,120 +5,47 @@
 // or any of these keywords:
 //
 //    base <IP_NAME> <base_address>
-//    reg <REG_NAME> <offset_from_base_address>
+//    reg <REG_NAME> <offset_from_base_address> [access_policy]
 //    field <FIELD_NAME> <rightmost_bit_number> <width_in_bits>
+//    include <filename>
+//    template <TEMPLATE_NAME>
+//    end
+//    instance <IP_NAME> <TEMPLATE_NAME> <base_address> [<count> <stride>]
+//
+// The file is parsed by RegDefParser, which describes the syntax in detail.
 //=================================================================================================
 #include <stdio.h>
-#include <fstream>
 #include <stdarg.h>
 #include <vector>
 #include <cstring>
+#include <stdexcept>
 #include "FpgaReg.h"
+#include "RegDefParser.h"
 using namespace std;
 
-// Returns true if the character indicates the end of the line is reached
-static inline bool isEOL(char c) {return (c == 0 || c == 10 || c == 13);}
+// The parser's access policies must be the ones the register map was generated with
+static_assert(RegDefParser::POLICY_COUNT == POLICY_COUNT, "FpgaRegDefs.h is out of date");
 
 // This is the name of the file we're processing
 static const char* fn;
 
-// This will be used by "throw_runtime()"
-static int lineNumber;
-
-// Convenient way to fetch a const char* to string data
-const char* c(const string& s) {return s.c_str();}
-
-
-//==========================================================================================================
-// parseTokens() - Parses an input string into a vector of tokens
-//==========================================================================================================
-static vector<string> parseTokens(const char* in)
-{
-    vector<string> result;
-    char           token[512];
-
-    // If we weren't given an input string, return an empty result;
-    if (in == nullptr) return result;
-
-    // So long as there are input characters still to be processed...
-    while (!isEOL(*in))
-    {
-        // Point to the output buffer
-        char* out = token;
-
-        // Skip over any leading spaces or tabs on the input
-        while (*in == 32 || *in == 9) in++;
-
-        // If we hit end-of-line, there are no more tokens to parse
-        if (isEOL(*in)) break;
-
-        // Assume for the moment that we're not starting a quoted string
-        char inQuotes = 0;
-
-        // If this is a single or double quote-mark, remember it and skip past it
-        if (*in == '"' || *in == '\'') inQuotes = *in++;
-
-        // Loop until we've parsed this entire token...
-        while (!isEOL(*in))
-        {
-            // If we're parsing a quoted string...
-            if (inQuotes)
-            {
-                // If we've hit the ending quote-mark, we're done parsing this token
-                if (*in == inQuotes)
-                {
-                    ++in;
-                    break;
-                }
-            }
-
-            // Otherwise, we're not parsing a quoted string. A space, tab, or comma ends the token
-            else if (*in == 32 || *in == 9 || *in == ',') break;
-
-            // Append this character to the token buffer
-            *out++ = *in++;
-        }
-
-        // nul-terminate the token string
-        *out = 0;
-
-        // Add the token to our result list
-        result.push_back(token);
-
-        // Skip over any trailing spaces or tabs in the input
-        while (*in == ' ' || *in == 9) ++in;
-
-        // If there is a trailing comma, throw it away
-        if (*in == ',') ++in;
-    }
-
-    // Hand the caller a vector of tokens
-    return result;
-}
-//==========================================================================================================
-
-
-
 
 //=================================================================================================
-// throwRuntime() - Throws a std::runtime_error exception
+// throwRuntime() - Throws a std::runtime_error exception whose message begins with "<filename>: "
 //=================================================================================================
 static void throwRuntime(const char* fmt, ...)
 {
     char message[1024];
     va_list ap;
 
-    // The message begins with "<filename>: " or with "<filename>, line <line>, "
-    if (lineNumber == 0)
-        sprintf(message, "%s: ", fn);
-    else
-        sprintf(message, "%s, line %i: ", fn, lineNumber);
+    // The message begins with "<filename>: "
+    sprintf(message, "%s: ", fn);
 
     // Find the end of the message
     char* end = strchr(message, 0);
 
     va_start(ap, fmt);
-    vsprintf(end, fmt, ap);
+    vsnprintf(end, message + sizeof message - end, fmt, ap);
     va_end(ap);
 
     throw runtime_error(message);
@@ -128,166 +54,196 @@ static void throwRuntime(const char* fmt, ...)
 
 
 //=================================================================================================
-// getRegConstant() - Returns the constant that corresponds to a given baseName/regName combo
+// compiledIndex() - Returns an index of the names in the compiled-in register map.  Registers
+//                   are at 0 thru REG_COUNT-1, and fields follow them
 //=================================================================================================
-static fpgareg_t getRegConstant(const string& baseName, const string& regName)
+static const PerfectHash& compiledIndex()
 {
-    if (baseName == "PCIPROXY")
+    static PerfectHash index = []
     {
-        if (regName == "DATA" ) return REG_PCIPROXY_DATA;
-        if (regName == "ADDRH") return REG_PCIPROXY_ADDRH;
-        if (regName == "ADDRL") return REG_PCIPROXY_ADDRL;
-        throwRuntime("Unknown register %s:%s", c(baseName), c(regName));
-    }
-
-    // If we get here, the definitions file contains and unknown base name
-    throwRuntime("Unknown base register %s", c(baseName));
-
-    // We'll never get here, but this keeps the compiler happy
-    return (fpgareg_t)-1;
+        vector<string_view> names;
+        PerfectHash         result;
+        for (auto name : fpgaRegName) names.push_back(name);
+        for (auto name : fpgaFldName) names.push_back(name);
+        result.build(names);
+        return result;
+    }();
+
+    return index;
 }
 //=================================================================================================
 
 
 //=================================================================================================
-// getFldConstant() - Returns the constant that corresponds to a given field name
+// getRegConstant() - Returns the constant that corresponds to a register name, or -1 if the
+//                    register isn't in the compiled-in register map
 //=================================================================================================
-static fpgafld_t getFldConstant(const string& baseName, const string& regName, const string& fldName)
+static int getRegConstant(string_view name)
 {
-    // Fetch the name of the register we're working with
-    string reg = baseName + "_" + regName;
-
-    if (reg  == "PCIPROXY_ADDRH")
-    {
-        if (fldName == "btm") return FLD_PCIPROXY_ADDRH_btm;
-        if (fldName == "top") return FLD_PCIPROXY_ADDRH_top;
-        if (fldName == "mid") return FLD_PCIPROXY_ADDRH_mid;
-        goto error;
-    }
-
-error:
-
-    // If we get here, the definitions file contains and unknown base name
-    throwRuntime("Unknown field %s_%s_%s", c(baseName), c(regName), c(fldName));
-
-    // We'll never get here, but this keeps the compiler happy
-    return (fpgafld_t)-1;
+    int i = compiledIndex().find(name);
+    return (i < REG_COUNT) ? i : -1;
 }
 //=================================================================================================
 
 
-
+//=================================================================================================
+// getFldConstant() - Returns the constant that corresponds to a field name, or -1 if the field
+//                    isn't in the compiled-in register map
+//=================================================================================================
+static int getFldConstant(string_view name)
+{
+    int i = compiledIndex().find(name);
+    return (i < REG_COUNT) ? -1 : i - REG_COUNT;
+}
+//=================================================================================================
 
 
 //=================================================================================================
 // readDefinitions() - Reads and parses the file that contains AXI register definitions.
+//
+// Every register and field in the compiled-in register map must be defined in the file, at the
+// address, with the access policy, and at the bit position it was compiled in with.  Code that
+// names a register at compile time (read<REG>(), write<REG>(), TypedReg) bakes those in, so a
+// file that moves one is rejected rather than leaving that code accessing the old location.  The
+// file may also define registers and fields that aren't compiled in: those can only be reached
+// by name, through lookup(), readByName(), and writeByName().
+//
+// The register map is only replaced once the entire file has been read successfully, and the
+// shadow is then invalidated.
+//
+// If "useCache" is true and there's an up-to-date cache of the file, the register map comes from
+// the cache without parsing anything.  Otherwise, once the file is parsed, the cache is rebuilt
 //=================================================================================================
-void FpgaReg::readDefinitions(string filename)
+void FpgaReg::readDefinitions(string filename, bool useCache)
 {
-    string   line, baseName = "", registerName;
-    uint32_t i, baseAddr = 0, registerOffset;
-    fpgareg_t regConstant = (fpgareg_t)0;
-    field_desc_t fd;
-    
-
-    // We haven't read in any lines of text yet
-    lineNumber = 0;
+    // If the file hasn't changed since we last parsed it, we're done
+    if (useCache && loadCache(filename)) return;
+
+    RegDefParser parser;
+    int          regConstant = -1;
+
+    // The register map we're building, and which entries of it the file has defined
+    array<uint32_t, REG_COUNT>     regMap;
+    array<field_desc_t, FLD_COUNT> fldMap;
+    array<fpgapolicy_t, REG_COUNT> policyMap;
+    vector<bool>                   regDefined(REG_COUNT), fldDefined(FLD_COUNT);
+
+    // Every register and field in the file.  Their names are built end to end in "pool", and
+    // nameEnd[i] is where the name of named[i] ends
+    vector<named_t>                named;
+    string                         pool;
+    vector<size_t>                 nameEnd;
+
+    // Appends the pieces of a name to the pool, joined by '_', and returns the whole name
+    auto makeName = [&](initializer_list<string_view> piece)
+    {
+        size_t start = pool.size();
+        for (auto p : piece)
+        {
+            if (pool.size() != start) pool += '_';
+            pool.append(p);
+        }
+        nameEnd.push_back(pool.size());
+        return string_view(pool.data() + start, pool.size() - start);
+    };
 
     // Get a const char* to the filename
     fn = filename.c_str();
 
-    // Open the specified file name
-    ifstream file(filename);
-
-    // If we couldn't open the file, tell the caller
-    if (!file.is_open()) throwRuntime("Can't open");
-
-    // Loop through each line of the file
-    while (getline(file, line))
+    // This is called with every register in the file
+    auto onReg = [&](const RegDefParser::reg_t& reg)
     {
-        // Keep track of the line number
-        ++lineNumber;
-
-        // Fetch a pointer to the characters in the line
-        const char* p = line.c_str();
-
-        // Skip over any leading spaces or tabs
-        while (*p == 32 || *p == 9) ++p;
-
-        // If the line is blank, skip this line
-        if (*p == 0 || *p == 10 || *p == 13) continue;
-
-        // If the line is a comment, skip this line
-        if (*p == '#' || (p[0] == '/' && p[1] == '/')) continue;
+        fpgapolicy_t policy = (fpgapolicy_t)reg.policy;
 
-        // Parse the line into tokens
-        vector<string> tokens = parseTokens(p);
+        regConstant = getRegConstant(makeName({reg.ip, reg.name}));
+        named.push_back({{}, false, reg.axiAddr, 0xFFFFFFFF, 0, 32, policy, regConstant});
 
-        // The first token is the keyword. ("base", "reg", etc)
-        string& keyword = tokens[0];
-
-        // If this is the "base" command, expect a name and an address
-        if (keyword == "base")
+        // If this register is in the compiled-in map, it must be where it was compiled in
+        if (regConstant >= 0)
         {
-            if (tokens.size() < 3) throwRuntime("Syntax error");
-            baseName = tokens[1];
-            baseAddr = stoul(tokens[2], 0, 0);
-            continue;
-        }
+            if (reg.axiAddr != fpgaRegAddr[regConstant] || policy != fpgaRegPolicy[regConstant])
+            {
+                throwRuntime("register %s is defined at 0x%x (%s), but was compiled in at "
+                             "0x%x (%s)", fpgaRegName[regConstant],
+                             reg.axiAddr, fpgaPolicyName[policy],
+                             fpgaRegAddr[regConstant], fpgaPolicyName[fpgaRegPolicy[regConstant]]);
+            }
 
-        // If this is a "reg" command, expect a name and an offset
-        if (keyword == "reg")
-        {
-            if (tokens.size() < 3) throwRuntime("Syntax error");
-            if (baseName.empty()) throwRuntime("No base defined");
-            registerName = tokens[1];
-            registerOffset = stoul(tokens[2], 0, 0);
-            regConstant = getRegConstant(baseName, registerName);
-            fd.axiAddr = regMap_[regConstant] = baseAddr + registerOffset;
-            continue;
+            regMap[regConstant]     = reg.axiAddr;
+            policyMap[regConstant]  = policy;
+            regDefined[regConstant] = true;
         }
+    };
 
-        // If this is a "field" command, expect a name, bit-position, and field-width
-        if (keyword == "field")
+    // This is called with every field in the file, right after the register it belongs to
+    auto onField = [&](const RegDefParser::field_t& fld)
+    {
+        uint32_t mask = (uint32_t)(((1ULL << fld.width) - 1) << fld.bitPos);
+
+        string_view name = makeName({fld.ip, fld.reg, fld.name});
+        named.push_back({{}, true, fld.axiAddr, mask, fld.bitPos, fld.width,
+                         (fpgapolicy_t)fld.policy, regConstant});
+
+        // If this field is in the compiled-in map, it must be where it was compiled in
+        int fldConstant = (regConstant < 0) ? -1 : getFldConstant(name);
+        if (fldConstant >= 0)
         {
-            if (tokens.size() < 4) throwRuntime("Syntax error");
-            string& fieldName = tokens[1];
-            fd.bitPos = stoul(tokens[2], 0, 0);
-            fd.width  = stoul(tokens[3], 0, 0);
-            fd.mask   = ((1 << fd.width) - 1) << fd.bitPos;
-            fpgafld_t fldConstant = getFldConstant(baseName, registerName, fieldName);
-            fldMap_[fldConstant] = fd;
-            continue;
+            auto& compiled = fpgaFldInfo[fldConstant];
+            if (fld.bitPos != compiled.bitPos || fld.width != compiled.width)
+            {
+                throwRuntime("field %s is defined as bits %u-%u, but was compiled in as bits %u-%u",
+                             fpgaFldName[fldConstant], fld.bitPos, fld.bitPos + fld.width - 1,
+                             compiled.bitPos, compiled.bitPos + compiled.width - 1);
+            }
 
+            fldMap[fldConstant] = {(fpgareg_t)regConstant, fld.axiAddr, mask, fld.bitPos,
+                                   fld.width};
+            fldDefined[fldConstant] = true;
         }
+    };
 
-        // If we get here, we don't recognize the keyword
-        throwRuntime("Syntax error");
+    // Parse the file
+    parser.parse(filename, onReg, onField);
 
+    // Check to ensure that every register has been defined
+    for (int i=0; i<REG_COUNT; ++i)
+    {
+        if (!regDefined[i]) throwRuntime("missing register %s", fpgaRegName[i]);
     }
 
-    // Check to ensure that every register has been defined
-    for (i=0; i<REG_COUNT; ++i)
+    // Check to ensure that every field has been defined
+    for (int i=0; i<FLD_COUNT; ++i)
     {
-        if(regMap_.find((fpgareg_t)i) == regMap_.end())
-        {
-            throwRuntime("missing register constant %i", i);
-        }
+        if (!fldDefined[i]) throwRuntime("missing field %s", fpgaFldName[i]);
     }
 
+    // The pool is complete, so it's safe to point the descriptors into it
+    for (size_t i=0; i<named.size(); ++i)
+    {
+        size_t start = (i == 0) ? 0 : nameEnd[i-1];
+        named[i].name = string_view(pool.data() + start, nameEnd[i] - start);
+    }
 
-    // Check to ensure that every field has been defined
-    for (i=0; i<FLD_COUNT; ++i)
+    // Index every name in the file.  This fails if a name is defined twice
+    PerfectHash nameIndex;
+    try
     {
-        if(fldMap_.find((fpgafld_t)i) == fldMap_.end())
-        {
-            throwRuntime("missing field constant %i", i);
-        }
+        nameIndex = makeIndex(named);
+    }
+    catch (const runtime_error& e)
+    {
+        throwRuntime("%s", e.what());
     }
 
+    // The file is good, so start using the register map it describes
+    regMap_    = regMap;
+    fldMap_    = fldMap;
+    policyMap_ = policyMap;
+    named_.swap(named);
+    nameIndex_ = move(nameIndex);
+    invalidateShadow();
 
+    // Next time, we won't have to parse the file
+    if (useCache) saveCache(filename, parser.files());
 }
 //=================================================================================================
-
-
-
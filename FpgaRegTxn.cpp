@@ -0,0 +1,195 @@
+//=================================================================================================
+// FpgaRegTxn.cpp - Implements a transaction that batches register updates into minimal MMIO
+//                  writes
+//=================================================================================================
+#include "FpgaRegTxn.h"
+#include "Util.h"
+using namespace std;
+
+
+//=================================================================================================
+// checkWritable() - Throws if a register can't be written
+//
+// This is checked when a register joins a transaction, so that commit() can't fail partway
+// through, with some registers written and others not
+//=================================================================================================
+static void checkWritable(FpgaReg& reg, uint32_t index)
+{
+    fpgapolicy_t policy = reg.policy();
+
+    if (policy == POLICY_RO || policy == POLICY_STATIC)
+    {
+        throwRuntime("Register %s is read-only", fpgaRegName[index]);
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// touch() - Adds a register to the transaction if it's not already in it
+//
+// Passed: reg = the FpgaReg object the caller is updating
+//
+// Returns: the value that will be written to the hardware register "reg" names
+//
+// Callers tend to set several fields of one register in a row, so search from the most
+// recently added entry backwards.  A register's entry is shared by every FpgaReg object that
+// names it
+//=================================================================================================
+uint32_t& FpgaRegTxn::touch(FpgaReg& reg)
+{
+    // If this object is already in the transaction, so is its register
+    for (size_t i = object_.size(); i > 0; --i)
+    {
+        if (object_[i-1].reg == &reg) return entry_[object_[i-1].entry].value;
+    }
+
+    // Find the entry for the register this object names
+    size_t entry = entry_.size();
+    for (size_t i = entry_.size(); i > 0; --i)
+    {
+        if (entry_[i-1].index == reg.regIndex_) {entry = i - 1; break;}
+    }
+
+    // If there isn't one, start the register out with the best value we know for it
+    if (entry == entry_.size())
+    {
+        fpgareg_t index = reg.regIndex_;
+        uint32_t  value = FpgaReg::shadowValid_[index] ? FpgaReg::shadow_[index] : reg.regValue_;
+        entry_.push_back({index, value, &reg});
+    }
+
+    object_.push_back({&reg, reg.regValue_, entry});
+    return entry_[entry].value;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// setField() - Sets the value of a bit-field in the register's pending value
+//=================================================================================================
+void FpgaRegTxn::setField(FpgaReg& reg, fpgafld_t idx, uint32_t value)
+{
+    // These throw if the register can't be written or the field isn't in it, in which case
+    // nothing has changed
+    checkWritable(reg, reg.regIndex_);
+    auto& fd = reg.fieldDesc(idx);
+
+    // Merge the field into the value the register will be written with, and let the caller's
+    // object see it
+    uint32_t& pending = touch(reg);
+    pending = (pending & ~fd.mask) | ((value << fd.bitPos) & fd.mask);
+    reg.regValue_ = pending;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// write() - Sets the entire pending value of the register
+//=================================================================================================
+void FpgaRegTxn::write(FpgaReg& reg, uint32_t value)
+{
+    checkWritable(reg, reg.regIndex_);
+    touch(reg)    = value;
+    reg.regValue_ = value;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// commit() - Writes every register in the transaction to the FPGA, once each
+//
+// Passed: readBack = if true, finish with a read of the last "rw" register written (if there is
+//                    one).  A read can't complete until every posted write ahead of it has, so
+//                    when this returns the device has seen every write
+//
+// Returns: the number of register writes performed
+//
+// Only an "rw" register is read back, since it's the only kind in a transaction that's sure to
+// have no side-effects when it's read.  If there isn't one, the writes are posted and not waited
+// for.  Use commit(FpgaReg&) to name a register that's safe to read
+//=================================================================================================
+size_t FpgaRegTxn::commit(bool readBack)
+{
+    FpgaReg* reg = nullptr;
+
+    if (readBack)
+    {
+        for (size_t i = entry_.size(); i > 0; --i)
+        {
+            if (entry_[i-1].reg->policy() == POLICY_RW) {reg = entry_[i-1].reg; break;}
+        }
+    }
+
+    return post(reg);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// commit() - Writes every register in the transaction to the FPGA, then reads back a register
+//            of the caller's choosing
+//
+// Passed: readBack = a register that has no side-effects when it's read
+//
+// Returns: the number of register writes performed
+//=================================================================================================
+size_t FpgaRegTxn::commit(FpgaReg& readBack)
+{
+    // There's no reading a write-only register, and we find that out before writing anything
+    if (readBack.policy() == POLICY_WO)
+    {
+        throwRuntime("Register %s is write-only", fpgaRegName[readBack.regIndex_]);
+    }
+
+    return post(&readBack);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// post() - Writes every register in the transaction to the FPGA, once each, and reads back
+//          "readBack" if it isn't null
+//
+// The writes are posted as one MmioBatch, so there are no barriers between them.  The read-back
+// has to go to the FPGA, so the shadow is no help here, and it doesn't disturb our copy of the
+// register's value
+//=================================================================================================
+size_t FpgaRegTxn::post(FpgaReg* readBack)
+{
+    size_t    count = entry_.size();
+    MmioBatch batch;
+
+    // If there's nothing to write, there's nothing to flush either
+    if (count == 0) return 0;
+
+    // Write each register once, in the order they were first touched
+    for (auto& entry : entry_) entry.reg->writeToFpga(entry.value, &batch);
+
+    // Wait for the writes to reach the device, if we've been given a way to
+    if (readBack)
+        batch.complete(FpgaReg::userspaceBaseAddress_ + readBack->axiAddress());
+    else
+        batch.complete();
+
+    // Every object that took part now holds what was written to its register
+    for (auto& object : object_) object.reg->regValue_ = entry_[object.entry].value;
+
+    // The transaction is complete
+    entry_.clear();
+    object_.clear();
+    return count;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// abort() - Restores every FpgaReg object we touched to the value it had beforehand
+//=================================================================================================
+void FpgaRegTxn::abort()
+{
+    for (auto& object : object_) object.reg->regValue_ = object.original;
+    entry_.clear();
+    object_.clear();
+}
+//=================================================================================================
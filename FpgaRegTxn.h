@@ -0,0 +1,95 @@
+//=================================================================================================
+// FpgaRegTxn.h - Defines a transaction that batches register updates into minimal MMIO writes
+//
+// Calling FpgaReg::setField() with auto_flush=true costs one MMIO write per field.  A
+// transaction instead records field updates (and whole-register writes) against any number of
+// FpgaReg objects, and commit() writes each register that was touched exactly once, followed by
+// a single read-back that forces the posted writes out to the device.  Updating 200 fields in 40
+// registers costs 40 writes and one read.
+//
+// Only registers that can be written may join a transaction, and setField() and write() throw
+// on any other, so commit() never stops partway through.  The read-back must not disturb the
+// device, so it's either a register the caller names, or the last "rw" register in the
+// transaction.
+//
+// Updates are merged per hardware register, not per FpgaReg object, so two FpgaReg objects that
+// name the same register still cost one write, and neither one's stale copy overwrites the
+// other's fields.  A register starts out with its shadowed value if that's valid, and otherwise
+// with the value in the first FpgaReg object that touched it.
+//
+// Registers are written in the order they were first touched in the transaction, so a register
+// that must be written last (an "enable" or "go" bit, say) should be touched last.
+//
+// Example:    FpgaRegTxn txn;
+//             txn.setField(ctrl,  FLD_DMA_CTRL_mode, 2);
+//             txn.setField(ctrl,  FLD_DMA_CTRL_burst, 7);
+//             txn.write(addrL, 0x1000);
+//             txn.commit();
+//=================================================================================================
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "FpgaReg.h"
+
+class FpgaRegTxn
+{
+public:
+
+    // Constructor
+    FpgaRegTxn() {};
+
+    // No copy or assignment constructor - objects of this class can't be copied
+    FpgaRegTxn (const FpgaRegTxn&) = delete;
+    FpgaRegTxn& operator= (const FpgaRegTxn&) = delete;
+
+    // Destructor - Anything that was never committed is abandoned
+    ~FpgaRegTxn() {abort();}
+
+    // Sets the value of a bit-field in "reg", without writing it to the FPGA yet.  Throws if
+    // the register is read-only
+    void        setField(FpgaReg& reg, fpgafld_t idx, uint32_t value);
+
+    // Sets the value of the entire register, without writing it to the FPGA yet.  Throws if the
+    // register is read-only
+    void        write(FpgaReg& reg, uint32_t value);
+
+    // Writes every register that was touched, once each.  If "readBack" is true and one of them
+    // is an "rw" register, the last such register is read back, so that the writes have reached
+    // the device by the time this returns.  Returns the number of register writes performed
+    size_t      commit(bool readBack = true);
+
+    // Same as above, but always finishes by reading "readBack", which must be a register that
+    // has no side-effects when it's read.  Throws (with nothing written) if it's write-only
+    size_t      commit(FpgaReg& readBack);
+
+    // Abandons the transaction: nothing is written, and every FpgaReg object that was touched
+    // gets back the value it had before the transaction
+    void        abort();
+
+    // Returns the number of registers waiting to be written
+    size_t      pending() {return entry_.size();}
+
+protected:
+
+    // Writes every register in the transaction, then reads back "readBack" if it isn't null
+    size_t      post(FpgaReg* readBack);
+
+    // Adds "reg" (and the hardware register it names) to the transaction if they're not already
+    // in it, and returns the value that will be written to that register
+    uint32_t&   touch(FpgaReg& reg);
+
+    // One hardware register in the transaction, the value it will be written with, and the
+    // FpgaReg object that first touched it (which does the writing)
+    struct entry_t {fpgareg_t index; uint32_t value; FpgaReg* reg;};
+
+    // One FpgaReg object in the transaction, the value it had before we first touched it, and
+    // the entry of the register it names
+    struct object_t {FpgaReg* reg; uint32_t original; size_t entry;};
+
+    // The registers in the transaction, in the order they were first touched
+    std::vector<entry_t>  entry_;
+
+    // The FpgaReg objects in the transaction
+    std::vector<object_t> object_;
+};
+//=================================================================================================
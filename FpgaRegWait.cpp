@@ -0,0 +1,202 @@
+//=================================================================================================
+// FpgaRegWait.cpp - Implements waiting for a bit-field of an FPGA register to take on a value
+//
+// A wait that's over in a microsecond or two is best served by a tight spin, since anything
+// else would add latency.  A wait that goes on for milliseconds is best served by sleeping, since
+// spinning would burn a core the whole time.  We don't know in advance which one we're in, so
+// waitForField() backs off as the wait goes on:
+//
+//    spin  - Read the register as fast as possible, with a "pause" (or "yield") between reads
+//    yield - Read the register, then give the CPU to any other thread that's ready to run
+//    sleep - Read the register, then sleep.  Each sleep is twice as long as the last, up to a
+//            limit, so a long wait costs almost no CPU
+//
+// Every wait is timed, and the times are kept in a histogram so the backoff can be tuned to
+// what the hardware actually does.
+//=================================================================================================
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sched.h>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include "FpgaReg.h"
+#include "Util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+#endif
+using namespace std;
+using namespace std::chrono;
+
+// How waitForField() backs off.  These may be changed while other threads are waiting
+static atomic<uint32_t> spinNs(10000);
+static atomic<uint32_t> yieldNs(100000);
+static atomic<uint32_t> maxSleepNs(1000000);
+
+// The shortest sleep between reads
+static const uint32_t MIN_SLEEP_NS = 10000;
+
+// The statistics of every wait so far.  Waits may happen in several threads at once
+static atomic<uint64_t> waits, timeouts, spun, yielded, slept;
+static atomic<uint64_t> histogram[FpgaReg::WAIT_BUCKETS];
+
+
+//=================================================================================================
+// cpuRelax() - Tells the CPU we're in a spin-loop
+//=================================================================================================
+static inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield" ::: "memory");
+#endif
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// sleepNs() - Sleeps for the specified number of nanoseconds
+//=================================================================================================
+static void sleepNs(int64_t ns)
+{
+    timespec ts = {(time_t)(ns / 1000000000), (long)(ns % 1000000000)};
+    nanosleep(&ts, nullptr);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// setWaitBackoff() - Sets how waitForField() backs off while it waits
+//=================================================================================================
+void FpgaReg::setWaitBackoff(uint32_t spin, uint32_t yield, uint32_t maxSleep)
+{
+    spinNs     = spin;
+    yieldNs    = (yield > spin) ? yield : spin;
+    maxSleepNs = (maxSleep > MIN_SLEEP_NS) ? maxSleep : MIN_SLEEP_NS;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// waitStats() - Returns the statistics of every waitForField() call so far
+//=================================================================================================
+FpgaReg::wait_stats_t FpgaReg::waitStats()
+{
+    wait_stats_t stats;
+
+    stats.waits    = waits;
+    stats.timeouts = timeouts;
+    stats.spun     = spun;
+    stats.yielded  = yielded;
+    stats.slept    = slept;
+    for (int i=0; i<WAIT_BUCKETS; ++i) stats.histogram[i] = histogram[i];
+
+    return stats;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// resetWaitStats() - Clears the statistics of every waitForField() call so far
+//=================================================================================================
+void FpgaReg::resetWaitStats()
+{
+    waits = timeouts = spun = yielded = slept = 0;
+    for (auto& bucket : histogram) bucket = 0;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// waitForField() - Waits for a bit-field to hold a specific value
+//=================================================================================================
+bool FpgaReg::waitForField(fpgafld_t fieldIndex, uint32_t value, int timeoutMs)
+{
+    return waitForField(fieldIndex, [value](uint32_t v) {return v == value;}, timeoutMs);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// waitForField() - Waits for a test of a bit-field to succeed
+//
+// Passed: fieldIndex = the field to wait on.  It must belong to this register
+//         test       = returns true when the field holds the value we're waiting for
+//         timeoutMs  = how long to wait in milliseconds (-1 = forever)
+//
+// Returns: false on timeout
+//
+// The register is always read from the FPGA, since a shadowed value would never change.  On
+// return, the register's value is the one that was read last
+//=================================================================================================
+bool FpgaReg::waitForField(fpgafld_t fieldIndex, field_test_fn test, int timeoutMs)
+{
+    // Get a convenient reference to the field-descriptor that matches this index
+    auto& fd = fieldDesc(fieldIndex);
+
+    // There's no point in waiting for a register we can't read
+    if (policy() == POLICY_WO)
+    {
+        throwRuntime("Register %s is write-only", fpgaRegName[regIndex_]);
+    }
+
+    // Take one consistent copy of the backoff settings for the whole wait
+    const int64_t  spin     = spinNs;
+    const int64_t  yield    = yieldNs;
+    const uint64_t maxSleep = maxSleepNs;
+
+    auto     start    = steady_clock::now();
+    auto     deadline = start + milliseconds(timeoutMs < 0 ? 0 : timeoutMs);
+    uint32_t sleep    = MIN_SLEEP_NS;
+
+    while (true)
+    {
+        // Has the field taken on the value we're waiting for?
+        bool done = test((fetch() & fd.mask) >> fd.bitPos);
+
+        auto    now     = steady_clock::now();
+        int64_t elapsed = duration_cast<nanoseconds>(now - start).count();
+
+        if (done)
+        {
+            // Record how long it took, and which phase of the backoff we were in at the time
+            if      (elapsed < spin)  ++spun;
+            else if (elapsed < yield) ++yielded;
+            else                        ++slept;
+
+            int bucket = 63 - __builtin_clzll(elapsed | 1);
+            ++histogram[bucket < WAIT_BUCKETS ? bucket : WAIT_BUCKETS - 1];
+            ++waits;
+            return true;
+        }
+
+        // If we've run out of time, give up
+        if (timeoutMs >= 0 && now >= deadline)
+        {
+            ++timeouts;
+            return false;
+        }
+
+        // Back off before reading the register again
+        if (elapsed < spin)
+            cpuRelax();
+        else if (elapsed < yield)
+            sched_yield();
+        else
+        {
+            // Don't sleep past the deadline
+            int64_t ns = sleep;
+            if (timeoutMs >= 0)
+            {
+                int64_t remaining = duration_cast<nanoseconds>(deadline - now).count();
+                ns = min(ns, remaining);
+            }
+            sleepNs(ns);
+            sleep = (uint32_t)min((uint64_t)sleep * 2, maxSleep);
+        }
+    }
+}
+//=================================================================================================
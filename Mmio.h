@@ -0,0 +1,147 @@
+//=================================================================================================
+// Mmio.h - Defines the primitives for accessing registers in a memory-mapped PCI BAR
+//
+// An access through an ordinary pointer is fair game for the compiler, which may drop it, merge
+// it with its neighbors, or move it past other accesses.  Even an access the compiler leaves
+// alone may be reordered by the CPU: stores to a write-combined BAR are weakly ordered on x86,
+// and ARM only orders device accesses against ordinary memory when it's told to.
+//
+// Every access here is one volatile access of exactly 32 bits.  read32() and write32() are also
+// ordered against the memory accesses around them, so that (for instance) a DMA descriptor that
+// was written to memory is visible to the device before the doorbell write that tells the device
+// to go fetch it.  The "relaxed" versions leave out the barrier, for callers that order their
+// accesses themselves.
+//
+// MmioBatch posts a series of writes with no barriers between them, then waits for all of them
+// to reach the device with a single read-back.
+//=================================================================================================
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+#endif
+
+class Mmio
+{
+public:
+
+    // Orders every earlier store (to memory or to a BAR) before every later store
+    static void writeBarrier()
+    {
+    #if defined(__x86_64__) || defined(__i386__)
+        _mm_sfence();
+    #elif defined(__aarch64__) || defined(__arm__)
+        __asm__ __volatile__("dmb oshst" ::: "memory");
+    #else
+        __sync_synchronize();
+    #endif
+    }
+
+    // Orders every earlier load (from memory or from a BAR) before every later load or store.
+    // x86 never reorders those, so there, only the compiler has to be stopped
+    static void readBarrier()
+    {
+    #if defined(__x86_64__) || defined(__i386__)
+        __asm__ __volatile__("" ::: "memory");
+    #elif defined(__aarch64__)
+        __asm__ __volatile__("dmb oshld" ::: "memory");
+    #elif defined(__arm__)
+        __asm__ __volatile__("dmb osh" ::: "memory");
+    #else
+        __sync_synchronize();
+    #endif
+    }
+
+    // Orders every earlier load and store before every later one
+    static void fullBarrier()
+    {
+    #if defined(__x86_64__) || defined(__i386__)
+        _mm_mfence();
+    #elif defined(__aarch64__) || defined(__arm__)
+        __asm__ __volatile__("dsb sy" ::: "memory");
+    #else
+        __sync_synchronize();
+    #endif
+    }
+
+    // Reads or writes a register, with no barrier
+    static uint32_t read32Relaxed(const void* addr) {return *(const volatile uint32_t*)addr;}
+    static void     write32Relaxed(void* addr, uint32_t value) {*(volatile uint32_t*)addr = value;}
+
+    // Reads a register.  Later loads and stores can't be performed ahead of it
+    static uint32_t read32(const void* addr)
+    {
+        uint32_t value = read32Relaxed(addr);
+        readBarrier();
+        return value;
+    }
+
+    // Writes a register.  Earlier stores can't be performed after it
+    static void     write32(void* addr, uint32_t value)
+    {
+        writeBarrier();
+        write32Relaxed(addr, value);
+    }
+};
+//=================================================================================================
+
+
+
+//=================================================================================================
+// MmioBatch - Posts a series of register writes, and waits once for all of them to complete
+//
+// A PCIe write is "posted": the CPU sends it and moves on without waiting to hear that it
+// arrived.  A read, on the other hand, must wait for its completion, and can't pass the writes
+// ahead of it.  So rather than reading a register back after each write, a batch writes back to
+// back with no barriers between writes, and reads one register back at the end.
+//
+// Example:    MmioBatch batch;
+//             batch.write32(bar + 0x10, lo);
+//             batch.write32(bar + 0x14, hi);
+//             batch.complete(bar + 0x18);
+//=================================================================================================
+class MmioBatch
+{
+public:
+
+    // Constructor
+    MmioBatch() {};
+
+    // No copy or assignment constructor - objects of this class can't be copied
+    MmioBatch (const MmioBatch&) = delete;
+    MmioBatch& operator= (const MmioBatch&) = delete;
+
+    // Posts a write.  The first write of a batch is ordered after every store that came before
+    // the batch, and the rest of them follow it with no barriers at all
+    void     write32(void* addr, uint32_t value)
+    {
+        if (count_++ == 0) Mmio::writeBarrier();
+        Mmio::write32Relaxed(addr, value);
+    }
+
+    // Ends the batch by reading back a register that has no side-effects when it's read.  When
+    // this returns, the device has every write in the batch.  Returns the value that was read
+    uint32_t complete(const void* readBack)
+    {
+        count_ = 0;
+        Mmio::fullBarrier();
+        return Mmio::read32(readBack);
+    }
+
+    // Ends the batch without waiting for the writes to reach the device
+    void     complete()
+    {
+        if (count_) Mmio::writeBarrier();
+        count_ = 0;
+    }
+
+    // Returns the number of writes posted since the batch began
+    size_t   pending() const {return count_;}
+
+protected:
+
+    // The number of writes posted since the batch began
+    size_t   count_ = 0;
+};
+//=================================================================================================
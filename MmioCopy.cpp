@@ -0,0 +1,673 @@
+//=================================================================================================
+// MmioCopy.cpp - Implements copy routines for moving bulk data to and from memory-mapped BARs
+//=================================================================================================
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdexcept>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include "MmioCopy.h"
+#include "Util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define MMIO_X86
+    #include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+    #define MMIO_NEON
+    #include <arm_neon.h>
+    #include <sys/auxv.h>
+#endif
+using namespace std;
+
+// A kernel copies "bytes" bytes from "src" to "dst"
+typedef void (*copy_fn)(uint8_t* dst, const uint8_t* src, size_t bytes);
+
+// A block reader copies one BLOCK-aligned block from a BAR to "dst", without any fences
+typedef void (*block_fn)(uint8_t* dst, const uint8_t* src);
+
+// The wide kernels all move data in blocks of this many bytes (i.e., one cache-line)
+static const size_t BLOCK = 64;
+
+
+//=================================================================================================
+// storeFence() - Ensures that all prior stores (including non-temporal and write-combined stores)
+//                have been pushed out of the CPU before any later store
+//=================================================================================================
+static inline void storeFence()
+{
+#if defined(MMIO_X86)
+    _mm_sfence();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("dsb st" ::: "memory");
+#else
+    __sync_synchronize();
+#endif
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// loadFence() - Ensures that all prior loads (including streaming loads) have completed before
+//               any later memory access
+//=================================================================================================
+static inline void loadFence()
+{
+#if defined(MMIO_X86)
+    _mm_lfence();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("dmb ld" ::: "memory");
+#elif defined(__arm__)
+    __asm__ __volatile__("dmb sy" ::: "memory");
+#else
+    __sync_synchronize();
+#endif
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// fullFence() - Orders every prior load and store against every later load and store
+//=================================================================================================
+static inline void fullFence()
+{
+#if defined(MMIO_X86)
+    _mm_mfence();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("dsb sy" ::: "memory");
+#else
+    __sync_synchronize();
+#endif
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// headBytes() - Returns the number of bytes between "ptr" and the next BLOCK boundary, capped
+//               at "bytes"
+//=================================================================================================
+static inline size_t headBytes(const void* ptr, size_t bytes)
+{
+    size_t distance = (BLOCK - ((uintptr_t)ptr & (BLOCK - 1))) & (BLOCK - 1);
+    return distance < bytes ? distance : bytes;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// smallToDevice() - Copies bytes to a BAR using the widest naturally-aligned stores (up to 64
+//                   bits) that the destination address allows
+//=================================================================================================
+static void smallToDevice(uint8_t* dst, const uint8_t* src, size_t bytes)
+{
+    while (bytes)
+    {
+        uintptr_t addr = (uintptr_t)dst;
+
+        if ((addr & 7) == 0 && bytes >= 8)
+        {
+            uint64_t value;
+            memcpy(&value, src, 8);
+            *(volatile uint64_t*)dst = value;
+            dst += 8; src += 8; bytes -= 8;
+        }
+        else if ((addr & 3) == 0 && bytes >= 4)
+        {
+            uint32_t value;
+            memcpy(&value, src, 4);
+            *(volatile uint32_t*)dst = value;
+            dst += 4; src += 4; bytes -= 4;
+        }
+        else if ((addr & 1) == 0 && bytes >= 2)
+        {
+            uint16_t value;
+            memcpy(&value, src, 2);
+            *(volatile uint16_t*)dst = value;
+            dst += 2; src += 2; bytes -= 2;
+        }
+        else
+        {
+            *(volatile uint8_t*)dst = *src;
+            dst += 1; src += 1; bytes -= 1;
+        }
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// smallFromDevice() - Copies bytes from a BAR using the widest naturally-aligned loads (up to 64
+//                     bits) that the source address allows
+//=================================================================================================
+static void smallFromDevice(uint8_t* dst, const uint8_t* src, size_t bytes)
+{
+    while (bytes)
+    {
+        uintptr_t addr = (uintptr_t)src;
+
+        if ((addr & 7) == 0 && bytes >= 8)
+        {
+            uint64_t value = *(volatile const uint64_t*)src;
+            memcpy(dst, &value, 8);
+            dst += 8; src += 8; bytes -= 8;
+        }
+        else if ((addr & 3) == 0 && bytes >= 4)
+        {
+            uint32_t value = *(volatile const uint32_t*)src;
+            memcpy(dst, &value, 4);
+            dst += 4; src += 4; bytes -= 4;
+        }
+        else if ((addr & 1) == 0 && bytes >= 2)
+        {
+            uint16_t value = *(volatile const uint16_t*)src;
+            memcpy(dst, &value, 2);
+            dst += 2; src += 2; bytes -= 2;
+        }
+        else
+        {
+            *dst = *(volatile const uint8_t*)src;
+            dst += 1; src += 1; bytes -= 1;
+        }
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// scalarToDevice() / scalarFromDevice() / scalarBlock() - The kernels that work on any CPU
+//=================================================================================================
+static void scalarToDevice(uint8_t* dst, const uint8_t* src, size_t bytes)
+{
+    smallToDevice(dst, src, bytes);
+    storeFence();
+}
+
+static void scalarFromDevice(uint8_t* dst, const uint8_t* src, size_t bytes)
+{
+    smallFromDevice(dst, src, bytes);
+    loadFence();
+}
+
+static void scalarBlock(uint8_t* dst, const uint8_t* src)
+{
+    for (int i=0; i<(int)BLOCK; i += 8)
+    {
+        uint64_t value = *(volatile const uint64_t*)(src + i);
+        memcpy(dst + i, &value, 8);
+    }
+}
+//=================================================================================================
+
+
+
+#if defined(MMIO_X86)
+//=================================================================================================
+// avx2ToDevice() - Copies to a BAR in 64-byte blocks, using pairs of 256-bit non-temporal stores
+//=================================================================================================
+__attribute__((target("avx2")))
+static void avx2ToDevice(uint8_t* dst, const uint8_t* src, size_t bytes)
+{
+    // Copy the bytes that come before the first 64-byte boundary in the destination
+    size_t head = headBytes(dst, bytes);
+    smallToDevice(dst, src, head);
+    dst += head; src += head; bytes -= head;
+
+    // Copy full 64-byte blocks
+    while (bytes >= BLOCK)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(src     ));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
+        _mm256_stream_si256((__m256i*)(dst     ), a);
+        _mm256_stream_si256((__m256i*)(dst + 32), b);
+        dst += BLOCK; src += BLOCK; bytes -= BLOCK;
+    }
+
+    // Copy whatever is left over
+    smallToDevice(dst, src, bytes);
+
+    // Non-temporal stores are weakly ordered, and must be fenced
+    _mm_sfence();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// avx2FromDevice() - Copies from a BAR in 64-byte blocks, using pairs of 256-bit streaming loads
+//=================================================================================================
+__attribute__((target("avx2")))
+static void avx2FromDevice(uint8_t* dst, const uint8_t* src, size_t bytes)
+{
+    // Streaming loads are weakly ordered, make sure earlier stores and loads are complete first
+    _mm_mfence();
+
+    // Copy the bytes that come before the first 64-byte boundary in the source
+    size_t head = headBytes(src, bytes);
+    smallFromDevice(dst, src, head);
+    dst += head; src += head; bytes -= head;
+
+    // Copy full 64-byte blocks
+    while (bytes >= BLOCK)
+    {
+        __m256i a = _mm256_stream_load_si256((const __m256i*)(src     ));
+        __m256i b = _mm256_stream_load_si256((const __m256i*)(src + 32));
+        _mm256_storeu_si256((__m256i*)(dst     ), a);
+        _mm256_storeu_si256((__m256i*)(dst + 32), b);
+        dst += BLOCK; src += BLOCK; bytes -= BLOCK;
+    }
+
+    // Copy whatever is left over
+    smallFromDevice(dst, src, bytes);
+
+    // And don't let later loads pass the streaming loads
+    _mm_lfence();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// avx2Block() - Reads one 64-byte block from a BAR with a pair of 256-bit streaming loads
+//=================================================================================================
+__attribute__((target("avx2")))
+static void avx2Block(uint8_t* dst, const uint8_t* src)
+{
+    __m256i a = _mm256_stream_load_si256((const __m256i*)(src     ));
+    __m256i b = _mm256_stream_load_si256((const __m256i*)(src + 32));
+    _mm256_storeu_si256((__m256i*)(dst     ), a);
+    _mm256_storeu_si256((__m256i*)(dst + 32), b);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// avx512ToDevice() - Copies to a BAR in 64-byte blocks, using 512-bit non-temporal stores
+//=================================================================================================
+__attribute__((target("avx512f")))
+static void avx512ToDevice(uint8_t* dst, const uint8_t* src, size_t bytes)
+{
+    // Copy the bytes that come before the first 64-byte boundary in the destination
+    size_t head = headBytes(dst, bytes);
+    smallToDevice(dst, src, head);
+    dst += head; src += head; bytes -= head;
+
+    // Copy full 64-byte blocks
+    while (bytes >= BLOCK)
+    {
+        __m512i a = _mm512_loadu_si512((const void*)src);
+        _mm512_stream_si512((__m512i*)dst, a);
+        dst += BLOCK; src += BLOCK; bytes -= BLOCK;
+    }
+
+    // Copy whatever is left over
+    smallToDevice(dst, src, bytes);
+
+    // Non-temporal stores are weakly ordered, and must be fenced
+    _mm_sfence();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// avx512FromDevice() - Copies from a BAR in 64-byte blocks, using 512-bit streaming loads
+//=================================================================================================
+__attribute__((target("avx512f")))
+static void avx512FromDevice(uint8_t* dst, const uint8_t* src, size_t bytes)
+{
+    // Streaming loads are weakly ordered, make sure earlier stores and loads are complete first
+    _mm_mfence();
+
+    // Copy the bytes that come before the first 64-byte boundary in the source
+    size_t head = headBytes(src, bytes);
+    smallFromDevice(dst, src, head);
+    dst += head; src += head; bytes -= head;
+
+    // Copy full 64-byte blocks
+    while (bytes >= BLOCK)
+    {
+        __m512i a = _mm512_stream_load_si512((void*)src);
+        _mm512_storeu_si512((void*)dst, a);
+        dst += BLOCK; src += BLOCK; bytes -= BLOCK;
+    }
+
+    // Copy whatever is left over
+    smallFromDevice(dst, src, bytes);
+
+    // And don't let later loads pass the streaming loads
+    _mm_lfence();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// avx512Block() - Reads one 64-byte block from a BAR with a single 512-bit streaming load
+//=================================================================================================
+__attribute__((target("avx512f")))
+static void avx512Block(uint8_t* dst, const uint8_t* src)
+{
+    __m512i a = _mm512_stream_load_si512((void*)src);
+    _mm512_storeu_si512((void*)dst, a);
+}
+//=================================================================================================
+#endif
+
+
+
+#if defined(MMIO_NEON)
+//=================================================================================================
+// neonToDevice() - Copies to a BAR in 64-byte blocks, using four 128-bit NEON stores per block
+//=================================================================================================
+static void neonToDevice(uint8_t* dst, const uint8_t* src, size_t bytes)
+{
+    // Copy the bytes that come before the first 64-byte boundary in the destination
+    size_t head = headBytes(dst, bytes);
+    smallToDevice(dst, src, head);
+    dst += head; src += head; bytes -= head;
+
+    // Copy full 64-byte blocks
+    while (bytes >= BLOCK)
+    {
+        uint8x16_t a = vld1q_u8(src     );
+        uint8x16_t b = vld1q_u8(src + 16);
+        uint8x16_t c = vld1q_u8(src + 32);
+        uint8x16_t d = vld1q_u8(src + 48);
+        vst1q_u8(dst     , a);
+        vst1q_u8(dst + 16, b);
+        vst1q_u8(dst + 32, c);
+        vst1q_u8(dst + 48, d);
+        dst += BLOCK; src += BLOCK; bytes -= BLOCK;
+    }
+
+    // Copy whatever is left over
+    smallToDevice(dst, src, bytes);
+
+    // Make sure the stores have left the CPU
+    storeFence();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// neonFromDevice() - Copies from a BAR in 64-byte blocks, using four 128-bit NEON loads per block
+//=================================================================================================
+static void neonFromDevice(uint8_t* dst, const uint8_t* src, size_t bytes)
+{
+    // Make sure earlier stores and loads are complete before we start reading
+    fullFence();
+
+    // Copy the bytes that come before the first 64-byte boundary in the source
+    size_t head = headBytes(src, bytes);
+    smallFromDevice(dst, src, head);
+    dst += head; src += head; bytes -= head;
+
+    // Copy full 64-byte blocks
+    while (bytes >= BLOCK)
+    {
+        uint8x16_t a = vld1q_u8(src     );
+        uint8x16_t b = vld1q_u8(src + 16);
+        uint8x16_t c = vld1q_u8(src + 32);
+        uint8x16_t d = vld1q_u8(src + 48);
+        vst1q_u8(dst     , a);
+        vst1q_u8(dst + 16, b);
+        vst1q_u8(dst + 32, c);
+        vst1q_u8(dst + 48, d);
+        dst += BLOCK; src += BLOCK; bytes -= BLOCK;
+    }
+
+    // Copy whatever is left over
+    smallFromDevice(dst, src, bytes);
+
+    // Don't let later accesses pass these loads
+    loadFence();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// neonBlock() - Reads one 64-byte block from a BAR with four 128-bit NEON loads
+//=================================================================================================
+static void neonBlock(uint8_t* dst, const uint8_t* src)
+{
+    uint8x16_t a = vld1q_u8(src     );
+    uint8x16_t b = vld1q_u8(src + 16);
+    uint8x16_t c = vld1q_u8(src + 32);
+    uint8x16_t d = vld1q_u8(src + 48);
+    vst1q_u8(dst     , a);
+    vst1q_u8(dst + 16, b);
+    vst1q_u8(dst + 32, c);
+    vst1q_u8(dst + 48, d);
+}
+//=================================================================================================
+#endif
+
+
+// These are the kernels currently in use.  They start out as the scalar kernels (which are
+// constant-initialized, so they're valid even during static initialization), and are replaced
+// with the best available kernels by "autoSelect" below.
+static copy_fn            toDeviceFn   = scalarToDevice;
+static copy_fn            fromDeviceFn = scalarFromDevice;
+static block_fn           blockFn      = scalarBlock;
+static MmioCopy::kernel_t currentKernel = MmioCopy::KERNEL_SCALAR;
+
+// Select the best kernel for this CPU at startup
+static bool autoSelect = (MmioCopy::selectKernel(MmioCopy::KERNEL_AUTO), true);
+
+
+//=================================================================================================
+// isSupported() - Returns true if this CPU supports the specified kernel
+//=================================================================================================
+bool MmioCopy::isSupported(kernel_t kernel)
+{
+    switch (kernel)
+    {
+        case KERNEL_AUTO:
+        case KERNEL_SCALAR:
+            return true;
+
+#if defined(MMIO_X86)
+        case KERNEL_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+
+        case KERNEL_AVX512:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx512f");
+#endif
+
+#if defined(MMIO_NEON)
+        case KERNEL_NEON:
+    #if defined(__aarch64__)
+            return true;
+    #elif defined(HWCAP_ARM_NEON)
+            return (getauxval(AT_HWCAP) & HWCAP_ARM_NEON) != 0;
+    #else
+            return true;
+    #endif
+#endif
+
+        default:
+            return false;
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// selectKernel() - Selects the kernel that toDevice() and fromDevice() will use
+//=================================================================================================
+void MmioCopy::selectKernel(kernel_t kernel)
+{
+    // If the caller wants us to choose, pick the best kernel this CPU supports
+    if (kernel == KERNEL_AUTO)
+    {
+        if      (isSupported(KERNEL_AVX512)) kernel = KERNEL_AVX512;
+        else if (isSupported(KERNEL_AVX2  )) kernel = KERNEL_AVX2;
+        else if (isSupported(KERNEL_NEON  )) kernel = KERNEL_NEON;
+        else                                 kernel = KERNEL_SCALAR;
+    }
+
+    // If the CPU can't run this kernel, complain
+    if (!isSupported(kernel)) throwRuntime("Copy kernel %s not supported", kernelName(kernel));
+
+    switch (kernel)
+    {
+#if defined(MMIO_X86)
+        case KERNEL_AVX2:
+            toDeviceFn   = avx2ToDevice;
+            fromDeviceFn = avx2FromDevice;
+            blockFn      = avx2Block;
+            break;
+
+        case KERNEL_AVX512:
+            toDeviceFn   = avx512ToDevice;
+            fromDeviceFn = avx512FromDevice;
+            blockFn      = avx512Block;
+            break;
+#endif
+
+#if defined(MMIO_NEON)
+        case KERNEL_NEON:
+            toDeviceFn   = neonToDevice;
+            fromDeviceFn = neonFromDevice;
+            blockFn      = neonBlock;
+            break;
+#endif
+
+        default:
+            toDeviceFn   = scalarToDevice;
+            fromDeviceFn = scalarFromDevice;
+            blockFn      = scalarBlock;
+            break;
+    }
+
+    // Keep track of which kernel is in use
+    currentKernel = kernel;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// kernel() - Returns the kernel currently in use
+//=================================================================================================
+MmioCopy::kernel_t MmioCopy::kernel()
+{
+    return currentKernel;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// kernelName() - Returns the human-readable name of a kernel
+//=================================================================================================
+const char* MmioCopy::kernelName(kernel_t kernel)
+{
+    switch (kernel)
+    {
+        case KERNEL_AUTO:   return "auto";
+        case KERNEL_SCALAR: return "scalar";
+        case KERNEL_AVX2:   return "avx2";
+        case KERNEL_AVX512: return "avx512";
+        case KERNEL_NEON:   return "neon";
+    }
+    return "unknown";
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// toDevice() - Copies host memory to a BAR
+//
+// Passed: dst   = user-space address inside of a mapped BAR
+//         src   = host memory
+//         bytes = number of bytes to copy
+//=================================================================================================
+void MmioCopy::toDevice(void* dst, const void* src, size_t bytes)
+{
+    toDeviceFn((uint8_t*)dst, (const uint8_t*)src, bytes);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// fromDevice() - Copies a BAR to host memory
+//
+// Passed: dst   = host memory
+//         src   = user-space address inside of a mapped BAR
+//         bytes = number of bytes to copy
+//=================================================================================================
+void MmioCopy::fromDevice(void* dst, const void* src, size_t bytes)
+{
+    fromDeviceFn((uint8_t*)dst, (const uint8_t*)src, bytes);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// gather() - Reads a list of 32-bit registers from a BAR in a single pass
+//
+// Passed: dst      = where to store the register values. dst[i] receives the register at
+//                    offsets[i]
+//         base     = user-space address of the BAR
+//         offsets  = the byte offset of each register within the BAR
+//         count    = the number of registers to read
+//         coalesce = if true, registers that share a 64-byte block are fetched with a single
+//                    wide read of that block
+//
+// Notes: Coalescing reads neighboring registers that weren't asked for.   Don't coalesce if the
+//        BAR contains registers that have side-effects when they're read.   When coalescing,
+//        the BAR must be at least 64 bytes long.
+//=================================================================================================
+void MmioCopy::gather(uint32_t* dst, const void* base, const uint32_t* offsets, size_t count,
+                      bool coalesce)
+{
+    const uint8_t* bar = (const uint8_t*)base;
+
+    // Make sure earlier stores and loads are complete before we start reading
+    fullFence();
+
+    // If we're not coalescing, this is a simple loop of 32-bit reads
+    if (!coalesce)
+    {
+        for (size_t i=0; i<count; ++i) dst[i] = *(volatile const uint32_t*)(bar + offsets[i]);
+        loadFence();
+        return;
+    }
+
+    // Sort the register indices by offset, so registers in the same block are adjacent
+    vector<uint32_t> order(count);
+    iota(order.begin(), order.end(), 0);
+    sort(order.begin(), order.end(), [offsets](uint32_t a, uint32_t b)
+    {
+        return offsets[a] < offsets[b];
+    });
+
+    // This holds a copy of the most recently fetched block
+    alignas(BLOCK) uint8_t block[BLOCK];
+    uint64_t blockOffset = ~(uint64_t)0;
+
+    // Loop through the registers in offset order
+    for (uint32_t index : order)
+    {
+        uint32_t offset = offsets[index];
+
+        // Registers that aren't 32-bit aligned are read on their own
+        if (offset & 3)
+        {
+            dst[index] = *(volatile const uint32_t*)(bar + offset);
+            continue;
+        }
+
+        // If this register isn't in the block we fetched most recently, fetch its block
+        if ((offset & ~(BLOCK - 1)) != blockOffset)
+        {
+            blockOffset = offset & ~(BLOCK - 1);
+            blockFn(block, bar + blockOffset);
+        }
+
+        // Extract this register from the block
+        memcpy(&dst[index], block + (offset & (BLOCK - 1)), 4);
+    }
+
+    // Don't let later loads pass the loads we just did
+    loadFence();
+}
+//=================================================================================================
@@ -0,0 +1,51 @@
+//=================================================================================================
+// MmioCopy.h - Defines copy routines for moving bulk data to and from memory-mapped PCI BARs
+//
+// libc's memcpy() makes no promise about the width of the stores it issues, and the width of
+// the stores is what determines the size of the PCIe TLPs that reach the device.   The routines
+// here copy with the widest non-temporal stores (and the widest loads) that the CPU supports,
+// and pick the best kernel at run-time.
+//=================================================================================================
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+class MmioCopy
+{
+public:
+
+    // These are the copy kernels that might be available on this CPU
+    enum kernel_t
+    {
+        KERNEL_AUTO,        // Choose the best kernel this CPU supports
+        KERNEL_SCALAR,      // 64-bit stores and loads, available everywhere
+        KERNEL_AVX2,        // 256-bit non-temporal stores and streaming loads (x86)
+        KERNEL_AVX512,      // 512-bit non-temporal stores and streaming loads (x86)
+        KERNEL_NEON         // 128-bit NEON stores and loads, four at a time (ARM)
+    };
+
+    // Copies host memory to a BAR, then fences so the stores are on their way to the device
+    static void toDevice(void* dst, const void* src, size_t bytes);
+
+    // Copies a BAR into host memory, using the widest loads the CPU supports
+    static void fromDevice(void* dst, const void* src, size_t bytes);
+
+    // Reads a list of 32-bit registers at the specified BAR offsets in a single pass.  If
+    // "coalesce" is true, registers in the same 64-byte block are fetched with one wide read,
+    // which also reads the registers between them: only ask for that when none of them has
+    // side-effects when it's read
+    static void gather(uint32_t* dst, const void* base, const uint32_t* offsets, size_t count,
+                       bool coalesce = false);
+
+    // Selects a specific kernel.  Throws if this CPU doesn't support the requested kernel
+    static void selectKernel(kernel_t kernel);
+
+    // Returns true if this CPU supports the specified kernel
+    static bool isSupported(kernel_t kernel);
+
+    // Returns the kernel currently in use
+    static kernel_t kernel();
+
+    // Returns the name of a kernel, for display purposes
+    static const char* kernelName(kernel_t kernel);
+};
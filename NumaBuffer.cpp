@@ -0,0 +1,70 @@
+//=================================================================================================
+// NumaBuffer.cpp - Implements a class that allocates a host buffer on a specific NUMA node
+//=================================================================================================
+#include <unistd.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdexcept>
+#include "NumaBuffer.h"
+#include "Util.h"
+using namespace std;
+
+// The memory policy for mbind() that says "allocate on this node if possible".  This is from
+// <numaif.h>, which we don't include so that we don't depend on libnuma
+static const int MPOL_PREFERRED = 1;
+
+// The number of bits in the node-mask we hand to mbind()
+static const unsigned long MAX_NODES = 8 * sizeof(unsigned long);
+
+
+//=================================================================================================
+// alloc() - Allocates a page-aligned buffer whose pages live on the specified NUMA node
+//
+// Passed: size     = the size of the buffer in bytes
+//         numaNode = the NUMA node to allocate from, or -1 for "no preference"
+//=================================================================================================
+void NumaBuffer::alloc(size_t size, int numaNode)
+{
+    // Free any buffer we may already have
+    free();
+
+    // Reserve the address space.  No physical pages are allocated yet
+    void* ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    // If that failed, tell the caller
+    if (ptr == MAP_FAILED) throwRuntime("NumaBuffer: can't allocate 0x%zx bytes", size);
+
+    // Tell the kernel which node we'd like the pages to come from.  If this fails (because the
+    // kernel doesn't support NUMA, for instance) we just get memory from wherever
+    if (numaNode >= 0 && numaNode < (int)MAX_NODES)
+    {
+        unsigned long nodeMask = 1UL << numaNode;
+        syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &nodeMask, MAX_NODES, 0);
+    }
+
+    // Touch every page now, so that they're allocated (on the right node) up front
+    memset(ptr, 0, size);
+
+    // Record the address and size of the buffer
+    userspaceAddr_ = ptr;
+    size_          = size;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// free() - Frees the buffer if one has been allocated
+//=================================================================================================
+void NumaBuffer::free()
+{
+    // If we have a buffer, give it back to the kernel
+    if (userspaceAddr_) munmap(userspaceAddr_, size_);
+
+    // Indicate that we no longer have a buffer
+    userspaceAddr_ = nullptr;
+    size_          = 0;
+}
+//=================================================================================================
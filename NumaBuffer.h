@@ -0,0 +1,49 @@
+//=================================================================================================
+// NumaBuffer.h - Defines a class that allocates a host buffer on a specific NUMA node
+//
+// Staging buffers that feed a PCI device should live in the memory attached to the same socket
+// as the device.   PciDevice::numaNode() tells you which node that is.
+//=================================================================================================
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+class NumaBuffer
+{
+public:
+
+    // Constructor
+    NumaBuffer() {userspaceAddr_ = nullptr; size_ = 0;}
+
+    // Constructor - allocates a buffer
+    NumaBuffer(size_t size, int numaNode) : NumaBuffer() {alloc(size, numaNode);}
+
+    // No copy or assignment constructor - objects of this class can't be copied
+    NumaBuffer (const NumaBuffer&) = delete;
+    NumaBuffer& operator= (const NumaBuffer&) = delete;
+
+    // Destructor, frees the buffer
+    ~NumaBuffer() {free();}
+
+    // Allocates a page-aligned buffer on the specified NUMA node.  A numaNode of -1 means
+    // "no preference"
+    void    alloc(size_t size, int numaNode);
+
+    // Frees the buffer if one has been allocated
+    void    free();
+
+    // Call these to return either a void* or a byte* to the buffer
+    uint8_t* bptr() {return (uint8_t*)userspaceAddr_;}
+    void*    vptr() {return userspaceAddr_;}
+
+    // Returns the size of the buffer in bytes
+    size_t   size() {return size_;}
+
+protected:
+
+    // If this is not null, it points to the buffer
+    void*   userspaceAddr_;
+
+    // The size of the buffer
+    size_t  size_;
+};
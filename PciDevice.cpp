@@ -3,17 +3,25 @@
 //=================================================================================================
 #include <unistd.h>
 #include <string>
-#include <filesystem>
 #include <fstream>
 #include <stdarg.h>
 #include <string.h>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include "PciDevice.h"
+#include "Util.h"
 using namespace std;
 
 #define c(s) s.c_str()
 
+// These are the IORESOURCE_xxx flags (from <linux/ioport.h>) in the sysfs "resource" file
+static const uint64_t IORESOURCE_IO       = 0x00000100;
+static const uint64_t IORESOURCE_MEM      = 0x00000200;
+static const uint64_t IORESOURCE_PREFETCH = 0x00002000;
+
+// A PCI device has at most this many BARs
+static const int PCI_BAR_COUNT = 6;
+
 
 //=================================================================================================
 // FileDes - This is a standard Unix/Linux file descriptor that closes itself
@@ -49,57 +57,58 @@ public:
 
 
 
-//=================================================================================================
-// throwRuntime() - Throws a runtime exception
-//=================================================================================================
-static void throwRuntime(const char* fmt, ...)
-{
-    char buffer[1024];
-    va_list ap;
-    va_start(ap, fmt);
-    vsprintf(buffer, fmt, ap);
-    va_end(ap);
-
-    throw runtime_error(buffer);
-}
-//=================================================================================================
-
-
 //=================================================================================================
 // mapResources() - Maps each memory-mappable resource for this device into user-space
 //
-// On Entry: resource_ = list of memory-mappable resources (the phys addr and the size)
+// On Entry: resource_   = list of memory-mappable resources (the phys addr and the size)
+//           deviceDir_  = the sysfs directory of the device
 //
 // On Exit:  resource_ = each entry has userspace "baseAddr" filled in
+//
+// Notes: Each BAR is mapped through its sysfs "resourceN" file, which the kernel maps uncached.
+//        Prefetchable BARs are mapped through "resourceN_wc" instead (if the kernel provides it)
+//        so that bulk stores to them are write-combined into large PCIe TLPs.
 //=================================================================================================
 void PciDevice::mapResources()
 {
-    const char* filename = "/dev/mem";
-
     // These are the memory protection flags we'll use when mapping the device into memory
     const int protection = PROT_READ | PROT_WRITE;
 
-    // Open the /dev/mem device
-    FileDes fd = ::open(filename, O_RDWR| O_SYNC);
-
-    // If that open failed, we're done here
-    if (fd < 0)
-    {
-        close();
-        throwRuntime("Can't open %s", filename);
-    }
-
     // Loop through each entry in the list of memory-mappable resources for this PCI device
     for (auto& bar : resource_)
     {
+        // This is the sysfs file that maps this BAR with default (uncached) attributes
+        string filename = deviceDir_ + "/resource" + to_string(bar.barIndex);
+
+        // If this BAR is prefetchable, we'd rather map it write-combined
+        if (bar.flags & IORESOURCE_PREFETCH)
+        {
+            string wcFilename = filename + "_wc";
+            if (access(c(wcFilename), F_OK) == 0)
+            {
+                filename = wcFilename;
+                bar.writeCombined = true;
+            }
+        }
+
+        // Open the sysfs resource file for this BAR
+        FileDes fd = ::open(c(filename), O_RDWR);
+
+        // If that open failed, we're done here
+        if (fd < 0)
+        {
+            close();
+            throwRuntime("Can't open %s", c(filename));
+        }
+
         // Map the resources of this PCI device's BAR into our user-space memory map
-        void* ptr = ::mmap(0, bar.size, protection, MAP_SHARED, fd, bar.physAddr);
+        void* ptr = ::mmap(0, bar.size, protection, MAP_SHARED, fd, 0);
 
         // If a mapping error occurs, don't continue trying to map resources
         if (ptr == MAP_FAILED) 
         {
             close();
-            throwRuntime("mmap failed on 0x%lx for size 0x%lx", bar.physAddr, bar.size);
+            throwRuntime("mmap failed on %s for size 0x%zx", c(filename), bar.size);
         }
         
         // Otherwise, save the user-space address that our PCI resource is mapped to
@@ -110,24 +119,75 @@ void PciDevice::mapResources()
 
 
 //=================================================================================================
-// getIntegerFromFile() - Opens the specified file, reads the first line, expects to find an 
-//                        integer encoded as an ASCII string, and returns the value of that string
+// bar() - Returns the resource that describes the specified BAR
 //=================================================================================================
-static int getIntegerFromFile(string filename)
+PciDevice::resource_t& PciDevice::bar(int barIndex)
+{
+    // Look for the resource that corresponds to this BAR
+    for (auto& resource : resource_)
+    {
+        if (resource.barIndex == barIndex) return resource;
+    }
+
+    // If we get here, that BAR isn't mapped
+    throwRuntime("BAR %i is not mapped", barIndex);
+
+    // We'll never get here, but this keeps the compiler happy
+    return resource_[0];
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// parseCpuList() - Parses a Linux CPU-list string such as "0-7,16-23" into a list of CPUs
+//=================================================================================================
+vector<int> PciDevice::parseCpuList(const string& cpuList)
+{
+    vector<int> result;
+    const char* p = c(cpuList);
+
+    while (*p)
+    {
+        // Fetch the first CPU number in this range
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p) break;
+        p = end;
+
+        // If this is a range, fetch the last CPU number in the range
+        long last = first;
+        if (*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+
+        // Add this range of CPUs to the result
+        for (long cpu = first; cpu <= last; ++cpu) result.push_back((int)cpu);
+
+        // Skip over the comma between ranges
+        if (*p == ',') ++p; else break;
+    }
+
+    return result;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// readLocality() - Reads the "numa_node" and "local_cpulist" files for the device
+//=================================================================================================
+void PciDevice::readLocality()
 {
     string line;
-   
-    // Open the specified file.  It will contain a line of ASCII data
-    ifstream file(filename);
 
-    // If we couldn't open the file, hand the caller an invalid value   
-    if (!file.is_open()) return -1;
-    
-    // Fetch the first line of the file
-    getline(file, line);
+    // Fetch the NUMA node this device is attached to.  The kernel reports -1 if it doesn't know
+    ifstream numaFile(deviceDir_ + "/numa_node");
+    if (numaFile.is_open() && getline(numaFile, line)) numaNode_ = strtol(c(line), 0, 10);
 
-    // And hand the caller that line, decoded as an integer
-    return stoi(line, 0, 0);
+    // Fetch the list of CPUs that are local to this device
+    ifstream cpuFile(deviceDir_ + "/local_cpulist");
+    if (cpuFile.is_open() && getline(cpuFile, line)) localCpus_ = parseCpuList(line);
 }
 //=================================================================================================
 
@@ -145,6 +205,11 @@ void PciDevice::close()
 
     // Delete the list of memory-mapped resources
     resource_.clear();
+
+    // We no longer have a device open
+    deviceDir_.clear();
+    numaNode_ = -1;
+    localCpus_.clear();
 }
 //=================================================================================================
 
@@ -161,12 +226,16 @@ void PciDevice::close()
 //        Each line contains 3 fields separated one space character:
 //           (1) The physical starting address of the memory mapped resource
 //           (2) The physical ending address of the memory mapped resource
-//           (3) A set of flags that we don't care about    
+//           (3) A set of IORESOURCE_xxx flags
+//
+//        Lines with a starting address of 0 and I/O-port BARs are skipped.  I/O-port BARs can't
+//        be memory mapped.
 //=================================================================================================
 std::vector<PciDevice::resource_t> PciDevice::getResourceList(std::string deviceDir)
 {
     string             line;
     vector<resource_t> result;
+    int                barIndex = -1;
     
     // This file will contain 1 line per potential resource
     string filename = deviceDir + "/resource";
@@ -180,22 +249,39 @@ std::vector<PciDevice::resource_t> PciDevice::getResourceList(std::string device
     // Loop through each line of the file...
     while (getline(file, line))
     {
-        // Get pointers to the 1st and 2nd text fields of that line
+        // Line N of the file describes BAR N
+        ++barIndex;
+
+        // Only lines 0 thru 5 are BARs.  The lines after that are the expansion ROM and such
+        if (barIndex >= PCI_BAR_COUNT) break;
+
+        // Get pointers to the 1st, 2nd, and 3rd text fields of that line
         const char* p1 = c(line);
         const char* p2 = strchr(p1, ' ');
+        const char* p3 = p2 ? strchr(p2 + 1, ' ') : nullptr;
         
+        // If this line is malformed, ignore it
+        if (p2 == nullptr || p3 == nullptr) continue;
+
         // Parse the physical starting and ending address of this memory-mappable resource
-        off_t starting_address = strtoll(p1, 0, 0);
-        off_t ending_address   = strtoll(p2, 0, 0);
+        off_t    starting_address = strtoull(p1, 0, 0);
+        off_t    ending_address   = strtoull(p2, 0, 0);
+        uint64_t flags            = strtoull(p3, 0, 0);
 
         // A starting address of 0 means "this line doesn't define a memory-mappable resource"
         if (starting_address == 0) continue;
 
+        // I/O-port BARs aren't memory-mappable
+        if (flags & IORESOURCE_IO) continue;
+
+        // Neither is anything else that isn't a memory BAR
+        if ((flags & IORESOURCE_MEM) == 0) continue;
+
         // Compute how many bytes long that memory region is
         size_t size = ending_address - starting_address + 1;
 
         // Append the description of this mappable resource into our result vector        
-        result.push_back({0, size, starting_address});
+        result.push_back({0, size, starting_address, barIndex, flags, false});
     }
 
     // If there are no memory-mappable resources, create an error message
@@ -210,55 +296,51 @@ std::vector<PciDevice::resource_t> PciDevice::getResourceList(std::string device
 
 
 //=================================================================================================
-// open() - Opens a connection to the specified PCIe device
+// open() - Opens a connection to the first PCIe device with the specified vendor and device ID
 //
 // Passed: vendorID  = The vendor ID of the PCIe device we're looking for
 //         deviceID  = The device ID of the PCIe device we're looking for
 //         deviceDir = Name of the file-system directory where PCI device information can
 //                     be found.   If empty-string, a sensible default is used
+//
+// Notes: To open every device with a given vendor ID and device ID, use PciIndex::open()
 //=================================================================================================
 void PciDevice::open(int vendorID, int deviceID, string deviceDir)
 {
-    string  dirName;
-
-    // We have not yet found the device that we're looking for
-    bool found = false;
-
-    // If we already have a PCIe device mapped, unmap it
-    close();
-
-    // If the caller didn't specify a device-directory, use the default
-    if (deviceDir.empty()) deviceDir = "/sys/bus/pci/devices";
+    // Find every device in the system with this vendor ID and device ID
+    auto matches = PciIndex(deviceDir).select(vendorID, deviceID);
 
-    // Loop through the entry for each device in the specified directory...
-    for (auto const& entry : filesystem::directory_iterator(deviceDir)) 
+    // If we couldn't find a device with that vendor ID and device ID, complain
+    if (matches.empty())
     {
-        // Ignore any directory entry that isn't itself a directory
-        if (!entry.is_directory()) continue;
+        close();
+        throwRuntime("No PCI device found for vendor=0x%X, device=0x%X", vendorID, deviceID);
+    }
 
-        // Fetch the name of the directory that we're about to examine
-        dirName = entry.path().string();
+    // Open the first one we found
+    open(matches[0]);
+}
+//=================================================================================================
 
-        // Fetch the vendor ID and device ID of this device
-        int thisVendorID = getIntegerFromFile(dirName + "/vendor");
-        int thisDeviceID = getIntegerFromFile(dirName + "/device");
 
-        // If this vendor ID and device ID match the caller's, we have found 
-        // the droid we're looking for.
-        if (thisVendorID == vendorID && thisDeviceID == deviceID)
-        {
-            found = true;
-            break;
-        }
-    }
+//=================================================================================================
+// open() - Opens a connection to a PCIe device that was found by a PciIndex
+//=================================================================================================
+void PciDevice::open(const PciIndex::device_t& device)
+{
+    // If we already have a PCIe device mapped, unmap it
+    close();
 
-    // If we couldn't find a device with that vendor ID and device ID, complain
-    if (!found) throwRuntime("No PCI device found for vendor=0x%X, device=0x%X", vendorID, deviceID);
+    // Keep track of the sysfs directory for the device we're opening
+    deviceDir_ = device.dir;
 
     // Fetch the physical address and size of each resource (i.e. BAR) that our device supports
-    resource_ = getResourceList(dirName);
+    resource_ = getResourceList(deviceDir_);
 
     // Memory map each of the PCI device resources into userspace
     mapResources();
+
+    // Find out which NUMA node and which CPUs are closest to the device
+    readLocality();
 }
 //=================================================================================================
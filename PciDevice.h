@@ -2,8 +2,10 @@
 // PciDevice.h - Defines a generic class for mapping PCIe devices into user-space
 //=================================================================================================
 #pragma once
+#include <stdint.h>
 #include <string>
 #include <vector>
+#include "PciIndex.h"
 
 class PciDevice
 {
@@ -12,21 +14,47 @@ public:
     // Default constructor
     PciDevice() {};
 
-    // Destructor
-    ~PciDevice() {close();}
+    // Destructor.  It's virtual, since SimDevice derives from this
+    virtual ~PciDevice() {close();}
 
     // No copy or assignment constructor - objects of this class can't be copied
     PciDevice (const PciDevice&) = delete;
     PciDevice& operator= (const PciDevice&) = delete;
 
     // These each describe a memory mapped resource from a PCI device
-    struct resource_t {uint8_t* baseAddr; size_t size; off_t physAddr;};
+    struct resource_t
+    {
+        uint8_t* baseAddr;          // Where the resource is mapped in user-space
+        size_t   size;              // Size of the resource in bytes
+        off_t    physAddr;          // Physical address of the resource
+        int      barIndex;          // Which BAR (i.e, which "resourceN" file) this resource is
+        uint64_t flags;             // The IORESOURCE_xxx flags from the sysfs "resource" file
+        bool     writeCombined;     // True if this resource was mapped via "resourceN_wc"
+    };
 
-    // Opens a connection to a PCIe device
+    // Opens a connection to the first PCIe device with the specified vendor ID and device ID
     void    open(int vendorID, int deviceID, std::string deviceDir = "");
 
+    // Opens a connection to a PCIe device that was found in a PciIndex
+    void    open(const PciIndex::device_t& device);
+
+    // Returns the sysfs directory of the device we have open
+    const std::string& deviceDir() {return deviceDir_;}
+
+    // Returns the NUMA node the device is attached to (-1 = unknown)
+    int     numaNode() {return numaNode_;}
+
+    // Returns the list of CPUs that are local to the device (empty = unknown)
+    const std::vector<int>& localCpus() {return localCpus_;}
+
+    // Parses a Linux CPU-list string such as "0-7,16-23" into a list of CPU numbers
+    static std::vector<int> parseCpuList(const std::string& cpuList);
+
     // Fetches the list of memory mappable resources
     std::vector<resource_t>& resourceList() {return resource_;}
+
+    // Fetches the resource for a specific BAR.  Throws if that BAR isn't mapped
+    resource_t& bar(int barIndex);
     
     // Stop access to the PCI device
     void    close();
@@ -39,6 +67,18 @@ protected:
     // Memory maps the resources whose definitions are in resource_
     void mapResources();
 
+    // Reads the NUMA node and local CPU list of the device from sysfs
+    void readLocality();
+
+    // The sysfs directory of the device we have open
+    std::string deviceDir_;
+
+    // The NUMA node the device is attached to
+    int numaNode_ = -1;
+
+    // The CPUs that are local to the device
+    std::vector<int> localCpus_;
+
     // Contains one entry for each resource (i.e, BAR) that is configured in the PCI device
     std::vector<resource_t> resource_;
 };
@@ -0,0 +1,219 @@
+//=================================================================================================
+// PciIndex.cpp - Implements a class that indexes the PCI devices in the system
+//=================================================================================================
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <algorithm>
+#include "PciIndex.h"
+#include "PciDevice.h"
+using namespace std;
+
+// The offset in PCI config space where the extended capabilities begin
+static const int EXT_CAP_START = 0x100;
+
+// The size of PCI Express config space
+static const int CONFIG_SIZE = 4096;
+
+// The extended capability ID of the Device Serial Number capability
+static const int EXT_CAP_ID_DSN = 0x0003;
+
+
+//=================================================================================================
+// readIntegerFile() - Reads a small sysfs file that contains an integer in ASCII, and returns
+//                     the value of that integer.   Returns -1 if the file can't be read
+//
+// This is called for several files in every device directory, so it avoids the overhead of
+// an ifstream and reads the file with a single read()
+//=================================================================================================
+static long readIntegerFile(const string& filename)
+{
+    char buffer[32];
+
+    // Open the file
+    int fd = ::open(filename.c_str(), O_RDONLY);
+
+    // If we can't, tell the caller
+    if (fd < 0) return -1;
+
+    // Read the contents of the file, and we're done with the file
+    ssize_t length = ::read(fd, buffer, sizeof(buffer) - 1);
+    ::close(fd);
+
+    // If the file was empty or unreadable, tell the caller
+    if (length <= 0) return -1;
+
+    // Nul-terminate the buffer and decode it
+    buffer[length] = 0;
+    return strtol(buffer, 0, 0);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// bdfMatches() - Returns true if the caller's BDF string matches the BDF of a device.  The
+//                caller's string may omit the domain, in which case domain 0000 is assumed
+//=================================================================================================
+static bool bdfMatches(const string& wanted, const string& bdf)
+{
+    if (wanted == bdf) return true;
+    return ("0000:" + wanted) == bdf;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// scan() - Builds the index of every PCI device in the system
+//
+// Passed: deviceDir = Name of the file-system directory where PCI device information can
+//                     be found.   If empty-string, a sensible default is used
+//=================================================================================================
+void PciIndex::scan(string deviceDir)
+{
+    // Throw away any index we already have
+    device_.clear();
+
+    // If the caller didn't specify a device-directory, use the default
+    if (deviceDir.empty()) deviceDir = "/sys/bus/pci/devices";
+
+    // Open the directory that contains an entry for each device
+    DIR* dir = opendir(deviceDir.c_str());
+
+    // If we can't, there are no devices
+    if (dir == nullptr) return;
+
+    // Loop through each entry in the directory
+    while (dirent* entry = readdir(dir))
+    {
+        // Ignore "." and ".."
+        if (entry->d_name[0] == '.') continue;
+
+        device_t device;
+        device.bdf = entry->d_name;
+        device.dir = deviceDir + "/" + entry->d_name;
+
+        // Fetch the IDs of this device.  If there's no vendor ID, it isn't a device directory
+        device.vendorID = readIntegerFile(device.dir + "/vendor");
+        if (device.vendorID < 0) continue;
+        device.deviceID    = readIntegerFile(device.dir + "/device");
+        device.subVendorID = readIntegerFile(device.dir + "/subsystem_vendor");
+        device.subDeviceID = readIntegerFile(device.dir + "/subsystem_device");
+        device.classCode   = (uint32_t)readIntegerFile(device.dir + "/class");
+
+        // Add this device to the index
+        device_.push_back(device);
+    }
+
+    // We're done with the directory
+    closedir(dir);
+
+    // Sort the devices by BDF so that the order is the same every time
+    sort(device_.begin(), device_.end(), [](const device_t& a, const device_t& b)
+    {
+        return a.bdf < b.bdf;
+    });
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// select() - Returns every device in the index that matches the selector
+//=================================================================================================
+vector<PciIndex::device_t> PciIndex::select(const selector_t& selector)
+{
+    vector<device_t> result;
+
+    for (auto& device : device_)
+    {
+        if (selector.vendorID >= 0 && device.vendorID != selector.vendorID) continue;
+        if (selector.deviceID >= 0 && device.deviceID != selector.deviceID) continue;
+        if (!selector.bdf.empty() && !bdfMatches(selector.bdf, device.bdf)) continue;
+        if ((device.classCode ^ selector.classCode) & selector.classMask) continue;
+        if (selector.serial && readSerial(device) != selector.serial) continue;
+        result.push_back(device);
+    }
+
+    return result;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// select() - Returns every device in the index with the specified vendor ID and device ID
+//=================================================================================================
+vector<PciIndex::device_t> PciIndex::select(int vendorID, int deviceID)
+{
+    selector_t selector;
+    selector.vendorID = vendorID;
+    selector.deviceID = deviceID;
+    return select(selector);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// open() - Opens every device that matches the selector
+//=================================================================================================
+vector<unique_ptr<PciDevice>> PciIndex::open(const selector_t& selector)
+{
+    vector<unique_ptr<PciDevice>> result;
+
+    for (auto& device : select(selector))
+    {
+        result.push_back(unique_ptr<PciDevice>(new PciDevice));
+        result.back()->open(device);
+    }
+
+    return result;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// readSerial() - Walks the extended capabilities in PCI config space looking for the Device
+//                Serial Number capability, and returns the serial number
+//
+// Notes: Only root can read past the first 64 bytes of config space.  If config space can't be
+//        read, or the device has no serial number capability, this returns 0
+//=================================================================================================
+uint64_t PciIndex::readSerial(const device_t& device)
+{
+    uint8_t config[CONFIG_SIZE];
+
+    // Open the config space of this device
+    int fd = ::open((device.dir + "/config").c_str(), O_RDONLY);
+    if (fd < 0) return 0;
+
+    // Read in the entire config space
+    ssize_t length = ::pread(fd, config, sizeof(config), 0);
+    ::close(fd);
+
+    // Walk the linked-list of extended capabilities
+    int offset = EXT_CAP_START, hops = 0;
+    while (offset >= EXT_CAP_START && offset + 12 <= length && ++hops < 256)
+    {
+        uint32_t header;
+        memcpy(&header, config + offset, 4);
+
+        // A header of 0 means there are no extended capabilities
+        if (header == 0) break;
+
+        // If this is the serial number capability, hand the caller the serial number
+        if ((header & 0xFFFF) == EXT_CAP_ID_DSN)
+        {
+            uint32_t lo, hi;
+            memcpy(&lo, config + offset + 4, 4);
+            memcpy(&hi, config + offset + 8, 4);
+            return ((uint64_t)hi << 32) | lo;
+        }
+
+        // Point to the next capability
+        offset = (header >> 20) & 0xFFC;
+    }
+
+    // If we get here, there's no serial number
+    return 0;
+}
+//=================================================================================================
@@ -0,0 +1,72 @@
+//=================================================================================================
+// PciIndex.h - Defines a class that indexes the PCI devices in the system
+//
+// The index is built with one pass over /sys/bus/pci/devices.  Devices can then be selected by
+// vendor/device ID, by bus/device/function (BDF), by class code, or by serial number, and every
+// matching device can be opened as a PciDevice.
+//=================================================================================================
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+
+class PciDevice;
+
+class PciIndex
+{
+public:
+
+    // Describes one PCI device in the system
+    struct device_t
+    {
+        std::string dir;            // The sysfs directory for this device
+        std::string bdf;            // Domain:bus:device.function, i.e. "0000:01:00.0"
+        int         vendorID;
+        int         deviceID;
+        int         subVendorID;
+        int         subDeviceID;
+        uint32_t    classCode;      // 24-bit class code: class, subclass, programming interface
+    };
+
+    // Describes which devices a caller is interested in.  Fields left at their default values
+    // match every device
+    struct selector_t
+    {
+        int         vendorID  = -1;
+        int         deviceID  = -1;
+        std::string bdf       = "";     // "0000:01:00.0" or "01:00.0"
+        uint32_t    classCode = 0;
+        uint32_t    classMask = 0;      // Bits of classCode that must match.  0 = any class
+        uint64_t    serial    = 0;      // Device Serial Number capability. 0 = any serial
+    };
+
+    // Default constructor - creates an empty index
+    PciIndex() {};
+
+    // Constructor - scans the specified sysfs directory
+    PciIndex(std::string deviceDir) {scan(deviceDir);}
+
+    // Scans the PCI devices in the system. If deviceDir is empty, a sensible default is used
+    void    scan(std::string deviceDir = "");
+
+    // Returns every device in the index, in BDF order
+    const std::vector<device_t>& devices() {return device_;}
+
+    // Returns every device that matches the selector, in BDF order
+    std::vector<device_t> select(const selector_t& selector);
+
+    // Convenience method: returns every device with the specified vendor ID and device ID
+    std::vector<device_t> select(int vendorID, int deviceID);
+
+    // Opens every device that matches the selector
+    std::vector<std::unique_ptr<PciDevice>> open(const selector_t& selector);
+
+    // Reads the Device Serial Number capability of a device. Returns 0 if there isn't one
+    static uint64_t readSerial(const device_t& device);
+
+protected:
+
+    // The devices in the system, sorted by BDF
+    std::vector<device_t> device_;
+};
@@ -0,0 +1,312 @@
+//=================================================================================================
+// PerfectHash.cpp - Implements a collision-free hash table that maps a fixed set of strings to
+//                   indices
+//=================================================================================================
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+#include "PerfectHash.h"
+#include "Util.h"
+using namespace std;
+
+// The most seeds we'll try for one bucket before deciding the table needs more slots
+static const uint32_t MAX_SEED = 65536;
+
+
+//=================================================================================================
+// putVector() - Appends the size of a vector, then its contents, to an image
+//=================================================================================================
+template <class T> static void putVector(string& image, const vector<T>& v)
+{
+    uint64_t count = v.size();
+    image.append((const char*)&count, sizeof count);
+    image.append((const char*)v.data(), count * sizeof(T));
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// getVector() - Fetches a vector that putVector() appended to an image
+//
+// Returns: false if the image ends before the vector does
+//=================================================================================================
+template <class T> static bool getVector(const char*& p, const char* end, vector<T>& v)
+{
+    uint64_t count;
+
+    if (end - p < (ptrdiff_t)sizeof count) return false;
+    memcpy(&count, p, sizeof count);
+    p += sizeof count;
+
+    if ((uint64_t)(end - p) / sizeof(T) < count) return false;
+    v.resize(count);
+    memcpy(v.data(), p, count * sizeof(T));
+    p += count * sizeof(T);
+    return true;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// hash() - Returns the 64-bit FNV-1a hash of a key
+//=================================================================================================
+uint64_t PerfectHash::hash(string_view key)
+{
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (unsigned char c : key)
+    {
+        h ^= c;
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// mix() - Combines a key's hash with a seed, and scrambles the result so that every bit of it
+//         depends on every bit of the hash.  Different seeds give unrelated results
+//=================================================================================================
+uint64_t PerfectHash::mix(uint64_t h, uint64_t seed)
+{
+    h ^= seed * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// build() - Builds the table
+//
+// Passed: key = the keys.  find(key[i]) will return "i"
+//
+// The table starts out with 2 slots per key, and doubles until every bucket can be placed.  In
+// practice, the first size almost always works
+//=================================================================================================
+void PerfectHash::build(const vector<string_view>& key)
+{
+    size_t           slotCount = 1, bucketCount = 1, poolSize = 0;
+    vector<uint64_t> h(key.size());
+
+    // Hash every key
+    for (size_t i=0; i<key.size(); ++i)
+    {
+        h[i] = hash(key[i]);
+        poolSize += key[i].size();
+    }
+
+    // Make our own copy of the keys
+    key_.resize(key.size());
+    pool_.clear();
+    pool_.reserve(poolSize);
+    for (size_t i=0; i<key.size(); ++i)
+    {
+        key_[i] = {(uint32_t)pool_.size(), (uint32_t)key[i].size()};
+        pool_.insert(pool_.end(), key[i].begin(), key[i].end());
+    }
+
+    // Aim for 2 keys per bucket, and 2 slots per key
+    while (bucketCount * 2 < key_.size()) bucketCount *= 2;
+    while (slotCount < key_.size() * 2) slotCount *= 2;
+
+    // Keep adding slots until every bucket finds a home
+    while (!place(h, slotCount, bucketCount))
+    {
+        slotCount *= 2;
+        if (slotCount > key_.size() * 256) throwRuntime("PerfectHash: can't build the table");
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// place() - Finds a seed for every bucket that puts each of its keys in an empty slot
+//
+// Passed: h           = the hash of every key
+//         slotCount   = the number of slots in the table
+//         bucketCount = the number of buckets
+//
+// Returns: false if some bucket can't be placed in a table of this size
+//
+// Which slots are taken is tracked in a bitmap while the buckets are being placed.  It's small
+// enough to stay in cache, where the slot table itself (for a big key set) wouldn't be
+//=================================================================================================
+bool PerfectHash::place(const vector<uint64_t>& h, size_t slotCount, size_t bucketCount)
+{
+    const size_t     MAX_BUCKET = 64;
+    vector<uint32_t> bucketOf(h.size()), first(bucketCount + 1, 0), member(h.size());
+    vector<uint32_t> order(bucketCount), bySize(MAX_BUCKET + 2, 0);
+    vector<uint64_t> taken((slotCount + 63) / 64, 0);
+    size_t           pos[MAX_BUCKET];
+
+    bucketMask_ = bucketCount - 1;
+    slotMask_   = slotCount - 1;
+    seed_.assign(bucketCount, 0);
+
+    // Sort the keys by bucket: member[first[b]] thru member[first[b+1]-1] are in bucket "b"
+    for (size_t i=0; i<h.size(); ++i)
+    {
+        bucketOf[i] = mix(h[i], 0) & bucketMask_;
+        ++first[bucketOf[i] + 1];
+    }
+    for (size_t b=0; b<bucketCount; ++b) first[b+1] += first[b];
+    vector<uint32_t> next(first.begin(), first.end() - 1);
+    for (size_t i=0; i<h.size(); ++i) member[next[bucketOf[i]]++] = i;
+    auto size = [&](uint32_t b) {return first[b+1] - first[b];};
+
+    // Identical keys always land in the same bucket, so that's the only place to look for them
+    for (size_t b=0; b<bucketCount; ++b)
+    {
+        for (uint32_t i = first[b]; i < first[b+1]; ++i)
+        {
+            for (uint32_t j = first[b]; j < i; ++j)
+            {
+                if (h[member[i]] == h[member[j]] && key(member[i]) == key(member[j]))
+                {
+                    throwRuntime("Duplicate name %.*s", (int)key_[member[i]].length,
+                                 pool_.data() + key_[member[i]].offset);
+                }
+            }
+        }
+    }
+
+    // The biggest buckets are the hardest to place, so place them first while the table is
+    // empty.  A bucket too big to place at all means the table is too small
+    for (size_t b=0; b<bucketCount; ++b)
+    {
+        if (size(b) > MAX_BUCKET) return false;
+        ++bySize[MAX_BUCKET - size(b) + 1];
+    }
+    for (size_t i=0; i<=MAX_BUCKET; ++i) bySize[i+1] += bySize[i];
+    for (size_t b=0; b<bucketCount; ++b) order[bySize[MAX_BUCKET - size(b)]++] = b;
+
+    for (uint32_t b : order)
+    {
+        uint32_t count = size(b);
+
+        // The buckets are sorted by size, so once we find an empty one, we're done
+        if (count == 0) break;
+
+        // Find a seed that puts every key in this bucket into a different empty slot
+        uint32_t seed, placed = 0;
+        for (seed = 1; seed < MAX_SEED; ++seed)
+        {
+            for (placed = 0; placed < count; ++placed)
+            {
+                size_t p = mix(h[member[first[b] + placed]], seed) & slotMask_;
+                if (taken[p / 64] & (1ULL << (p % 64))) break;
+                if (std::find(pos, pos + placed, p) != pos + placed) break;
+                pos[placed] = p;
+            }
+            if (placed == count) break;
+        }
+
+        // If no seed worked, the table is too crowded
+        if (seed == MAX_SEED) return false;
+
+        // Claim the slots for this bucket's keys
+        seed_[b] = seed;
+        for (uint32_t i=0; i<count; ++i) taken[pos[i] / 64] |= 1ULL << (pos[i] % 64);
+    }
+
+    // Now fill in the table itself
+    slot_.assign(slotCount, -1);
+    for (size_t i=0; i<h.size(); ++i)
+    {
+        slot_[mix(h[i], seed_[bucketOf[i]]) & slotMask_] = i;
+    }
+
+    return true;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// find() - Returns the index of a key, or -1 if it isn't in the table
+//=================================================================================================
+int PerfectHash::find(string_view key) const
+{
+    // An empty table has no slots
+    if (key_.empty()) return -1;
+
+    // Find the bucket, and use its seed to find the only slot the key can be in
+    uint64_t h     = hash(key);
+    uint32_t seed  = seed_[mix(h, 0) & bucketMask_];
+    int32_t  index = slot_[mix(h, seed) & slotMask_];
+
+    // It's only a match if the key in that slot is the one we're looking for
+    return (index >= 0 && this->key(index) == key) ? index : -1;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// save() - Appends an image of the table to "image"
+//=================================================================================================
+void PerfectHash::save(string& image) const
+{
+    putVector(image, key_);
+    putVector(image, pool_);
+    putVector(image, seed_);
+    putVector(image, slot_);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// load() - Restores the table from an image that save() made
+//
+// Passed: p   = where the image starts.  On return, it points just past the image
+//         end = the end of the buffer the image is in
+//
+// Returns: false if the image is malformed
+//
+// The image is checked closely enough that even a corrupt one can't make find() or key() read
+// outside of the table
+//=================================================================================================
+bool PerfectHash::load(const char*& p, const char* end)
+{
+    vector<key_t>    key;
+    vector<char>     pool;
+    vector<uint32_t> seed;
+    vector<int32_t>  slot;
+
+    // Fetch the pieces of the table
+    if (!getVector(p, end, key))  return false;
+    if (!getVector(p, end, pool)) return false;
+    if (!getVector(p, end, seed)) return false;
+    if (!getVector(p, end, slot)) return false;
+
+    // Every key must lie within the pool
+    for (auto& k : key)
+    {
+        if ((uint64_t)k.offset + k.length > pool.size()) return false;
+    }
+
+    // There must be a power-of-2 number of buckets and slots
+    if (seed.empty() || (seed.size() & (seed.size() - 1))) return false;
+    if (slot.empty() || (slot.size() & (slot.size() - 1))) return false;
+
+    // Every slot must be empty, or hold a key that exists
+    for (auto index : slot)
+    {
+        if (index < -1 || index >= (int64_t)key.size()) return false;
+    }
+
+    // The image is good
+    key_.swap(key);
+    pool_.swap(pool);
+    seed_.swap(seed);
+    slot_.swap(slot);
+    bucketMask_ = seed_.size() - 1;
+    slotMask_   = slot_.size() - 1;
+    return true;
+}
+//=================================================================================================
@@ -0,0 +1,76 @@
+//=================================================================================================
+// PerfectHash.h - Defines a collision-free hash table that maps a fixed set of strings to indices
+//
+// The table is built once from a list of keys, and after that every lookup costs two hashes of
+// the key and a single string comparison, no matter how many keys there are or how they're
+// spelled.  There are no collision chains to walk and no probing.
+//
+// It's built by "hash and displace": keys are first hashed into small buckets, then each bucket
+// (biggest first) is given the seed that places all of its keys into empty slots of the table.
+// A lookup hashes the key to find its bucket, then hashes it again with that bucket's seed to
+// find the one slot it can be in.
+//=================================================================================================
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class PerfectHash
+{
+public:
+
+    // Constructor
+    PerfectHash() {};
+
+    // Builds the table.  key[i] will be found at index "i".  The table keeps its own copy of
+    // the keys.  Throws if a key appears twice
+    void    build(const std::vector<std::string_view>& key);
+
+    // Returns the index of "key", or -1 if it isn't in the table
+    int     find(std::string_view key) const;
+
+    // Returns the number of keys in the table
+    size_t  size() const {return key_.size();}
+
+    // Returns key "i".  The view stays valid until the table is rebuilt or destroyed, even if
+    // the table is moved
+    std::string_view key(size_t i) const
+    {
+        return std::string_view(pool_.data() + key_[i].offset, key_[i].length);
+    }
+
+    // Appends an image of the table to "image", or restores the table from one.  load() moves
+    // "p" past the image, and returns false (leaving the table alone) if it's malformed
+    void    save(std::string& image) const;
+    bool    load(const char*& p, const char* end);
+
+protected:
+
+    // Hashes a key.  Every seed gives an unrelated hash
+    static uint64_t hash(std::string_view key);
+    static uint64_t mix(uint64_t hash, uint64_t seed);
+
+    // Tries to build the table with the given number of slots.  Returns false if some bucket
+    // can't be placed
+    bool    place(const std::vector<uint64_t>& h, size_t slotCount, size_t bucketCount);
+
+    // Where each key is in the pool, in the order they were given to build()
+    struct key_t {uint32_t offset; uint32_t length;};
+    std::vector<key_t> key_;
+
+    // Every key, end to end.  This is a vector rather than a string so that moving the table
+    // never moves the characters
+    std::vector<char> pool_;
+
+    // The seed for each bucket
+    std::vector<uint32_t> seed_;
+
+    // The index of the key that lives in each slot, or -1 if the slot is empty
+    std::vector<int32_t> slot_;
+
+    // The bucket and slot counts are powers of 2, so these pick a bucket or slot from a hash
+    uint64_t bucketMask_ = 0;
+    uint64_t slotMask_ = 0;
+};
+//=================================================================================================
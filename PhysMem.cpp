@@ -6,10 +6,16 @@
 #include <stdarg.h>
 #include <sys/mman.h>
 #include <sys/fcntl.h>
+#include <stdlib.h>
 #include <string.h>
 #include <string>
 #include <fstream>
 #include "PhysMem.h"
+#include "Util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+#endif
 using namespace std;
 
 #define MALFORMED 0xFFFFFFFFFFFFFFFF
@@ -17,86 +23,102 @@ using namespace std;
 
 
 //=================================================================================================
-// throwRuntime() - Throws a runtime exception
+// parseSize() - Parses an integer the way the kernel's memparse() does: a decimal, hex (0x),
+//               or octal number, optionally followed by a K, M, G, T, P, or E suffix
+//
+//              Example:  4G         = 0x1_0000_0000
+//                        2K         = 0x400
+//                        0x30000000 = 0x3000_0000
+//
+// On Exit: ptr points to the first character after the number and its suffix
+//
+// If the string doesn't start with a number, returns MALFORMED
 //=================================================================================================
-static void throwRuntime(const char* fmt, ...)
+static uint64_t parseSize(const char*& ptr)
 {
-    char buffer[1024];
-    va_list ap;
-    va_start(ap, fmt);
-    vsprintf(buffer, fmt, ap);
-    va_end(ap);
-
-    throw runtime_error(buffer);
+    char* end;
+
+    // Convert the ASCII digits to an integer
+    uint64_t value = strtoull(ptr, &end, 0);
+
+    // If there were no digits, tell the caller
+    if (end == ptr) return MALFORMED;
+    ptr = end;
+
+    // Apply the suffix, if there is one
+    switch (*ptr)
+    {
+        case 'E': case 'e': value <<= 10;   // Fall through
+        case 'P': case 'p': value <<= 10;   // Fall through
+        case 'T': case 't': value <<= 10;   // Fall through
+        case 'G': case 'g': value <<= 10;   // Fall through
+        case 'M': case 'm': value <<= 10;   // Fall through
+        case 'K': case 'k': value <<= 10;
+                            ++ptr;
+    }
+
+    return value;
 }
 //=================================================================================================
 
 
 
 //=================================================================================================
-// parseKMG() - Examines a string for a delimeter, and parses the integer immediately after 
-//              the delimeter.  Looks for the character after the digits, expect to find a K, M,
-//              or G (meaning Kilo, Mega, or Giga) and returns the parsed value.
+// setCached() - Records whether regions should be mapped cached
 //
-//              Example:  4G = 0x1_0000_0000
-//                        2K = 0x400
-//                        3M = 0x30_0000
-//
-// If the delimieter is not found or the string is malformed in some way, returns -1
+// 32-bit ARM has no cache maintenance instructions that user-space can use, so there's no way
+// to keep a cached mapping coherent with the FPGA
 //=================================================================================================
-static uint64_t parseKMG(const char delimeter, const char* ptr)
+void PhysMem::setCached(bool cached)
 {
-    // Look for the delimeter in the string the user gave us
-    ptr = strchr(ptr, delimeter);
-
-    // If the delimeter didn't exist, tell the caller
-    if (ptr == nullptr) return MALFORMED;
-
-    // Point to the character after the delimeter
-    ++ptr;
-
-    // Convert the ASCII digits that follow the delimeter to an integer
-    int64_t value = strtol(ptr, 0, 0);
-
-    // Skip over all of the ASCII digits
-    while (*ptr >= '0' && *ptr <= '9') ++ptr;
+#if defined(__arm__)
+    if (cached) throwRuntime("Cached mappings are not supported on this architecture");
+#endif
 
-    // Return the appropriate scaled integer value
-    if (*ptr == 'K') return value * 1024;
-    if (*ptr == 'M') return value * 1024 * 1024;
-    if (*ptr == 'G') return value * 1024 * 1024 * 1024;
-
-    // If we get here, there wasn't a K, M, or G after the numeric value
-    return MALFORMED;
+    cached_ = cached;
 }
 //=================================================================================================
 
 
-
 //=================================================================================================
 // map() - Maps the specified physical address into user-space
 //
 // Passed: physAddr = The physical address to map into user-space
 //         size     = The size of the region to map, in bytes
+//         cached   = true to map the region cached instead of uncached
+//=================================================================================================
+void PhysMem::map(uint64_t physAddr, size_t size, bool cached)
+{
+    // Unmap any memory we may already have mapped
+    unmap();
+
+    // Decide whether the mapping should be cached
+    setCached(cached);
+
+    // And map this region
+    mapRegion({nullptr, physAddr, size, '$'});
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// mapRegion() - Maps a region of physical memory into user-space and adds it to region_
 //=================================================================================================
-void PhysMem::map(uint64_t physAddr, size_t size)
+void PhysMem::mapRegion(region_t region)
 {
     const char* filename = "/dev/mem";
 
     // These are the memory protection flags we'll use when mapping the device into memory
     const int protection = PROT_READ | PROT_WRITE;
 
-    // Unmap any memory we may already have mapped
-    unmap();
-
-    // Open the /dev/mem device
-    int fd = ::open(filename, O_RDWR| O_SYNC);
+    // Open the /dev/mem device.  O_SYNC is what makes the mapping uncached
+    int fd = ::open(filename, cached_ ? O_RDWR : O_RDWR | O_SYNC);
 
     // If that open failed, we're done here
     if (fd < 0) throwRuntime("Can't open %s", filename);
 
     // Map the memory
-    void* ptr = mmap(0, size, protection, MAP_SHARED, fd, physAddr);
+    void* ptr = mmap(0, region.size, protection, MAP_SHARED, fd, region.physAddr);
     
     // We're done with /dev/mem
     ::close(fd);
@@ -104,17 +126,77 @@ void PhysMem::map(uint64_t physAddr, size_t size)
     // If mapping into user-space failed tell the caller
     if (ptr == MAP_FAILED) throwRuntime("mmap failed");        
 
-    // Otherwise, that mapping succeeded.  Record the userspace address and region size
-    userspaceAddr_ = ptr;        
-    mappedSize_    = size;
+    // Otherwise, that mapping succeeded.  Record the userspace address of the region
+    region.userspaceAddr = (uint8_t*)ptr;
+    region_.push_back(region);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// parseCmdline() - Finds every region of memory reserved by a "memmap=" option on the kernel
+//                  command line
+//
+// The kernel accepts these forms, any number of which can be comma-separated in one "memmap=",
+// and "memmap=" can appear any number of times:
+//
+//     memmap=<size>$<addr>     Reserved memory
+//     memmap=<size>#<addr>     ACPI data
+//     memmap=<size>!<addr>     Persistent memory
+//     memmap=<size>@<addr>     Usable RAM (not a reservation, so ignored)
+//     memmap=exactmap          (ignored)
+//
+// Sizes and addresses can be plain numbers of bytes or have a K/M/G/T/P/E suffix.  The '$' is
+// sometimes preceded by a backslash, because boot loaders treat '$' specially
+//=================================================================================================
+vector<PhysMem::region_t> PhysMem::parseCmdline(const string& cmdline)
+{
+    vector<region_t> result;
+    const char*      p = cmdline.c_str();
+
+    // Loop through every "memmap=" on the command line
+    while ((p = ::strstr(p, "memmap=")) != nullptr)
+    {
+        // Only count "memmap=" when it's at the start of an option
+        bool atStart = (p == cmdline.c_str() || p[-1] == ' ' || p[-1] == '\t');
+        p += 7;
+        if (!atStart) continue;
+
+        // Loop through every comma-separated item after the '='
+        while (*p && *p != ' ' && *p != '\t' && *p != '\n')
+        {
+            // Parse the size
+            uint64_t size = parseSize(p);
+
+            // Boot loaders sometimes make you escape the '$'
+            if (*p == '\\') ++p;
+
+            // Find out what kind of region this is
+            char type = *p;
+
+            // If this is a reservation, parse the address and add it to our result
+            if (size != MALFORMED && (type == '$' || type == '#' || type == '!'))
+            {
+                uint64_t physAddr = parseSize(++p);
+                if (physAddr != MALFORMED && size) result.push_back({nullptr, physAddr, size, type});
+            }
+
+            // Skip to the next item
+            while (*p && *p != ',' && *p != ' ' && *p != '\t' && *p != '\n') ++p;
+            if (*p == ',') ++p;
+        }
+    }
+
+    // Hand the caller the list of reserved regions
+    return result;
 }
 //=================================================================================================
 
 
 //=================================================================================================
-// map() - Automatically maps the region defined with "memmap=" in /proc/cmdline
+// map() - Automatically maps every region reserved with "memmap=" in /proc/cmdline
 //=================================================================================================
-void PhysMem::map()
+void PhysMem::map(bool cached)
 {
     string line;
     
@@ -123,6 +205,9 @@ void PhysMem::map()
     // Ensure that we don't have anything mapped
     unmap();
 
+    // Decide whether the mapping should be cached
+    setCached(cached);
+
     // Open the specified file.  It will contain a line of ASCII data
     ifstream file(filename);
 
@@ -132,23 +217,22 @@ void PhysMem::map()
     // Fetch the first line of the file
     getline(file, line);
 
-    // Look for "memmap=" in the command line
-    const char* p = ::strstr(line.c_str(), "memmap=");
+    // Find every reserved region
+    auto regions = parseCmdline(line);
 
     // If we can't find "memmap=", something is awry
-    if (p == nullptr) throwRuntime("malformed %s", filename);
-
-    // Fetch the value after the '='
-    auto size = parseKMG('=', p);
-
-    // Fetch the value after the '$'
-    auto physAddr = parseKMG('$', p);
-
-    // If we couldn't parse one of those values, /proc/cmdline is malformed
-    if (physAddr == MALFORMED || size == MALFORMED) throwRuntime("malformed %s", filename);
-
-    // Now go map this physical address into user-space
-    map(physAddr, size);
+    if (regions.empty()) throwRuntime("malformed %s", filename);
+
+    // Now go map each region into user-space
+    try
+    {
+        for (auto& region : regions) mapRegion(region);
+    }
+    catch (...)
+    {
+        unmap();
+        throw;
+    }
 }
 //=================================================================================================
 
@@ -159,11 +243,128 @@ void PhysMem::map()
 //=================================================================================================
 void PhysMem::unmap()
 {
-    // If we have a valid user-space address, we need to unmap that memory
-    if (userspaceAddr_) munmap(userspaceAddr_, mappedSize_);
+    // Unmap every region we have mapped
+    for (auto& region : region_) munmap(region.userspaceAddr, region.size);
 
     // Indicate that we no longer have any memory mapped
-    userspaceAddr_ = nullptr;
-    mappedSize_    = 0;
+    region_.clear();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// cacheLineSize() - Returns the size of the smallest data cache-line in the system
+//=================================================================================================
+size_t PhysMem::cacheLineSize()
+{
+#if defined(__aarch64__)
+    // CTR_EL0.DminLine is log2 of the number of 4-byte words in the smallest data cache-line
+    uint64_t ctr;
+    __asm__ __volatile__("mrs %0, ctr_el0" : "=r"(ctr));
+    return 4 << ((ctr >> 16) & 0xF);
+#else
+    return 64;
+#endif
+}
+//=================================================================================================
+
+
+#if defined(__x86_64__) || defined(__i386__)
+//=================================================================================================
+// x86 cache maintenance.  clflush is always available, but is serialized against every other
+// clflush.  clflushopt and clwb aren't, so when the CPU has them, they're used instead.  clwb
+// writes a line back without evicting it, so it's the preferred way to flush
+//=================================================================================================
+static void clflushRange(const uint8_t* ptr, const uint8_t* end)
+{
+    for (; ptr < end; ptr += 64) _mm_clflush(ptr);
+}
+
+__attribute__((target("clflushopt")))
+static void clflushoptRange(const uint8_t* ptr, const uint8_t* end)
+{
+    for (; ptr < end; ptr += 64) _mm_clflushopt((void*)ptr);
+}
+
+__attribute__((target("clwb")))
+static void clwbRange(const uint8_t* ptr, const uint8_t* end)
+{
+    for (; ptr < end; ptr += 64) _mm_clwb((void*)ptr);
+}
+
+static const bool hasClflushopt = __builtin_cpu_supports("clflushopt");
+static const bool hasClwb       = __builtin_cpu_supports("clwb");
+//=================================================================================================
+#endif
+
+
+//=================================================================================================
+// invalidate() - Discards every cache-line that overlaps [ptr, ptr+size)
+//
+// Any dirty data in those cache-lines is written back first, so the caller should never have
+// written to a buffer the FPGA is filling.  The fence ensures that no later load can be satisfied
+// before the cache-lines are gone.
+//
+// On x86, DMA is coherent with the CPU caches, so this is never strictly necessary.  It's still
+// correct, and it keeps code that uses it portable to architectures where DMA isn't coherent
+//=================================================================================================
+void PhysMem::invalidate(const void* ptr, size_t size)
+{
+    // Find the cache-lines that overlap the range
+    const size_t   line  = cacheLineSize();
+    const uint8_t* start = (const uint8_t*)((uintptr_t)ptr & ~(line - 1));
+    const uint8_t* end   = (const uint8_t*)ptr + size;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (hasClflushopt)
+        clflushoptRange(start, end);
+    else
+        clflushRange(start, end);
+    _mm_mfence();
+#elif defined(__aarch64__)
+    for (const uint8_t* p = start; p < end; p += line)
+    {
+        __asm__ __volatile__("dc civac, %0" :: "r"(p) : "memory");
+    }
+    __asm__ __volatile__("dsb sy" ::: "memory");
+#else
+    (void)start; (void)end;
+    __sync_synchronize();
+#endif
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// flush() - Writes every dirty cache-line that overlaps [ptr, ptr+size) out to memory
+//
+// The fence ensures that the data has reached memory before any later store (such as the
+// register write that tells the FPGA the buffer is ready)
+//=================================================================================================
+void PhysMem::flush(const void* ptr, size_t size)
+{
+    // Find the cache-lines that overlap the range
+    const size_t   line  = cacheLineSize();
+    const uint8_t* start = (const uint8_t*)((uintptr_t)ptr & ~(line - 1));
+    const uint8_t* end   = (const uint8_t*)ptr + size;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (hasClwb)
+        clwbRange(start, end);
+    else if (hasClflushopt)
+        clflushoptRange(start, end);
+    else
+        clflushRange(start, end);
+    _mm_sfence();
+#elif defined(__aarch64__)
+    for (const uint8_t* p = start; p < end; p += line)
+    {
+        __asm__ __volatile__("dc cvac, %0" :: "r"(p) : "memory");
+    }
+    __asm__ __volatile__("dsb sy" ::: "memory");
+#else
+    (void)start; (void)end;
+    __sync_synchronize();
+#endif
 }
 //=================================================================================================
@@ -1,16 +1,33 @@
 //=================================================================================================
 // PhysMem.h - Defines a class that maps physical address space into user-space
+//
+// By default, memory is mapped uncached, so the CPU always sees what the FPGA last wrote, at the
+// cost of every load going all the way to DRAM.  Memory can instead be mapped cached, in which
+// case the caller is responsible for cache maintenance: invalidate() a buffer after the FPGA has
+// written it and before reading it, and flush() a buffer after writing it and before the FPGA
+// reads it.
 //=================================================================================================
 #pragma once
 #include <stdint.h>
 #include <stddef.h>
+#include <string>
+#include <vector>
 
 class PhysMem
 {
 public:
 
+    // Describes one region of physical memory
+    struct region_t
+    {
+        uint8_t* userspaceAddr;     // Where the region is mapped in user-space (null = unmapped)
+        uint64_t physAddr;          // The physical address of the region
+        size_t   size;              // The size of the region in bytes
+        char     type;              // The memmap= type: '$' reserved, '#' ACPI, '!' persistent
+    };
+
     // Constructor
-    PhysMem() {userspaceAddr_ = nullptr; mappedSize_ = 0;}
+    PhysMem() {};
 
     // No copy or assignment constructor - objects of this class can't be copied
     PhysMem (const PhysMem&) = delete;
@@ -20,23 +37,51 @@ public:
     ~PhysMem() {unmap();}
 
     // Call this to map a region of physical address space into user-space
-    void    map(uint64_t physAddr, size_t size);
+    void    map(uint64_t physAddr, size_t size, bool cached = false);
+
+    // Automatically maps every region reserved with "memmap=" in /proc/cmdline
+    void    map(bool cached = false);
+
+    // Returns true if the memory is mapped cached
+    bool    cached() {return cached_;}
+
+    // Discards any cached copy of a range, so the next read fetches what the FPGA wrote
+    static void invalidate(const void* ptr, size_t size);
+
+    // Writes any cached modifications of a range out to memory, so the FPGA can see them
+    static void flush(const void* ptr, size_t size);
 
-    // Automatically maps the region define with "memmap=" in /proc/cmdline
-    void    map();
+    // Returns the granularity of invalidate() and flush()
+    static size_t cacheLineSize();
 
-    // Call these to return either a void* or a byte* in user-space
-    uint8_t* bptr() {return (uint8_t*)userspaceAddr_;}
-    void*    vptr() {return userspaceAddr_;}
+    // Returns every region reserved with "memmap=" on a kernel command line
+    static std::vector<region_t> parseCmdline(const std::string& cmdline);
+
+    // Call these to return either a void* or a byte* in user-space, for the first region
+    uint8_t* bptr() {return region_.empty() ? nullptr : region_[0].userspaceAddr;}
+    void*    vptr() {return bptr();}
+
+    // Returns the physical address and the size of the first region
+    uint64_t physAddr() {return region_.empty() ? 0 : region_[0].physAddr;}
+    size_t   size()     {return region_.empty() ? 0 : region_[0].size;}
+
+    // Returns every mapped region
+    const std::vector<region_t>& regions() {return region_;}
 
     // Unmaps the address space if one has been mapped
     void    unmap();
 
 protected:
 
-    // If this is not null, it contains a pointer to the mapped addresses
-    void*   userspaceAddr_;
+    // Records whether regions should be mapped cached, if this architecture allows it
+    void    setCached(bool cached);
+
+    // Maps a single region into user-space, and adds it to our list of regions
+    void    mapRegion(region_t region);
+
+    // The regions that have been mapped into user-space
+    std::vector<region_t> region_;
 
-    // This is the size of the address spaces that has been mapped into user-space
-    size_t  mappedSize_;
-};
\ No newline at end of file
+    // True if the regions are mapped cached
+    bool    cached_ = false;
+};
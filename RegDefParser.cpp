@@ -0,0 +1,446 @@
+//=================================================================================================
+// RegDefParser.cpp - Implements a parser for register definitions files
+//=================================================================================================
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <stdexcept>
+#include "RegDefParser.h"
+#include "FileDes.h"
+using namespace std;
+
+// The most tokens we pay attention to on one line.  Any beyond this are ignored
+static const int MAX_TOKENS = 8;
+
+// How deeply includes may be nested.  This is also what stops a file from including itself
+static const int MAX_INCLUDE_DEPTH = 16;
+
+
+//=================================================================================================
+// ~mapping_t() - Unmaps the file
+//=================================================================================================
+RegDefParser::mapping_t::~mapping_t()
+{
+    if (data) munmap((void*)data, size);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// tokenize() - Splits a line into tokens separated by spaces, tabs, or commas.  A token can be
+//              enclosed in single or double quotes.  A line that starts with '#' or '//' is a
+//              comment, and has no tokens
+//
+// Passed: p     = the start of the line
+//         end   = one past the end of the line
+//         token = where to store the tokens
+//
+// Returns: the number of tokens
+//=================================================================================================
+static int tokenize(const char* p, const char* end, string_view* token)
+{
+    int count = 0;
+
+    while (count < MAX_TOKENS)
+    {
+        // Skip over spaces, tabs, and commas
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) ++p;
+
+        // If we've hit the end of the line, we're done
+        if (p == end || *p == '\r') break;
+
+        // A comment at the start of the line means the line is empty
+        if (count == 0 && (*p == '#' || (*p == '/' && p + 1 < end && p[1] == '/'))) break;
+
+        // If the token is quoted, it ends at the closing quote-mark
+        const char* start;
+        if (*p == '"' || *p == '\'')
+        {
+            char quote = *p++;
+            start = p;
+            while (p < end && *p != quote) ++p;
+            token[count++] = string_view(start, p - start);
+            if (p < end) ++p;
+            continue;
+        }
+
+        // Otherwise it ends at whitespace, a comma, or the end of the line
+        start = p;
+        while (p < end && *p != ' ' && *p != '\t' && *p != ',' && *p != '\r') ++p;
+        token[count++] = string_view(start, p - start);
+    }
+
+    return count;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// parseNumber() - Parses a decimal, hex ("0x"), or octal (leading "0") number
+//
+// Returns: false if the number is malformed or doesn't fit in 32 bits
+//=================================================================================================
+static bool parseNumber(string_view s, uint32_t& result)
+{
+    uint64_t value = 0;
+    uint32_t base  = 10;
+    size_t   i     = 0;
+
+    if (s.empty()) return false;
+
+    // Figure out which base the number is in
+    if (s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+    {
+        base = 16;
+        i    = 2;
+    }
+    else if (s.size() > 1 && s[0] == '0') base = 8;
+
+    // Accumulate the digits
+    for (; i < s.size(); ++i)
+    {
+        char     c = s[i];
+        uint32_t digit;
+        if      (c >= '0' && c <= '9') digit = c - '0';
+        else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+        else return false;
+        if (digit >= base) return false;
+        value = value * base + digit;
+        if (value > 0xFFFFFFFF) return false;
+    }
+
+    result = (uint32_t)value;
+    return true;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// number() - Parses a number, and complains if it's malformed
+//=================================================================================================
+uint32_t RegDefParser::number(string_view s)
+{
+    uint32_t result = 0;
+    if (!parseNumber(s, result)) fail("Bad number '%.*s'", (int)s.size(), s.data());
+    return result;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// where() - Returns "<filename>, line <n>" for the line being parsed
+//=================================================================================================
+string RegDefParser::where()
+{
+    if (filename_ == nullptr) return "";
+    if (line_ == 0) return *filename_;
+    return *filename_ + ", line " + to_string(line_);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// fail() - Throws a runtime_error that says where in the file the error is
+//=================================================================================================
+void RegDefParser::fail(const char* fmt, ...)
+{
+    char    message[1024];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(message, sizeof message, fmt, ap);
+    va_end(ap);
+
+    string location = where();
+    throw runtime_error(location.empty() ? message : location + ": " + message);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// parse() - Parses a definitions file and every file it includes
+//=================================================================================================
+void RegDefParser::parse(string filename, reg_fn onReg, field_fn onField)
+{
+    // Start from a clean slate
+    onReg_     = onReg;
+    onField_   = onField;
+    filename_  = nullptr;
+    line_      = 0;
+    defining_  = nullptr;
+    haveBase_  = false;
+    haveReg_   = false;
+    template_.clear();
+    files_.clear();
+    mapping_.clear();
+
+    // Parse the file
+    parseFile(filename, 0);
+
+    // Now that nothing points into the files any more, unmap them
+    template_.clear();
+    ip_  = reg_ = string_view();
+    haveBase_ = haveReg_ = false;
+    filename_ = nullptr;
+    mapping_.clear();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// parseFile() - Maps a file into memory and parses it
+//
+// Passed: filename = the file to parse
+//         depth    = how deeply nested in includes this file is
+//=================================================================================================
+void RegDefParser::parseFile(const string& filename, int depth)
+{
+    struct stat sb;
+    string_view token[MAX_TOKENS];
+    uint32_t    a, b, c;
+
+    // Don't let includes go on forever
+    if (depth > MAX_INCLUDE_DEPTH) fail("Includes are nested too deeply");
+
+    // Open the file and find out how big it is
+    FileDes fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) fail("Can't open %s (%s)", filename.c_str(), strerror(errno));
+    if (fstat(fd, &sb) < 0) fail("Can't stat %s (%s)", filename.c_str(), strerror(errno));
+
+    // Map it into memory.  An empty file has nothing to map
+    mapping_.emplace_back(new mapping_t);
+    mapping_t& file = *mapping_.back();
+    file.name = filename;
+    if (sb.st_size > 0)
+    {
+        void* ptr = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED) fail("Can't map %s (%s)", filename.c_str(), strerror(errno));
+        file.data = (const char*)ptr;
+        file.size = sb.st_size;
+    }
+    files_.push_back(filename);
+
+    // From here on, errors are reported against this file
+    const string* outerFilename = filename_;
+    int           outerLine     = line_;
+    filename_ = &file.name;
+    line_     = 0;
+
+    const char* p   = file.data;
+    const char* end = file.data + file.size;
+
+    while (p < end)
+    {
+        // Find the end of this line, and tokenize it
+        const char* eol = (const char*)memchr(p, '\n', end - p);
+        if (eol == nullptr) eol = end;
+        int count = tokenize(p, eol, token);
+        p = eol + 1;
+        ++line_;
+
+        // Skip blank lines and comments
+        if (count == 0) continue;
+
+        // The first token is the keyword
+        string_view keyword = token[0];
+
+        // "base <IP_NAME> <base_address>"
+        if (keyword == "base")
+        {
+            if (count < 3) fail("Syntax error");
+            if (defining_) fail("base isn't allowed in a template");
+            a = number(token[2]);
+            ip_       = token[1];
+            baseAddr_ = a;
+            haveBase_ = true;
+            haveReg_  = false;
+            continue;
+        }
+
+        // "reg <REG_NAME> <offset_from_base_address> [access_policy]"
+        if (keyword == "reg")
+        {
+            if (count < 3) fail("Syntax error");
+            a = number(token[2]);
+
+            // Look up the access policy
+            int policy = DEFAULT_POLICY;
+            if (count > 3)
+            {
+                for (policy = 0; policy < POLICY_COUNT; ++policy)
+                {
+                    if (token[3] == policyName[policy]) break;
+                }
+                if (policy == POLICY_COUNT)
+                {
+                    fail("Unknown access policy '%.*s'", (int)token[3].size(), token[3].data());
+                }
+            }
+
+            if (defining_)
+                defining_->push_back({false, token[1], a, 0, policy});
+            else
+                emitReg(token[1], a, policy);
+            continue;
+        }
+
+        // "field <FIELD_NAME> <rightmost_bit_number> <width_in_bits>"
+        if (keyword == "field")
+        {
+            if (count < 4) fail("Syntax error");
+            a = number(token[2]);
+            b = number(token[3]);
+            if (b == 0 || a >= 32 || b > 32 - a)
+            {
+                fail("Field %.*s doesn't fit in 32 bits", (int)token[1].size(), token[1].data());
+            }
+
+            if (defining_)
+            {
+                if (defining_->empty()) fail("No register defined");
+                defining_->push_back({true, token[1], a, b, 0});
+            }
+            else
+                emitField(token[1], a, b);
+            continue;
+        }
+
+        // "include <filename>"
+        if (keyword == "include")
+        {
+            if (count < 2) fail("Syntax error");
+            if (defining_) fail("include isn't allowed in a template");
+
+            // A relative filename is relative to the directory this file is in
+            string name(token[1]);
+            size_t slash = filename.rfind('/');
+            if (name[0] != '/' && slash != string::npos) name = filename.substr(0, slash+1) + name;
+
+            parseFile(name, depth + 1);
+            continue;
+        }
+
+        // "template <TEMPLATE_NAME>"
+        if (keyword == "template")
+        {
+            if (count < 2) fail("Syntax error");
+            if (defining_) fail("Templates can't be nested");
+            if (template_.count(token[1]))
+            {
+                fail("Duplicate template %.*s", (int)token[1].size(), token[1].data());
+            }
+            defining_ = &template_[token[1]];
+            continue;
+        }
+
+        // "end"
+        if (keyword == "end")
+        {
+            if (!defining_) fail("end without template");
+            defining_ = nullptr;
+            continue;
+        }
+
+        // "instance <IP_NAME> <TEMPLATE_NAME> <base_address> [<count> <stride>]"
+        if (keyword == "instance")
+        {
+            if (count != 4 && count < 6) fail("Syntax error");
+            if (defining_) fail("instance isn't allowed in a template");
+
+            // Find the template
+            auto it = template_.find(token[2]);
+            if (it == template_.end())
+            {
+                fail("Unknown template %.*s", (int)token[2].size(), token[2].data());
+            }
+
+            // Fetch the base address, and the number of copies and how far apart they are
+            b = 1;
+            c = 0;
+            a = number(token[3]);
+            if (count > 4)
+            {
+                if (!parseNumber(token[4], b) || b == 0) fail("Bad instance count");
+                if (!parseNumber(token[5], c)) fail("Bad instance stride");
+            }
+
+            // Place each copy of the template
+            for (uint32_t i=0; i<b; ++i)
+            {
+                uint64_t base = a + (uint64_t)i * c;
+                if (base > 0xFFFFFFFF) fail("Address out of range");
+
+                // A single instance uses the name as given.  Otherwise the copies are numbered
+                if (count > 4)
+                {
+                    instanceName_.assign(token[1].data(), token[1].size());
+                    instanceName_ += to_string(i);
+                    ip_ = instanceName_;
+                }
+                else ip_ = token[1];
+
+                baseAddr_ = (uint32_t)base;
+                haveBase_ = true;
+                haveReg_  = false;
+
+                for (auto& entry : it->second)
+                {
+                    if (entry.isField)
+                        emitField(entry.name, entry.offset, entry.width);
+                    else
+                        emitReg(entry.name, entry.offset, entry.policy);
+                }
+            }
+            continue;
+        }
+
+        // If we get here, we don't recognize the keyword
+        fail("Syntax error");
+    }
+
+    // A template has to end in the file it started in
+    if (defining_) fail("Template has no end");
+
+    // Errors are once again reported against the file that included this one
+    filename_ = outerFilename;
+    line_     = outerLine;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// emitReg() - Reports a register to the caller, and makes it the current register
+//=================================================================================================
+void RegDefParser::emitReg(string_view name, uint32_t offset, int policy)
+{
+    if (!haveBase_) fail("No base defined");
+
+    uint64_t addr = (uint64_t)baseAddr_ + offset;
+    if (addr > 0xFFFFFFFF) fail("Address out of range");
+
+    reg_       = name;
+    regAddr_   = (uint32_t)addr;
+    regPolicy_ = policy;
+    haveReg_   = true;
+
+    if (onReg_) onReg_({ip_, reg_, regAddr_, regPolicy_});
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// emitField() - Reports a field of the current register to the caller
+//=================================================================================================
+void RegDefParser::emitField(string_view name, uint32_t bitPos, uint32_t width)
+{
+    if (!haveReg_) fail("No register defined");
+
+    if (onField_) onField_({ip_, reg_, name, regAddr_, bitPos, width, regPolicy_});
+}
+//=================================================================================================
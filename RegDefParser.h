@@ -0,0 +1,151 @@
+//=================================================================================================
+// RegDefParser.h - Defines a parser for register definitions files
+//
+// A register definitions file can contain blank lines, comments (beginning with '#' or '//'),
+// or any of these keywords:
+//
+//    base <IP_NAME> <base_address>
+//    reg <REG_NAME> <offset_from_base_address> [access_policy]
+//    field <FIELD_NAME> <rightmost_bit_number> <width_in_bits>
+//    include <filename>
+//    template <TEMPLATE_NAME>
+//    end
+//    instance <IP_NAME> <TEMPLATE_NAME> <base_address> [<count> <stride>]
+//
+// "include" reads another definitions file as though its lines appeared in place of the include
+// line.  A relative filename is relative to the directory of the file that includes it.
+//
+// The "reg" and "field" lines between "template" and "end" describe an IP block without placing
+// it anywhere.  "instance" places a copy of the template at a base address, as though a "base"
+// line and the template's lines appeared in its place.  With a count, it places that many
+// copies, "stride" bytes apart, named <IP_NAME>0, <IP_NAME>1, and so on.
+//
+// The access policy is one of the names in policyName[], and defaults to "volatile".
+//
+// The file is memory-mapped and tokenized in place, so parsing allocates nothing per line, and
+// every name handed to the caller is a view into the file itself.
+//=================================================================================================
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+
+class RegDefParser
+{
+public:
+
+    // The access policies, in the order of the fpgapolicy_t constants generated from them
+    static constexpr const char* policyName[] = {"rw", "ro", "wo", "volatile", "static"};
+    static constexpr int POLICY_COUNT   = 5;
+    static constexpr int DEFAULT_POLICY = 3;
+
+    // One register.  Its full name is <ip>_<name>
+    struct reg_t
+    {
+        std::string_view ip;
+        std::string_view name;
+        uint32_t         axiAddr;
+        int              policy;    // Index into policyName[]
+    };
+
+    // One bit-field.  Its full name is <ip>_<reg>_<name>
+    struct field_t
+    {
+        std::string_view ip;
+        std::string_view reg;
+        std::string_view name;
+        uint32_t         axiAddr;   // The AXI address of the register
+        uint32_t         bitPos;
+        uint32_t         width;
+        int              policy;    // The access policy of the register
+    };
+
+    // Called with each register and each field, in the order they're defined.  The names are
+    // only valid until the callback returns
+    typedef std::function<void(const reg_t&)>   reg_fn;
+    typedef std::function<void(const field_t&)> field_fn;
+
+    // Constructor
+    RegDefParser() {};
+
+    // No copy or assignment constructor - objects of this class can't be copied
+    RegDefParser (const RegDefParser&) = delete;
+    RegDefParser& operator= (const RegDefParser&) = delete;
+
+    // Parses a definitions file and every file it includes.  Throws a runtime_error that begins
+    // with "<filename>, line <n>: " if the file has an error in it
+    void    parse(std::string filename, reg_fn onReg, field_fn onField);
+
+    // From inside a callback, returns "<filename>, line <n>" for the line being reported, so
+    // that the caller can report its own errors the same way
+    std::string where();
+
+    // Returns the name of every file that was read, starting with the one passed to parse()
+    const std::vector<std::string>& files() {return files_;}
+
+protected:
+
+    // A file that's mapped into memory.  It's unmapped when this is destroyed
+    struct mapping_t
+    {
+        std::string name;
+        const char* data = nullptr;
+        size_t      size = 0;
+        ~mapping_t();
+    };
+
+    // A "reg" or "field" line inside a template
+    struct entry_t
+    {
+        bool             isField;
+        std::string_view name;
+        uint32_t         offset;    // reg: offset from the base address.  field: bit position
+        uint32_t         width;     // field: width in bits
+        int              policy;    // reg: access policy
+    };
+
+    // Parses one file.  "depth" is how deeply nested in includes it is
+    void    parseFile(const std::string& filename, int depth);
+
+    // Handles a "reg" or "field" line, whether it came from the file or from a template
+    void    emitReg(std::string_view name, uint32_t offset, int policy);
+    void    emitField(std::string_view name, uint32_t bitPos, uint32_t width);
+
+    // Parses a number, and throws if it's malformed
+    uint32_t number(std::string_view s);
+
+    // Throws a runtime_error that begins with where()
+    [[noreturn]] void fail(const char* fmt, ...);
+
+    // The caller's callbacks
+    reg_fn   onReg_;
+    field_fn onField_;
+
+    // Every file we've mapped.  They stay mapped until parse() returns, since templates and
+    // the current IP and register names point into them
+    std::vector<std::unique_ptr<mapping_t>> mapping_;
+    std::vector<std::string>                files_;
+
+    // The file and line we're on
+    const std::string* filename_ = nullptr;
+    int                line_ = 0;
+
+    // The templates, by name, and the one being defined (or nullptr)
+    std::unordered_map<std::string_view, std::vector<entry_t>> template_;
+    std::vector<entry_t>* defining_ = nullptr;
+
+    // The current IP block and register, which "reg" and "field" lines are relative to
+    std::string_view ip_;
+    std::string      instanceName_;
+    uint32_t         baseAddr_ = 0;
+    std::string_view reg_;
+    uint32_t         regAddr_ = 0;
+    int              regPolicy_ = DEFAULT_POLICY;
+    bool             haveBase_ = false;
+    bool             haveReg_ = false;
+};
+//=================================================================================================
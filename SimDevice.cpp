@@ -0,0 +1,337 @@
+//=================================================================================================
+// SimDevice.cpp - Implements a simulated PCI device
+//=================================================================================================
+#include <unistd.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdexcept>
+#include "SimDevice.h"
+#include "MmioCopy.h"
+#include "Util.h"
+using namespace std;
+
+#define c(s) s.c_str()
+
+// These are the IORESOURCE_xxx flags we write into the simulated sysfs "resource" file
+static const uint64_t IORESOURCE_MEM      = 0x00000200;
+static const uint64_t IORESOURCE_PREFETCH = 0x00002000;
+
+// The fake physical address of BAR 0.  Each BAR follows the one before it
+static const uint64_t SIM_PHYS_BASE = 0xF0000000;
+
+// The name of the device directory within the simulated sysfs directory
+static const char* SIM_BDF = "0000:00:00.0";
+
+// The name of the file that backs the simulated AXI address space
+static const char* AXI_FILE = "axi";
+
+// A PCI device has at most this many BARs
+static const int PCI_BAR_COUNT = 6;
+
+
+//=================================================================================================
+// writeTextFile() - Creates a file that contains a string
+//=================================================================================================
+static void writeTextFile(const string& filename, const string& text)
+{
+    FILE* file = fopen(c(filename), "w");
+    if (file == nullptr) throwRuntime("Can't create %s", c(filename));
+    fputs(c(text), file);
+    fclose(file);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// createSizedFile() - Creates a zero-filled file of the specified size
+//=================================================================================================
+static void createSizedFile(const string& filename, size_t size)
+{
+    int fd = ::open(c(filename), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) throwRuntime("Can't create %s", c(filename));
+    int rc = ftruncate(fd, size);
+    ::close(fd);
+    if (rc != 0) throwRuntime("Can't size %s", c(filename));
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// create() - Builds a simulated PCI device and opens it
+//
+// Passed: dir      = the directory to build the simulated sysfs tree in
+//         barSize  = the size of each BAR, in bytes (0 = the BAR doesn't exist)
+//         vendorID = the vendor ID of the simulated device
+//         deviceID = the device ID of the simulated device
+//
+// BAR 0 is simulated as a non-prefetchable register BAR.  All other BARs are prefetchable, and
+// their "resourceN_wc" file is a hard-link to "resourceN", just as on real hardware both names
+// refer to the same memory
+//=================================================================================================
+void SimDevice::create(string dir, vector<size_t> barSize, int vendorID, int deviceID)
+{
+    char     line[100];
+    string   resource;
+    uint64_t physAddr = SIM_PHYS_BASE;
+
+    // Get rid of any simulated device we already have
+    destroy();
+
+    // If the caller asked for too many BARs, complain
+    if (barSize.size() > PCI_BAR_COUNT) throwRuntime("SimDevice: too many BARs");
+
+    // Create the directory structure
+    simDir_       = dir;
+    simDeviceDir_ = dir + "/" + SIM_BDF;
+    mkdir(c(simDir_), 0777);
+    mkdir(c(simDeviceDir_), 0777);
+
+    // Create the ID files
+    snprintf(line, sizeof line, "0x%04x\n", vendorID);
+    writeTextFile(simDeviceDir_ + "/vendor", line);
+    snprintf(line, sizeof line, "0x%04x\n", deviceID);
+    writeTextFile(simDeviceDir_ + "/device", line);
+    writeTextFile(simDeviceDir_ + "/class", "0x058000\n");
+    writeTextFile(simDeviceDir_ + "/numa_node", "-1\n");
+
+    // Create a backing file for each BAR, and describe it in the "resource" file
+    for (int i=0; i<PCI_BAR_COUNT; ++i)
+    {
+        size_t size = i < (int)barSize.size() ? barSize[i] : 0;
+
+        // BARs that don't exist are all zeros in the resource file
+        if (size == 0)
+        {
+            resource += "0x0000000000000000 0x0000000000000000 0x0000000000000000\n";
+            continue;
+        }
+
+        // Describe this BAR
+        uint64_t flags = IORESOURCE_MEM | (i ? IORESOURCE_PREFETCH : 0);
+        snprintf(line, sizeof line, "0x%016" PRIx64 " 0x%016" PRIx64 " 0x%016" PRIx64 "\n",
+                 physAddr, physAddr + size - 1, flags);
+        resource += line;
+        physAddr += size;
+
+        // Create the backing file for this BAR
+        string filename = simDeviceDir_ + "/resource" + to_string(i);
+        createSizedFile(filename, size);
+
+        // Prefetchable BARs have a write-combining alias
+        string wcFilename = filename + "_wc";
+        if (i) link(c(filename), c(wcFilename));
+    }
+
+    // Write the resource file
+    writeTextFile(simDeviceDir_ + "/resource", resource);
+
+    // And open our simulated device
+    PciIndex::device_t device = {simDeviceDir_, SIM_BDF, vendorID, deviceID, -1, -1, 0x058000};
+    open(device);
+
+    // The simulated link is idle
+    linkFreeAt_ = clock::now();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// destroy() - Closes the simulated device and deletes the files that back it
+//=================================================================================================
+void SimDevice::destroy()
+{
+    // Unmap the simulated AXI space
+    if (axiMemory_) munmap(axiMemory_, proxy_.axiSize);
+    axiMemory_ = nullptr;
+
+    // Unmap the BARs
+    close();
+
+    // If we never created a device, we're done
+    if (simDir_.empty()) return;
+
+    // Delete the files we created
+    const char* names[] = {"vendor", "device", "class", "numa_node", "resource", AXI_FILE};
+    for (auto name : names) unlink((simDeviceDir_ + "/" + name).c_str());
+    for (int i=0; i<PCI_BAR_COUNT; ++i)
+    {
+        string filename = simDeviceDir_ + "/resource" + to_string(i);
+        string wcFilename = filename + "_wc";
+        unlink(c(filename));
+        unlink(c(wcFilename));
+    }
+    rmdir(c(simDeviceDir_));
+    rmdir(c(simDir_));
+
+    simDir_.clear();
+    simDeviceDir_.clear();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// setProxy() - Enables the PCIPROXY registers, and creates the AXI address space behind them
+//=================================================================================================
+void SimDevice::setProxy(const proxy_t& proxy)
+{
+    // We need to have a device to attach a proxy to
+    if (simDeviceDir_.empty()) throwRuntime("SimDevice: no device");
+
+    // Throw away any AXI space we already have
+    if (axiMemory_) munmap(axiMemory_, proxy_.axiSize);
+    axiMemory_ = nullptr;
+
+    // Save the new proxy configuration
+    proxy_ = proxy;
+
+    // If the proxy is disabled, we're done
+    if (proxy_.axiSize == 0) return;
+
+    // Create and map the file that backs the simulated AXI space
+    string filename = simDeviceDir_ + "/" + AXI_FILE;
+    createSizedFile(filename, proxy_.axiSize);
+    int fd = ::open(c(filename), O_RDWR);
+    if (fd < 0) throwRuntime("Can't open %s", c(filename));
+    void* ptr = mmap(0, proxy_.axiSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (ptr == MAP_FAILED) throwRuntime("SimDevice: can't map AXI space");
+    axiMemory_ = (uint8_t*)ptr;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// transact() - Models one transaction on the simulated link
+//
+// Passed: latencyNs = the fixed cost of the transaction
+//         bytes     = the number of bytes the transaction moves
+//
+// The link carries one transaction at a time.  A transaction starts when the link is free,
+// takes "latencyNs" plus however long "bytes" takes at the bandwidth cap, and the caller is
+// held until the transaction completes
+//=================================================================================================
+void SimDevice::transact(double latencyNs, size_t bytes)
+{
+    clock::time_point done;
+
+    // Compute how long this transaction occupies the link
+    double ns = latencyNs;
+    if (model_.bandwidthMBps > 0) ns += bytes * 1000.0 / model_.bandwidthMBps;
+
+    // Reserve the link for that long
+    {
+        lock_guard<mutex> lock(linkMutex_);
+        auto start  = max(clock::now(), linkFreeAt_);
+        done        = start + chrono::nanoseconds((int64_t)ns);
+        linkFreeAt_ = done;
+    }
+
+    // And spin until the transaction completes
+    while (clock::now() < done);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// address() - Returns the user-space address of an offset within a BAR, after checking that an
+//             access of "bytes" bytes at that offset lies within the BAR
+//=================================================================================================
+uint8_t* SimDevice::address(int barIndex, size_t offset, size_t bytes)
+{
+    auto& resource = bar(barIndex);
+    if (offset + bytes > resource.size)
+    {
+        throwRuntime("SimDevice: access of 0x%zx bytes at 0x%zx overflows BAR %i",
+                     bytes, offset, barIndex);
+    }
+    return resource.baseAddr + offset;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// proxyTarget() - Returns the address in the simulated AXI space that PCIPROXY_ADDRH and
+//                 PCIPROXY_ADDRL currently point to
+//=================================================================================================
+uint8_t* SimDevice::proxyTarget()
+{
+    uint8_t* base  = bar(proxy_.barIndex).baseAddr;
+    uint64_t addrH = *(volatile uint32_t*)(base + proxy_.addrH);
+    uint64_t addrL = *(volatile uint32_t*)(base + proxy_.addrL);
+    uint64_t axi   = (addrH << 32) | addrL;
+
+    if (axi + 4 > proxy_.axiSize)
+    {
+        throwRuntime("SimDevice: PCIPROXY address 0x%llx is outside of AXI space",
+                     (unsigned long long)axi);
+    }
+
+    return axiMemory_ + axi;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// read32() - Reads a 32-bit register through the latency model
+//=================================================================================================
+uint32_t SimDevice::read32(int barIndex, size_t offset)
+{
+    uint32_t value;
+
+    // If this is a read of PCIPROXY_DATA, fetch the value from the AXI address space
+    if (axiMemory_ && barIndex == proxy_.barIndex && offset == proxy_.data)
+        value = *(volatile uint32_t*)proxyTarget();
+    else
+        value = *(volatile uint32_t*)address(barIndex, offset, 4);
+
+    // Model the round-trip
+    transact(model_.readLatencyNs, 4);
+    return value;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// write32() - Writes a 32-bit register through the latency model
+//=================================================================================================
+void SimDevice::write32(int barIndex, size_t offset, uint32_t value)
+{
+    // If this is a write to PCIPROXY_DATA, store the value in the AXI address space
+    if (axiMemory_ && barIndex == proxy_.barIndex && offset == proxy_.data)
+        *(volatile uint32_t*)proxyTarget() = value;
+    else
+        *(volatile uint32_t*)address(barIndex, offset, 4) = value;
+
+    // Model the posted write
+    transact(model_.writeLatencyNs, 4);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// toDevice() - Copies a block of data to a BAR through the latency model
+//=================================================================================================
+void SimDevice::toDevice(int barIndex, size_t offset, const void* src, size_t bytes)
+{
+    MmioCopy::toDevice(address(barIndex, offset, bytes), src, bytes);
+    transact(model_.writeLatencyNs, bytes);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// fromDevice() - Copies a block of data from a BAR through the latency model.   Every
+//                "maxReadBytes" bytes costs a full read round-trip
+//=================================================================================================
+void SimDevice::fromDevice(void* dst, int barIndex, size_t offset, size_t bytes)
+{
+    MmioCopy::fromDevice(dst, address(barIndex, offset, bytes), bytes);
+    size_t reads = (bytes + model_.maxReadBytes - 1) / model_.maxReadBytes;
+    transact(model_.readLatencyNs * reads, bytes);
+}
+//=================================================================================================
@@ -0,0 +1,118 @@
+//=================================================================================================
+// SimDevice.h - Defines a simulated PCI device, for running on machines that have no FPGA
+//
+// A SimDevice builds a fake sysfs device directory whose "resourceN" files are ordinary files
+// (or shared memory, if the directory is on a tmpfs such as /dev/shm), and opens it like any
+// other PciDevice.   Other processes can open the same simulated device with
+// PciDevice::open(vendorID, deviceID, <directory>).
+//
+// The read32()/write32()/toDevice()/fromDevice() methods access the BARs through a latency
+// model that imitates a PCIe link, and implement the PCIPROXY ADDRH/ADDRL/DATA registers.
+//
+// Only those four methods are simulated.  Anything that accesses a BAR through bar(n).baseAddr
+// (FpgaReg, TypedReg, FpgaRegTxn, Mmio, MmioBatch, MmioCopy, BarWriter, StripeWriter) is just
+// reading and writing the backing file: there's no link latency, and writing PCIPROXY_DATA that
+// way never reaches the simulated AXI address space.  Those classes deliberately have no hook
+// the simulator could intercept, since it would cost every register access on real hardware.
+//
+// So for that code, a SimDevice is a functional stand-in that lets it run (and be checked)
+// without an FPGA, not a model of how fast it runs: pcibench runs it on the simulator, but
+// doesn't time it.
+//=================================================================================================
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include "PciDevice.h"
+
+class SimDevice : public PciDevice
+{
+public:
+
+    // Describes how a simulated PCIe link behaves
+    struct model_t
+    {
+        double  readLatencyNs  = 800;   // Round-trip time of a single non-posted read
+        double  writeLatencyNs = 50;    // Time for the CPU to issue a single posted write
+        double  bandwidthMBps  = 0;     // Link bandwidth cap in megabytes/sec. 0 = unlimited
+        size_t  maxReadBytes   = 64;    // The most bytes a single read can fetch
+    };
+
+    // Describes where the PCIPROXY registers live
+    struct proxy_t
+    {
+        int      barIndex = 0;          // The BAR that contains the PCIPROXY registers
+        uint32_t addrH    = 0;          // Offset of PCIPROXY_ADDRH within that BAR
+        uint32_t addrL    = 4;          // Offset of PCIPROXY_ADDRL within that BAR
+        uint32_t data     = 8;          // Offset of PCIPROXY_DATA within that BAR
+        size_t   axiSize  = 0;          // Size of the simulated AXI address space. 0 = disabled
+    };
+
+    // Constructor
+    SimDevice() {};
+
+    // Destructor
+    ~SimDevice() {destroy();}
+
+    // Builds a simulated device in the specified directory and opens it.  barSize[n] is the
+    // size of BAR n.  A size of 0 means "BAR n doesn't exist"
+    void    create(std::string dir, std::vector<size_t> barSize,
+                   int vendorID = 0x10ee, int deviceID = 0x903f);
+
+    // Closes the simulated device and deletes its files
+    void    destroy();
+
+    // Returns the sysfs-style directory that contains the simulated device
+    const std::string& simDir() {return simDir_;}
+
+    // Sets the latency model
+    void    setModel(const model_t& model) {model_ = model;}
+
+    // Enables the PCIPROXY registers
+    void    setProxy(const proxy_t& proxy);
+
+    // Returns a pointer to the simulated AXI address space that PCIPROXY accesses
+    uint8_t* axiMemory() {return axiMemory_;}
+
+    // Reads and writes a 32-bit register through the latency model
+    uint32_t read32(int barIndex, size_t offset);
+    void     write32(int barIndex, size_t offset, uint32_t value);
+
+    // Copies a block of data to or from a BAR through the latency model
+    void     toDevice(int barIndex, size_t offset, const void* src, size_t bytes);
+    void     fromDevice(void* dst, int barIndex, size_t offset, size_t bytes);
+
+protected:
+
+    typedef std::chrono::steady_clock clock;
+
+    // Occupies the simulated link for one transaction and waits for it to complete
+    void     transact(double latencyNs, size_t bytes);
+
+    // Checks that an access falls inside a BAR, and returns its user-space address
+    uint8_t* address(int barIndex, size_t offset, size_t bytes);
+
+    // Returns the AXI address that PCIPROXY_DATA currently refers to
+    uint8_t* proxyTarget();
+
+    // The directory we built, and the device directory inside of it
+    std::string simDir_, simDeviceDir_;
+
+    // The latency model
+    model_t     model_;
+
+    // The PCIPROXY register configuration
+    proxy_t     proxy_;
+
+    // The simulated AXI address space behind PCIPROXY
+    uint8_t*    axiMemory_ = nullptr;
+
+    // The simulated link is busy until this time
+    clock::time_point linkFreeAt_;
+
+    // Serializes access to the simulated link
+    std::mutex  linkMutex_;
+};
@@ -0,0 +1,100 @@
+//=================================================================================================
+// SpscQueue.h - Defines a lock-free, fixed-capacity, single-producer/single-consumer queue
+//
+// Exactly one thread may call push() and exactly one (other) thread may call pop().  Neither
+// ever blocks: push() returns false when the queue is full, and pop() returns false when it's
+// empty.  Each side keeps a private copy of the other side's index, and only re-reads the shared
+// one when its copy says the queue is full (or empty), so in the steady state the producer and
+// consumer don't touch each other's cache-lines.
+//=================================================================================================
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+
+template <class T> class SpscQueue
+{
+public:
+
+    // Constructor - The capacity is rounded up to a power of 2
+    SpscQueue(size_t capacity = 0) {if (capacity) init(capacity);}
+
+    // No copy or assignment constructor - objects of this class can't be copied
+    SpscQueue (const SpscQueue&) = delete;
+    SpscQueue& operator= (const SpscQueue&) = delete;
+
+    // Sets the capacity of the queue and empties it.  Not thread-safe
+    void init(size_t capacity)
+    {
+        if (capacity == 0) throw std::runtime_error("SpscQueue: invalid capacity");
+
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+
+        slot_.reset(new T[size]);
+        mask_       = size - 1;
+        head_       = 0;
+        tail_       = 0;
+        cachedHead_ = 0;
+        cachedTail_ = 0;
+    }
+
+    // Called by the producer.  Returns false if the queue is full
+    bool push(const T& value)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+
+        // If the queue looks full, find out where the consumer really is
+        if (tail - cachedHead_ > mask_)
+        {
+            cachedHead_ = head_.load(std::memory_order_acquire);
+            if (tail - cachedHead_ > mask_) return false;
+        }
+
+        slot_[tail & mask_] = value;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Called by the consumer.  Returns false if the queue is empty
+    bool pop(T& value)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+
+        // If the queue looks empty, find out where the producer really is
+        if (head == cachedTail_)
+        {
+            cachedTail_ = tail_.load(std::memory_order_acquire);
+            if (head == cachedTail_) return false;
+        }
+
+        value = slot_[head & mask_];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Returns the number of items in the queue.  This is only a snapshot
+    size_t size()
+    {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+
+    // Returns the maximum number of items the queue can hold
+    size_t capacity() {return mask_ + 1;}
+
+protected:
+
+    // The storage for the items, and the mask that turns an index into a slot number
+    std::unique_ptr<T[]> slot_;
+    size_t               mask_ = 0;
+
+    // The consumer's index, and the consumer's copy of the producer's index
+    alignas(64) std::atomic<size_t> head_{0};
+    size_t                          cachedTail_ = 0;
+
+    // The producer's index, and the producer's copy of the consumer's index
+    alignas(64) std::atomic<size_t> tail_{0};
+    size_t                          cachedHead_ = 0;
+};
@@ -0,0 +1,229 @@
+//=================================================================================================
+// StripeWriter.cpp - Implements a class that stripes one logical transfer across several devices
+//=================================================================================================
+#include <stdio.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <pthread.h>
+#include <chrono>
+#include <stdexcept>
+#include "StripeWriter.h"
+#include "MmioCopy.h"
+#include "Mmio.h"
+#include "Util.h"
+using namespace std;
+
+// When a transfer is split into one contiguous piece per card, pieces are a multiple of this
+static const size_t PIECE_ALIGN = 64;
+
+
+//=================================================================================================
+// start() - Starts one worker thread for each card
+//
+// Passed: cards      = the devices to stripe across, all of which must already be open
+//         barIndex   = which BAR to write on each card
+//         stripeSize = the size of each stripe, 0 = one contiguous piece per card
+//=================================================================================================
+void StripeWriter::start(vector<PciDevice*> cards, int barIndex, size_t stripeSize)
+{
+    // If we already have threads running, stop them
+    stop();
+
+    // We need at least one card
+    if (cards.empty()) throwRuntime("StripeWriter: no cards");
+
+    // Find the BAR we'll be writing to on each card.  The list is built on the side so that a
+    // previous start() doesn't leave its cards in it, and a card without that BAR leaves it alone
+    vector<PciDevice::resource_t*> bars;
+    for (auto card : cards) bars.push_back(&card->bar(barIndex));
+    card_.swap(bars);
+
+    // Save the stripe size and make room for the per-card reports
+    stripeSize_ = stripeSize;
+    report_.assign(card_.size(), {0, 0, 0});
+
+    // Start one worker thread per card, running on the CPUs closest to that card
+    for (int i=0; i<(int)card_.size(); ++i)
+    {
+        thread_.push_back(thread(&StripeWriter::workerLoop, this, i, cards[i]->localCpus()));
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// stop() - Waits for any job in progress, then stops the worker threads
+//=================================================================================================
+void StripeWriter::stop()
+{
+    // If there are no threads running, there's nothing to do
+    if (thread_.empty()) return;
+
+    // Wait for any job that's still in progress
+    wait();
+
+    // Tell the workers to quit
+    {
+        lock_guard<mutex> lock(mutex_);
+        quit_ = true;
+    }
+    jobReady_.notify_all();
+
+    // And wait for them to do so
+    for (auto& t : thread_) t.join();
+
+    // We no longer have any workers or cards
+    thread_.clear();
+    card_.clear();
+    quit_ = false;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// writeAsync() - Hands a new job to the worker threads and returns immediately
+//
+// Passed: offset   = byte offset within each card's BAR where the striped data begins
+//         src      = the host buffer to be written
+//         bytes    = the number of bytes to write, in total, across all cards
+//         readBack = if true, each worker reads back from its card after writing it
+//=================================================================================================
+void StripeWriter::writeAsync(size_t offset, const void* src, size_t bytes, bool readBack)
+{
+    size_t cards = card_.size();
+
+    // If there are no workers, complain
+    if (cards == 0) throwRuntime("StripeWriter: not started");
+
+    // Wait for any previous job to complete
+    wait();
+
+    // Determine the stripe size for this job
+    size_t stripe = stripeSize_;
+    if (stripe == 0)
+    {
+        stripe = (bytes + cards - 1) / cards;
+        stripe = (stripe + PIECE_ALIGN - 1) & ~(PIECE_ALIGN - 1);
+        if (stripe == 0) stripe = PIECE_ALIGN;
+    }
+
+    // Make sure that no card's share runs off the end of its BAR
+    size_t stripes = (bytes + stripe - 1) / stripe;
+    for (size_t i=0; i<cards && i<stripes; ++i)
+    {
+        size_t count  = (stripes - 1 - i) / cards + 1;
+        size_t last   = i + (count - 1) * cards;
+        size_t length = min(stripe, bytes - last * stripe);
+        size_t extent = offset + (count - 1) * stripe + length;
+        if (extent > card_[i]->size)
+        {
+            throwRuntime("StripeWriter: card %i, write of 0x%zx bytes overflows BAR %i",
+                         (int)i, extent, card_[i]->barIndex);
+        }
+    }
+
+    // Post the job and wake up the workers
+    {
+        lock_guard<mutex> lock(mutex_);
+        job_.offset     = offset;
+        job_.src        = (const uint8_t*)src;
+        job_.bytes      = bytes;
+        job_.stripeSize = stripe;
+        job_.readBack   = readBack;
+        busyWorkers_    = (int)cards;
+        ++generation_;
+    }
+    jobReady_.notify_all();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// wait() - Waits for the job in progress to complete, and returns the per-card reports
+//=================================================================================================
+const vector<StripeWriter::report_t>& StripeWriter::wait()
+{
+    unique_lock<mutex> lock(mutex_);
+    jobDone_.wait(lock, [this]{return busyWorkers_ == 0;});
+    return report_;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// write() - Writes a striped buffer and waits for the write to complete
+//=================================================================================================
+const vector<StripeWriter::report_t>& StripeWriter::write(size_t offset, const void* src,
+                                                          size_t bytes, bool readBack)
+{
+    writeAsync(offset, src, bytes, readBack);
+    return wait();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// writeShare() - Writes every stripe of the current job that belongs to one card
+//
+// Passed:  index = the index of the card
+//
+// Returns: the number of bytes written to that card
+//
+// Stripe "k" of the job goes to card "k % cardCount", at stripe slot "k / cardCount" of that card
+//=================================================================================================
+size_t StripeWriter::writeShare(int index)
+{
+    size_t   cards  = card_.size();
+    size_t   stripe = job_.stripeSize;
+    uint8_t* base   = card_[index]->baseAddr + job_.offset;
+    size_t   total  = 0;
+
+    for (size_t k = index; k * stripe < job_.bytes; k += cards)
+    {
+        size_t length = min(stripe, job_.bytes - k * stripe);
+        MmioCopy::toDevice(base + (k / cards) * stripe, job_.src + k * stripe, length);
+        total += length;
+    }
+
+    // A read from the device can't pass the posted writes ahead of it
+    if (job_.readBack && total) Mmio::read32(base);
+
+    return total;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// workerLoop() - Each worker waits for a job, writes its card's share, then waits again
+//=================================================================================================
+void StripeWriter::workerLoop(int index, vector<int> cpuList)
+{
+    uint64_t lastGeneration = 0;
+
+    // Run on the CPUs that are local to our card
+    pinThread(cpuList);
+
+    while (true)
+    {
+        // Wait for either a new job or for the signal to quit
+        {
+            unique_lock<mutex> lock(mutex_);
+            jobReady_.wait(lock, [&]{return quit_ || generation_ != lastGeneration;});
+            if (quit_) return;
+            lastGeneration = generation_;
+        }
+
+        // Write our card's share of the job, and time how long it takes
+        auto   startTime = chrono::steady_clock::now();
+        size_t bytes     = writeShare(index);
+        double seconds   = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+
+        // Record the report for our card, and tell wait() when the last worker is done
+        {
+            lock_guard<mutex> lock(mutex_);
+            report_[index] = {bytes, seconds, seconds > 0 ? bytes / seconds / 1e6 : 0};
+            if (--busyWorkers_ == 0) jobDone_.notify_all();
+        }
+    }
+}
+//=================================================================================================
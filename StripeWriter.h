@@ -0,0 +1,108 @@
+//=================================================================================================
+// StripeWriter.h - Defines a class that stripes one logical transfer across several PCI devices
+//
+// A StripeWriter treats the same BAR on several identical cards as a single striped target. A
+// host buffer is split into stripes that are dealt out to the cards round-robin, and each card
+// is written concurrently by its own worker thread.
+//=================================================================================================
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "PciDevice.h"
+
+class StripeWriter
+{
+public:
+
+    // Describes how the most recent transfer went on one card
+    struct report_t
+    {
+        size_t  bytes;              // The number of bytes written to this card
+        double  seconds;            // How long it took to write them
+        double  mbps;               // Throughput in megabytes per second
+    };
+
+    // Constructor
+    StripeWriter() {};
+
+    // No copy or assignment constructor - objects of this class can't be copied
+    StripeWriter (const StripeWriter&) = delete;
+    StripeWriter& operator= (const StripeWriter&) = delete;
+
+    // Destructor - Stops the worker threads
+    ~StripeWriter() {stop();}
+
+    // Starts one worker thread per card, each pinned to the CPUs that are local to its card.
+    // A stripeSize of 0 means "split each transfer into one contiguous piece per card"
+    void    start(std::vector<PciDevice*> cards, int barIndex, size_t stripeSize = 0);
+
+    // Stops the worker threads
+    void    stop();
+
+    // Returns the number of cards we're striping across
+    int     cardCount() {return (int)card_.size();}
+
+    // Starts writing "bytes" bytes from "src", striped across the cards, starting at "offset"
+    // within each card's BAR.   If "readBack" is true, each worker reads back from its card when
+    // it's done, which ensures that every posted write has arrived
+    void    writeAsync(size_t offset, const void* src, size_t bytes, bool readBack = false);
+
+    // Waits for the transfer to complete and returns a report for each card
+    const std::vector<report_t>& wait();
+
+    // Convenience method: writeAsync() followed by wait()
+    const std::vector<report_t>& write(size_t offset, const void* src, size_t bytes,
+                                       bool readBack = false);
+
+protected:
+
+    // The loop that the worker for card "index" runs
+    void    workerLoop(int index, std::vector<int> cpuList);
+
+    // Writes this card's share of the current job, and returns the number of bytes written
+    size_t  writeShare(int index);
+
+    // Describes the transfer that is currently in progress
+    struct job_t
+    {
+        size_t         offset;
+        const uint8_t* src;
+        size_t         bytes;
+        size_t         stripeSize;
+        bool           readBack;
+    } job_;
+
+    // The BAR we're writing to on each card
+    std::vector<PciDevice::resource_t*> card_;
+
+    // The size of a stripe, 0 = one contiguous piece per card
+    size_t                  stripeSize_ = 0;
+
+    // One completion report per card
+    std::vector<report_t>   report_;
+
+    // Guards everything below
+    std::mutex              mutex_;
+
+    // Workers wait on this for a new job to arrive
+    std::condition_variable jobReady_;
+
+    // wait() waits on this for the workers to finish the current job
+    std::condition_variable jobDone_;
+
+    // Incremented every time a new job is posted
+    uint64_t                generation_ = 0;
+
+    // The number of workers still working on the current job
+    int                     busyWorkers_ = 0;
+
+    // True when the worker threads should exit
+    bool                    quit_ = false;
+
+    // The worker threads
+    std::vector<std::thread> thread_;
+};
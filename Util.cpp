@@ -0,0 +1,56 @@
+//=================================================================================================
+// Util.cpp - Implements small helpers that are shared by the rest of the code
+//=================================================================================================
+#include <stdio.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdexcept>
+#include "Util.h"
+using namespace std;
+
+
+//=================================================================================================
+// throwRuntime() - Throws a runtime exception
+//=================================================================================================
+void throwRuntime(const char* fmt, ...)
+{
+    char buffer[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buffer, sizeof buffer, fmt, ap);
+    va_end(ap);
+
+    throw runtime_error(buffer);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// pinThread() - Pins the calling thread to the specified CPU.  A cpu of -1 means "don't pin"
+//=================================================================================================
+void pinThread(int cpu)
+{
+    if (cpu < 0 || cpu >= CPU_SETSIZE) return;
+
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(cpu, &cpuSet);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// pinThread() - Pins the calling thread to a set of CPUs.  An empty list means "don't pin"
+//=================================================================================================
+void pinThread(const vector<int>& cpuList)
+{
+    if (cpuList.empty()) return;
+
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    for (int cpu : cpuList) if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &cpuSet);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+}
+//=================================================================================================
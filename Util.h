@@ -0,0 +1,15 @@
+//=================================================================================================
+// Util.h - Declares small helpers that are shared by the rest of the code
+//=================================================================================================
+#pragma once
+#include <vector>
+
+// Throws a std::runtime_error whose message is formatted like printf()
+[[noreturn]] void throwRuntime(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// Pins the calling thread to a CPU.  A cpu of -1 means "don't pin"
+void pinThread(int cpu);
+
+// Pins the calling thread to a set of CPUs.  An empty list means "don't pin"
+void pinThread(const std::vector<int>& cpuList);
+//=================================================================================================
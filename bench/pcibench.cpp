@@ -0,0 +1,776 @@
+//=================================================================================================
+// pcibench.cpp - Benchmarks MMIO latency, BAR write bandwidth, FpgaReg operation rate,
+//                completion wake-up latency, acquisition pipeline throughput, and PhysMem and
+//                capture-to-disk bandwidth, against real hardware or a simulated device
+//
+// Usage: pcibench [options]
+//
+//    -sim                     Run against a simulated device (this is the default)
+//    -hw <vendor> <device>    Run against the first real device with this vendor and device ID
+//    -regbar <n>              The BAR that holds the registers (default 0)
+//    -databar <n>             The BAR to measure write bandwidth on (default 2)
+//    -size <bytes>            The size of each bandwidth transfer (default 4 MB)
+//    -physmem                 Also measure the "memmap=" region from /proc/cmdline
+//    -capture <filename>      Also measure capture-to-disk bandwidth, writing to this file
+//    -json <filename>         Where to write the machine-readable results (default pcibench.json)
+//=================================================================================================
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include "../PciDevice.h"
+#include "../SimDevice.h"
+#include "../PhysMem.h"
+#include "../FpgaReg.h"
+#include "../FpgaRegTxn.h"
+#include "../MmioCopy.h"
+#include "../Mmio.h"
+#include "../BarWriter.h"
+#include "../NumaBuffer.h"
+#include "../DmaPool.h"
+#include "../CaptureWriter.h"
+#include "../CompletionWait.h"
+#include "../AcqPipeline.h"
+#include "../FileDes.h"
+using namespace std;
+
+typedef chrono::steady_clock clk;
+
+// One measured result, and what it was measured against: "hw" (real hardware, or host memory
+// and disks) or "sim-model" (the simulator's link model)
+struct result_t {string group; string name; double value; string unit; string backend;};
+
+// Every result we've measured
+static vector<result_t> results;
+
+// What the results being measured right now are measured against.  "sim-ram" means a simulated
+// BAR accessed as plain memory: the code under test runs, but how long it takes says nothing
+// about real hardware, so nothing is recorded
+static string backend = "hw";
+
+// The command line options
+static bool   useSim     = true;
+static int    vendorID   = 0x10ee;
+static int    deviceID   = 0x903f;
+static int    regBar     = 0;
+static int    dataBar    = 2;
+static size_t xferSize   = 4 * 1024 * 1024;
+static bool   usePhysMem = false;
+static string captureFile;
+static string jsonFile   = "pcibench.json";
+
+// The device under test.  "sim" is only non-null when we're running against the simulator
+static PciDevice* device;
+static SimDevice* sim;
+
+// Register definitions that match the compiled-in fpgareg_t and fpgafld_t constants
+static const char* benchDefinitions =
+    "base PCIPROXY 0\n"
+    "reg ADDRH 0x00 rw\n"
+    "field btm 0 8\n"
+    "field mid 8 16\n"
+    "field top 24 8\n"
+    "reg ADDRL 0x04 rw\n"
+    "reg DATA 0x08 volatile\n";
+
+
+//=================================================================================================
+// seconds() - Returns the number of seconds since "start"
+//=================================================================================================
+static double seconds(clk::time_point start)
+{
+    return chrono::duration<double>(clk::now() - start).count();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// record() - Records a result and displays it
+//
+// On a simulated BAR that's accessed as plain memory, the measurement isn't a benchmark: all
+// that's reported is that the code ran
+//=================================================================================================
+static void record(string group, string name, double value, string unit)
+{
+    if (backend == "sim-ram")
+    {
+        printf("  %-28s %-24s %14s\n", group.c_str(), name.c_str(), "ran (untimed)");
+        return;
+    }
+
+    results.push_back({group, name, value, unit, backend});
+    printf("  %-28s %-24s %14.2f %s\n", group.c_str(), name.c_str(), value, unit.c_str());
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// readReg() - Reads a 32-bit register from the register BAR of the device under test
+//=================================================================================================
+static uint32_t readReg(size_t offset)
+{
+    if (sim) return sim->read32(regBar, offset);
+    return *(volatile uint32_t*)(device->bar(regBar).baseAddr + offset);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// benchReadLatency() - Measures the round-trip latency of single 32-bit MMIO reads
+//=================================================================================================
+static void benchReadLatency()
+{
+    backend = sim ? "sim-model" : "hw";
+    const int warmup = 1000, count = 20000;
+    vector<double> sample(count);
+
+    // Warm up the caches, TLB, and link
+    for (int i=0; i<warmup; ++i) readReg(0);
+
+    // Time each read individually
+    for (int i=0; i<count; ++i)
+    {
+        auto start = clk::now();
+        readReg(0);
+        sample[i] = chrono::duration<double, nano>(clk::now() - start).count();
+    }
+
+    // Report the percentiles
+    sort(sample.begin(), sample.end());
+    record("mmio_read_latency", "p50",  sample[count * 50  / 100 ], "ns");
+    record("mmio_read_latency", "p99",  sample[count * 99  / 100 ], "ns");
+    record("mmio_read_latency", "p999", sample[count * 999 / 1000], "ns");
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// benchWrite() - Measures the bandwidth of one write strategy
+//
+// Passed: name  = the name of the strategy
+//         write = a function that writes "bytes" bytes from "src" to "dst"
+//=================================================================================================
+template <class F> static void benchWrite(string name, F write)
+{
+    auto&    bar   = device->bar(dataBar);
+    size_t   bytes = min(xferSize, bar.size);
+    int      reps  = max(1, (int)((256 << 20) / bytes));
+    NumaBuffer src(bytes, device->numaNode());
+
+    // Fill the source buffer with something other than zeros
+    for (size_t i=0; i<bytes; ++i) src.bptr()[i] = (uint8_t)i;
+
+    // Do one untimed write to get everything warmed up
+    write(bar.baseAddr, src.bptr(), bytes);
+
+    // Time a series of writes, ending with a read to ensure the posted writes have landed
+    auto start = clk::now();
+    for (int i=0; i<reps; ++i) write(bar.baseAddr, src.bptr(), bytes);
+    (void)*(volatile uint32_t*)bar.baseAddr;
+    double elapsed = seconds(start);
+
+    record("write_bandwidth", name, reps * bytes / elapsed / 1e6, "MB/s");
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// benchWriteBandwidth() - Measures posted-write bandwidth for each store width and copy strategy
+//=================================================================================================
+static void benchWriteBandwidth()
+{
+    // On the simulator, only a copy through SimDevice::toDevice() goes through the link model
+    if (sim)
+    {
+        backend = "sim-model";
+        auto& bar = device->bar(dataBar);
+        benchWrite("sim_toDevice", [&](uint8_t* dst, const uint8_t* src, size_t bytes)
+        {
+            sim->toDevice(dataBar, dst - bar.baseAddr, src, bytes);
+        });
+    }
+
+    // Everything else writes the BAR directly
+    backend = sim ? "sim-ram" : "hw";
+
+    // Plain 32-bit stores
+    benchWrite("store32", [](uint8_t* dst, const uint8_t* src, size_t bytes)
+    {
+        for (size_t i=0; i<bytes; i += 4) *(volatile uint32_t*)(dst + i) = *(uint32_t*)(src + i);
+    });
+
+    // Plain 64-bit stores
+    benchWrite("store64", [](uint8_t* dst, const uint8_t* src, size_t bytes)
+    {
+        for (size_t i=0; i<bytes; i += 8) *(volatile uint64_t*)(dst + i) = *(uint64_t*)(src + i);
+    });
+
+    // Whatever libc decides to do
+    benchWrite("memcpy", [](uint8_t* dst, const uint8_t* src, size_t bytes)
+    {
+        memcpy(dst, src, bytes);
+    });
+
+    // Each MmioCopy kernel that this CPU supports
+    auto original = MmioCopy::kernel();
+    for (auto kernel : {MmioCopy::KERNEL_SCALAR, MmioCopy::KERNEL_NEON,
+                        MmioCopy::KERNEL_AVX2,   MmioCopy::KERNEL_AVX512})
+    {
+        if (!MmioCopy::isSupported(kernel)) continue;
+        MmioCopy::selectKernel(kernel);
+        benchWrite(string("mmiocopy_") + MmioCopy::kernelName(kernel),
+                   [](uint8_t* dst, const uint8_t* src, size_t bytes)
+        {
+            MmioCopy::toDevice(dst, src, bytes);
+        });
+    }
+    MmioCopy::selectKernel(original);
+
+    // A BarWriter with several thread-counts
+    int cpus = (int)device->localCpus().size();
+    if (cpus == 0) cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    for (int threads = 2; threads <= 8 && threads <= cpus; threads *= 2)
+    {
+        BarWriter writer;
+        writer.start(threads, *device);
+        auto& bar = device->bar(dataBar);
+        benchWrite("barwriter_" + to_string(threads) + "t",
+                   [&](uint8_t* dst, const uint8_t* src, size_t bytes)
+        {
+            writer.write(bar, dst - bar.baseAddr, src, bytes);
+        });
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// benchFpgaReg() - Measures how many FpgaReg operations per second we can perform
+//=================================================================================================
+static void benchFpgaReg()
+{
+    // Loading the definitions is host-side work, even on the simulator
+    backend = "hw";
+    const int count = 1000000;
+
+    // Write out register definitions that match the compiled-in constants, and read them in
+    char filename[] = "/tmp/pcibench-XXXXXX";
+    int fd = mkstemp(filename);
+    if (fd < 0) {printf("  can't create %s, skipping FpgaReg\n", filename); return;}
+    write(fd, benchDefinitions, strlen(benchDefinitions));
+    close(fd);
+
+    // How long does it take to parse them, and how long to load them from the cache that
+    // parsing them leaves behind?
+    auto start = clk::now();
+    FpgaReg::readDefinitions(filename);
+    record("fpgareg_ops", "definitions_parse", seconds(start) * 1e6, "us");
+    start = clk::now();
+    FpgaReg::readDefinitions(filename);
+    record("fpgareg_ops", "definitions_cached", seconds(start) * 1e6, "us");
+
+    // Everything from here on accesses the register BAR directly
+    backend = sim ? "sim-ram" : "hw";
+    unlink(filename);
+    unlink((string(filename) + ".cache").c_str());
+
+    // Registers live in the register BAR
+    FpgaReg::setUserspaceAddr(device->bar(regBar).baseAddr);
+    FpgaReg reg(REG_PCIPROXY_ADDRH);
+    FpgaReg dataReg(REG_PCIPROXY_DATA);
+
+    // How many reads per second?  DATA is volatile, so every one of these goes to the device
+    start = clk::now();
+    for (int i=0; i<count; ++i) dataReg.read();
+    record("fpgareg_ops", "read", count / seconds(start), "ops/s");
+
+    // How many reads per second of a register that's served from the shadow?
+    start = clk::now();
+    for (int i=0; i<count; ++i) reg.read();
+    record("fpgareg_ops", "shadow_read", count / seconds(start), "ops/s");
+
+    // How many writes per second?
+    start = clk::now();
+    for (int i=0; i<count; ++i) reg.write(i);
+    (void)reg.read();
+    record("fpgareg_ops", "write", count / seconds(start), "ops/s");
+
+    // How many writes per second if each one is made certain of with a read-back?  fetch()
+    // goes to the device, where read() would answer from the shadow
+    start = clk::now();
+    for (int i=0; i<count; ++i)
+    {
+        reg.write(i);
+        reg.fetch();
+    }
+    record("fpgareg_ops", "write_readback", count / seconds(start), "ops/s");
+
+    // And how many raw register writes per second if they're posted in batches of 16 with one
+    // read-back per batch?  This is MmioBatch, underneath FpgaReg
+    uint8_t* addrH = FpgaReg::lookup("PCIPROXY_ADDRH")->axiAddr + device->bar(regBar).baseAddr;
+    MmioBatch batch;
+    start = clk::now();
+    for (int i=0; i<count; ++i)
+    {
+        batch.write32(addrH, i);
+        if (batch.pending() == 16) batch.complete(addrH);
+    }
+    batch.complete(addrH);
+    record("mmio_ops", "posted_write", count / seconds(start), "ops/s");
+
+    // How many setField() calls per second?
+    start = clk::now();
+    for (int i=0; i<count; ++i) reg.setField(FLD_PCIPROXY_ADDRH_mid, i);
+    (void)reg.read();
+    record("fpgareg_ops", "setField", count / seconds(start), "ops/s");
+
+    // How many compile-time-checked setField() calls per second?
+    TypedReg<REG_PCIPROXY_ADDRH> typed;
+    start = clk::now();
+    for (int i=0; i<count; ++i) typed.setField<FLD_PCIPROXY_ADDRH_mid>(i);
+    (void)typed.read();
+    record("fpgareg_ops", "typed_setField", count / seconds(start), "ops/s");
+
+    // How many waitForField() calls per second, when the field already holds the value?  This
+    // is the overhead a wait adds to the register read it can't avoid
+    reg.setField(FLD_PCIPROXY_ADDRH_mid, 7);
+    start = clk::now();
+    for (int i=0; i<count; ++i) reg.waitForField(FLD_PCIPROXY_ADDRH_mid, 7);
+    record("fpgareg_ops", "waitForField", count / seconds(start), "ops/s");
+
+    // How many field updates per second when they're batched into transactions?  Each
+    // transaction sets every field of ADDRH and writes ADDRL and DATA: 5 updates, 3 writes
+    FpgaReg    addrL(REG_PCIPROXY_ADDRL), data(REG_PCIPROXY_DATA);
+    FpgaRegTxn txn;
+    start = clk::now();
+    for (int i=0; i<count; i += 5)
+    {
+        txn.setField(reg, FLD_PCIPROXY_ADDRH_btm, i);
+        txn.setField(reg, FLD_PCIPROXY_ADDRH_mid, i);
+        txn.setField(reg, FLD_PCIPROXY_ADDRH_top, i);
+        txn.write(addrL, i);
+        txn.write(data, i);
+        txn.commit();
+    }
+    record("fpgareg_ops", "txn_update", count / seconds(start), "ops/s");
+
+    // How many name lookups per second?  This never touches the device
+    backend = "hw";
+    const char* names[] = {"PCIPROXY_ADDRH", "PCIPROXY_ADDRH_mid", "PCIPROXY_DATA", "NO_SUCH_REG"};
+    size_t found = 0;
+    start = clk::now();
+    for (int i=0; i<count; ++i) found += (FpgaReg::lookup(names[i & 3]) != nullptr);
+    record("fpgareg_ops", "lookup", count / seconds(start), "ops/s");
+    if (found != (size_t)count * 3 / 4) printf("  lookup found %zu names\n", found);
+
+    // How many reads by name per second?
+    backend = sim ? "sim-ram" : "hw";
+    start = clk::now();
+    for (int i=0; i<count; ++i) FpgaReg::readByName("PCIPROXY_DATA");
+    record("fpgareg_ops", "readByName", count / seconds(start), "ops/s");
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// benchCompletionWait() - Measures how long CompletionWait takes to wake up after an event, in
+//                         each of its modes
+//
+// The events come from an eventfd that another thread signals, standing in for a device
+// interrupt.  The signaling thread waits a while before each event, so that a waiter in
+// MODE_BLOCK or MODE_HYBRID has gone to sleep by the time it arrives
+//=================================================================================================
+static void benchCompletionWait()
+{
+    backend = "hw";
+    const int count = 2000;
+
+    const struct {CompletionWait::mode_t mode; const char* name;} modes[] =
+    {
+        {CompletionWait::MODE_SPIN,   "spin"},
+        {CompletionWait::MODE_BLOCK,  "block"},
+        {CompletionWait::MODE_HYBRID, "hybrid"}
+    };
+
+    for (auto& m : modes)
+    {
+        FileDes        efd = eventfd(0, EFD_NONBLOCK);
+        CompletionWait waiter;
+        vector<double> sample(count);
+        uint64_t       events = 0;
+
+        // The number of the event the waiter is waiting for (-1 = it gave up), and when the
+        // signaling thread sent the latest one
+        atomic<int>      waiting(0);
+        atomic<clk::rep> sent(0);
+
+        if (efd < 0)
+        {
+            printf("  completion_wait: skipped (eventfd: %s)\n", strerror(errno));
+            return;
+        }
+
+        waiter.attach(efd);
+        waiter.setMode(m.mode);
+
+        // Signal each event once the waiter is ready for it
+        thread signaler([&]
+        {
+            uint64_t one = 1;
+            for (int i=1; i<=count; ++i)
+            {
+                while (waiting != i) {if (waiting < 0) return; sched_yield();}
+                this_thread::sleep_for(chrono::microseconds(50));
+                sent = clk::now().time_since_epoch().count();
+                if (::write(efd, &one, sizeof one) != sizeof one) return;
+            }
+        });
+
+        // Time how long each event takes to wake us up
+        for (int i=0; i<count; ++i)
+        {
+            waiting = i + 1;
+            uint64_t n = waiter.wait(1000);
+            if (n == 0) {waiting = -1; break;}
+            events   += n;
+            sample[i] = chrono::duration<double, nano>(clk::now().time_since_epoch() -
+                                                       clk::duration(sent.load())).count();
+        }
+        signaler.join();
+
+        // Every event must arrive, and be counted exactly once
+        if (events != (uint64_t)count)
+        {
+            printf("  completion_wait: %s saw %llu of %i events\n", m.name,
+                   (unsigned long long)events, count);
+            continue;
+        }
+
+        // Report the percentiles, and how often the waiter went to sleep
+        sort(sample.begin(), sample.end());
+        string name = m.name;
+        record("completion_wait", name + "_p50", sample[count * 50 / 100], "ns");
+        record("completion_wait", name + "_p99", sample[count * 99 / 100], "ns");
+        record("completion_wait", name + "_sleeps", (double)waiter.sleeps() / count, "per wait");
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// benchAcqPipeline() - Measures how many buffers per second an AcqPipeline can move from
+//                      poller to sink
+//
+// A thread stands in for the FPGA: it fills each buffer with its sequence number once the host
+// has released it, and counts it in the completion register.  The processing threads and the
+// sink check that every buffer arrives with the right contents, and the sink that they arrive in
+// order.  The FPGA can only be stood in for when the register BAR is plain memory, so this needs
+// the simulator
+//=================================================================================================
+static void benchAcqPipeline()
+{
+    if (!sim)
+    {
+        printf("  acq_pipeline: skipped (needs the simulator to stand in for the FPGA)\n");
+        return;
+    }
+
+    backend = "sim-ram";
+    const size_t   bufferSize     = 64 * 1024;
+    const int      bufferCount    = 8;
+    const int      processThreads = 2;
+    const uint64_t totalCount     = 100000;
+
+    // Carve a host buffer into the DMA buffers the "FPGA" fills
+    NumaBuffer                host(bufferSize * bufferCount, device->numaNode());
+    DmaPool                   pool;
+    vector<DmaPool::buffer_t> buffer(bufferCount);
+    pool.init(host.bptr(), 0, host.size(), {{bufferSize, bufferCount}});
+    for (auto& b : buffer) pool.alloc(bufferSize, b);
+
+    // DATA is volatile, so it stands in for the completion count, and ADDRL for the release count
+    FpgaReg  completionReg(REG_PCIPROXY_DATA), releaseReg(REG_PCIPROXY_ADDRL);
+    uint8_t* bar        = device->bar(regBar).baseAddr;
+    uint8_t* completion = bar + completionReg.axiAddress();
+    uint8_t* release    = bar + releaseReg.axiAddress();
+    Mmio::write32(completion, 0);
+
+    // The number of buffers that arrived with the wrong contents or out of order
+    atomic<uint64_t> corrupt(0), disordered(0);
+    uint64_t         expected = 0;
+
+    auto process = [&](AcqPipeline::item_t& item)
+    {
+        if (*(uint64_t*)item.buffer.ptr != item.sequence) ++corrupt;
+    };
+
+    auto sink = [&](AcqPipeline::item_t& item)
+    {
+        if (item.sequence != expected++) ++disordered;
+    };
+
+    AcqPipeline pipeline;
+    pipeline.start(buffer, &completionReg, &releaseReg, process, sink, processThreads);
+
+    // Fill buffer "n" once buffer n-bufferCount has been released, then count it
+    auto start = clk::now();
+    thread fpga([&]
+    {
+        for (uint64_t n=0; n<totalCount; ++n)
+        {
+            while (n - Mmio::read32(release) >= (uint64_t)bufferCount) sched_yield();
+            *(uint64_t*)buffer[n % bufferCount].ptr = n;
+            Mmio::write32(completion, (uint32_t)(n + 1));
+        }
+    });
+    fpga.join();
+
+    // Wait for the last of them to reach the sink
+    while (pipeline.stats().sunk < totalCount && seconds(start) < 30) sched_yield();
+    double elapsed = seconds(start);
+    pipeline.stop();
+
+    auto stats = pipeline.stats();
+    if (stats.sunk != totalCount || corrupt || disordered)
+    {
+        printf("  acq_pipeline: %llu of %llu buffers sunk, %llu corrupt, %llu out of order\n",
+               (unsigned long long)stats.sunk, (unsigned long long)totalCount,
+               (unsigned long long)corrupt.load(), (unsigned long long)disordered.load());
+        return;
+    }
+
+    record("acq_pipeline", to_string(processThreads) + "t_buffers", totalCount / elapsed,
+           "buffers/s");
+    record("acq_pipeline", "stalls", stats.stalls, "stalls");
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// benchPhysMem() - Measures read and write bandwidth of the "memmap=" reserved region
+//=================================================================================================
+static void benchPhysMem()
+{
+    backend = "hw";
+    PhysMem mem;
+
+    // Map the reserved region.  This needs root and a "memmap=" on the kernel command line
+    try
+    {
+        mem.map();
+    }
+    catch (const exception& e)
+    {
+        printf("  physmem: skipped (%s)\n", e.what());
+        return;
+    }
+
+    size_t     bytes = min((size_t)(64 << 20), mem.size());
+    NumaBuffer host(bytes, -1);
+
+    // Time a write of the region
+    auto start = clk::now();
+    memcpy(mem.vptr(), host.vptr(), bytes);
+    record("physmem_bandwidth", "write", bytes / seconds(start) / 1e6, "MB/s");
+
+    // Time a read of the region
+    start = clk::now();
+    memcpy(host.vptr(), mem.vptr(), bytes);
+    record("physmem_bandwidth", "read", bytes / seconds(start) / 1e6, "MB/s");
+
+    // Now map the region cached, and time an invalidate followed by a read
+    try
+    {
+        mem.map(mem.physAddr(), bytes, true);
+    }
+    catch (const exception& e)
+    {
+        printf("  physmem cached: skipped (%s)\n", e.what());
+        return;
+    }
+
+    start = clk::now();
+    PhysMem::invalidate(mem.vptr(), bytes);
+    memcpy(host.vptr(), mem.vptr(), bytes);
+    record("physmem_bandwidth", "cached_read", bytes / seconds(start) / 1e6, "MB/s");
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// benchCapture() - Measures how fast a CaptureWriter can stream DMA buffers to disk
+//=================================================================================================
+static void benchCapture()
+{
+    backend = "hw";
+    const size_t bufferSize  = 1 << 20;
+    const int    bufferCount = 64;
+    const int    totalCount  = 1024;
+    const int    threadCount = 4;
+
+    // Carve a host buffer into DMA buffers, standing in for the memmap= region
+    NumaBuffer host(bufferSize * bufferCount, device->numaNode());
+    DmaPool    pool;
+    pool.init(host.bptr(), 0, host.size(), {{bufferSize, bufferCount}});
+
+    // Stream buffers to disk as fast as the writers will recycle them
+    CaptureWriter writer;
+    writer.start(captureFile, threadCount, [&](const DmaPool::buffer_t& b){pool.free(b);});
+    for (int i=0; i<totalCount; ++i)
+    {
+        DmaPool::buffer_t buffer;
+        while (!pool.alloc(bufferSize, buffer)) sched_yield();
+        writer.submit(buffer, bufferSize);
+    }
+    writer.stop();
+    unlink(captureFile.c_str());
+
+    auto stats = writer.stats();
+    record("capture_bandwidth", "odirect_" + to_string(threadCount) + "t", stats.mbps, "MB/s");
+    record("capture_bandwidth", "max_queue_depth", stats.maxQueueDepth, "buffers");
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// writeJson() - Writes the results to a JSON file
+//=================================================================================================
+static void writeJson()
+{
+    FILE* file = fopen(jsonFile.c_str(), "w");
+    if (file == nullptr)
+    {
+        printf("Can't create %s\n", jsonFile.c_str());
+        return;
+    }
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"target\": \"%s\",\n", useSim ? "sim" : "hw");
+    fprintf(file, "  \"kernel\": \"%s\",\n", MmioCopy::kernelName(MmioCopy::kernel()));
+    fprintf(file, "  \"results\": [\n");
+    for (size_t i=0; i<results.size(); ++i)
+    {
+        auto& r = results[i];
+        fprintf(file, "    {\"group\": \"%s\", \"name\": \"%s\", \"value\": %.3f, "
+                      "\"unit\": \"%s\", \"backend\": \"%s\"}%s\n",
+                r.group.c_str(), r.name.c_str(), r.value, r.unit.c_str(), r.backend.c_str(),
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+
+    printf("Results written to %s\n", jsonFile.c_str());
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// parseCommandLine() - Parses the command line options
+//=================================================================================================
+static void parseCommandLine(const char** argv)
+{
+    while (*++argv)
+    {
+        string arg = *argv;
+
+        if (arg == "-sim")
+            useSim = true;
+        else if (arg == "-hw" && argv[1] && argv[2])
+        {
+            useSim   = false;
+            vendorID = strtol(*++argv, 0, 0);
+            deviceID = strtol(*++argv, 0, 0);
+        }
+        else if (arg == "-regbar" && argv[1])
+            regBar = strtol(*++argv, 0, 0);
+        else if (arg == "-databar" && argv[1])
+            dataBar = strtol(*++argv, 0, 0);
+        else if (arg == "-size" && argv[1])
+            xferSize = strtoul(*++argv, 0, 0);
+        else if (arg == "-physmem")
+            usePhysMem = true;
+        else if (arg == "-capture" && argv[1])
+            captureFile = *++argv;
+        else if (arg == "-json" && argv[1])
+            jsonFile = *++argv;
+        else
+        {
+            fprintf(stderr, "pcibench: bad option %s\n", arg.c_str());
+            exit(1);
+        }
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// execute() - Runs the benchmarks
+//=================================================================================================
+static void execute()
+{
+    PciDevice hardware;
+    SimDevice simulator;
+
+    // Open either the real hardware or a simulated device
+    if (useSim)
+    {
+        vector<size_t> barSize(dataBar + 1, 0);
+        barSize[regBar]  = 64 * 1024;
+        barSize[dataBar] = max(xferSize, barSize[dataBar]);
+        simulator.create("/dev/shm/pcibench-" + to_string(getpid()), barSize);
+        device = sim = &simulator;
+    }
+    else
+    {
+        hardware.open(vendorID, deviceID);
+        device = &hardware;
+    }
+
+    printf("pcibench: target=%s kernel=%s\n", useSim ? "sim" : "hw",
+           MmioCopy::kernelName(MmioCopy::kernel()));
+
+    // Only SimDevice's own accessors go through its latency model
+    if (useSim)
+    {
+        printf("pcibench: note: on the simulator, only SimDevice's own accessors go through the"
+               " link model, and only they are timed.  Code that accesses the BARs directly runs"
+               " as a functional check\n");
+    }
+
+    benchReadLatency();
+    benchWriteBandwidth();
+    benchFpgaReg();
+    benchCompletionWait();
+    benchAcqPipeline();
+    if (usePhysMem) benchPhysMem();
+    if (!captureFile.empty()) benchCapture();
+
+    writeJson();
+}
+//=================================================================================================
+
+
+int main(int argc, const char** argv)
+{
+    parseCommandLine(argv);
+
+    try
+    {
+        execute();
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+}
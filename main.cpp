@@ -5,20 +5,25 @@
 #include "PciDevice.h"
 #include "PhysMem.h"
 #include "FpgaReg.h"
+#include "MmioCopy.h"
+#include "NumaBuffer.h"
 PciDevice pci;
 PhysMem   mem;
 
 #define ENTRIES (1024*1024)
-uint32_t buffer[ENTRIES];
+NumaBuffer buffer;
 
 FpgaReg pciProxyAddrH(REG_PCIPROXY_ADDRH);
 
 void process()
 {
-   for (int i=0;i<ENTRIES;++i) buffer[i] = i;
-
    pci.open(0x10ee, 0x903f);
 
+   // Allocate the staging buffer on the same NUMA node as the device
+   buffer.alloc(ENTRIES * sizeof(uint32_t), pci.numaNode());
+   uint32_t* data = (uint32_t*)buffer.vptr();
+   for (int i=0;i<ENTRIES;++i) data[i] = i;
+
    // Set the user-space address where AXI registers live
    FpgaReg::setUserspaceAddr(pci.resourceList()[0].baseAddr);
 
@@ -29,7 +34,7 @@ void process()
    printf("dest = %i\n", *dest);
    exit(1);
 
-   memcpy(dest, buffer, sizeof(buffer));
+   MmioCopy::toDevice(dest, buffer.vptr(), buffer.size());
    exit(1);
 
 
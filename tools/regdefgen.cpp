@@ -0,0 +1,301 @@
+//=================================================================================================
+// regdefgen.cpp - Generates FpgaRegDefs.h from a register definitions file
+//
+// Usage: regdefgen <register.def> <output.h> [<output.d>]
+//
+// The register definitions file is read by RegDefParser, the same parser that
+// FpgaReg::readDefinitions() uses, so it has the same syntax:
+//
+//    base <IP_NAME> <base_address>
+//    reg <REG_NAME> <offset_from_base_address> [access_policy]
+//    field <FIELD_NAME> <rightmost_bit_number> <width_in_bits>
+//    include <filename>
+//    template <TEMPLATE_NAME>
+//    end
+//    instance <IP_NAME> <TEMPLATE_NAME> <base_address> [<count> <stride>]
+//
+// The access policy is one of rw, ro, wo, volatile, or static, and defaults to volatile.
+//
+// The generated header contains:
+//
+//    fpgareg_t      - REG_<IP_NAME>_<REG_NAME> for every register, then REG_COUNT
+//    fpgafld_t      - FLD_<IP_NAME>_<REG_NAME>_<FIELD_NAME> for every field, then FLD_COUNT
+//    fpgapolicy_t   - POLICY_<ACCESS_POLICY> for every access policy, then POLICY_COUNT
+//    fpgaRegAddr    - The AXI address of every register
+//    fpgaRegPolicy  - The access policy of every register
+//    fpgaFldInfo    - The register, AXI address, mask, bit-position, and width of every field
+//    fpgaRegName    - The name of every register, as <IP_NAME>_<REG_NAME>
+//    fpgaFldName    - The name of every field, as <IP_NAME>_<REG_NAME>_<FIELD_NAME>
+//    fpgaPolicyName - The name of every access policy, as it appears in the definitions file
+//
+// The header is only rewritten if its contents change, so that editing a comment in the
+// definitions file doesn't force a rebuild of everything that includes it.
+//
+// If an output.d is named, it's written as a makefile fragment that makes the header depend on
+// every file that was read, so that editing an included file regenerates the header too.
+//=================================================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "../RegDefParser.h"
+using namespace std;
+
+// One register, as read from the definitions file.  "policy" indexes RegDefParser::policyName[]
+struct reg_t {string name; uint32_t axiAddr; int policy;};
+
+// One field, as read from the definitions file
+struct fld_t {string name; size_t reg; uint32_t bitPos; uint32_t width;};
+
+// The access policies, in the order they appear in fpgapolicy_t
+static const vector<string> policyName(begin(RegDefParser::policyName),
+                                       end(RegDefParser::policyName));
+
+// The name of the file we're reading
+static string inputName;
+
+// The parser that reads it
+static RegDefParser parser;
+
+
+//=================================================================================================
+// fail() - Reports an error in the definitions file and exits
+//=================================================================================================
+static void fail(const char* fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "%s: ", parser.where().c_str());
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+
+    exit(1);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// readDefinitions() - Reads the definitions file into lists of registers and fields
+//=================================================================================================
+static void readDefinitions(vector<reg_t>& regs, vector<fld_t>& flds)
+{
+    set<string> names;
+
+    auto onReg = [&](const RegDefParser::reg_t& reg)
+    {
+        string name = string(reg.ip) + "_" + string(reg.name);
+        if (!names.insert(name).second) fail("Duplicate register %s", name.c_str());
+        regs.push_back({name, reg.axiAddr, reg.policy});
+    };
+
+    auto onField = [&](const RegDefParser::field_t& fld)
+    {
+        string name = regs.back().name + "_" + string(fld.name);
+        if (!names.insert(name).second) fail("Duplicate field %s", name.c_str());
+        flds.push_back({name, regs.size() - 1, fld.bitPos, fld.width});
+    };
+
+    try
+    {
+        parser.parse(inputName, onReg, onField);
+    }
+    catch (const exception& e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        exit(1);
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// writeDependencies() - Writes a makefile fragment that makes the header depend on every file
+//                       that was read
+//=================================================================================================
+static bool writeDependencies(const char* headerName, const char* depName)
+{
+    FILE* file = fopen(depName, "w");
+    if (file == nullptr) return false;
+
+    fprintf(file, "%s :", headerName);
+    for (auto& name : parser.files()) fprintf(file, " %s", name.c_str());
+    fprintf(file, "\n");
+
+    // An empty rule for each file, so that deleting one doesn't break the build
+    for (auto& name : parser.files()) fprintf(file, "%s :\n", name.c_str());
+
+    return fclose(file) == 0;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// generate() - Returns the text of the header file
+//=================================================================================================
+static string generate(const vector<reg_t>& regs, const vector<fld_t>& flds)
+{
+    ostringstream out;
+    char          line[1024];
+
+    out << "//=================================================================================================\n"
+        << "// FpgaRegDefs.h - The FPGA register map\n"
+        << "//\n"
+        << "// Generated from " << inputName << " by tools/regdefgen.  Don't edit this file: edit\n"
+        << "// " << inputName << " instead, and rebuild.\n"
+        << "//=================================================================================================\n"
+        << "#pragma once\n"
+        << "#include <stdint.h>\n"
+        << "#include <array>\n"
+        << "\n";
+
+    // The register constants
+    out << "// Identifies every FPGA register\n"
+        << "enum fpgareg_t\n{\n";
+    for (auto& reg : regs) out << "    REG_" << reg.name << ",\n";
+    out << "    REG_COUNT\n};\n\n";
+
+    // The field constants
+    out << "// Identifies every bit-field in every FPGA register\n"
+        << "enum fpgafld_t\n{\n";
+    for (auto& fld : flds) out << "    FLD_" << fld.name << ",\n";
+    out << "    FLD_COUNT\n};\n\n";
+
+    // The access policies
+    out << "// How a register may be accessed, and whether a read has to go to the FPGA:\n"
+        << "//    rw       - Only the host changes it.  Reads come from the shadow once it's known\n"
+        << "//    ro       - Read-only, and the FPGA may change it.  Every read goes to the FPGA\n"
+        << "//    wo       - Write-only.  Reads return the last value written, never the FPGA\n"
+        << "//    volatile - The FPGA may change it.  Every read goes to the FPGA\n"
+        << "//    static   - Read-only, and never changes.  Only the first read goes to the FPGA\n"
+        << "enum fpgapolicy_t\n{\n";
+    for (auto& name : policyName)
+    {
+        string upper = name;
+        for (auto& ch : upper) ch = toupper(ch);
+        out << "    POLICY_" << upper << ",\n";
+    }
+    out << "    POLICY_COUNT\n};\n\n";
+
+    // The register addresses
+    out << "// The AXI address of every register\n"
+        << "constexpr std::array<uint32_t, REG_COUNT> fpgaRegAddr =\n{{\n";
+    for (auto& reg : regs)
+    {
+        sprintf(line, "    0x%08X,   // REG_%s\n", reg.axiAddr, reg.name.c_str());
+        out << line;
+    }
+    out << "}};\n\n";
+
+    // The register access policies
+    out << "// The access policy of every register\n"
+        << "constexpr std::array<fpgapolicy_t, REG_COUNT> fpgaRegPolicy =\n{{\n";
+    for (auto& reg : regs)
+    {
+        string upper = policyName[reg.policy];
+        for (auto& ch : upper) ch = toupper(ch);
+        sprintf(line, "    POLICY_%-10s // REG_%s\n", (upper + ",").c_str(), reg.name.c_str());
+        out << line;
+    }
+    out << "}};\n\n";
+
+    // The field descriptors
+    out << "// Describes a bit-field within a register.  \"mask\" is already shifted into position\n"
+        << "struct fpgafld_info_t {fpgareg_t reg; uint32_t axiAddr; uint32_t mask; uint32_t bitPos; "
+        << "uint32_t width;};\n\n"
+        << "// The location of every bit-field\n"
+        << "constexpr std::array<fpgafld_info_t, FLD_COUNT> fpgaFldInfo =\n{{\n";
+    for (auto& fld : flds)
+    {
+        uint32_t mask = (uint32_t)(((1ULL << fld.width) - 1) << fld.bitPos);
+        sprintf(line, "    {REG_%s, 0x%08X, 0x%08X, %2u, %2u},   // FLD_%s\n",
+                regs[fld.reg].name.c_str(), regs[fld.reg].axiAddr, mask, fld.bitPos, fld.width,
+                fld.name.c_str());
+        out << line;
+    }
+    out << "}};\n\n";
+
+    // The names
+    out << "// The name of every register, as it appears in " << inputName << "\n"
+        << "constexpr std::array<const char*, REG_COUNT> fpgaRegName =\n{{\n";
+    for (auto& reg : regs) out << "    \"" << reg.name << "\",\n";
+    out << "}};\n\n";
+
+    out << "// The name of every bit-field, as it appears in " << inputName << "\n"
+        << "constexpr std::array<const char*, FLD_COUNT> fpgaFldName =\n{{\n";
+    for (auto& fld : flds) out << "    \"" << fld.name << "\",\n";
+    out << "}};\n\n";
+
+    out << "// The name of every access policy, as it appears in " << inputName << "\n"
+        << "constexpr std::array<const char*, POLICY_COUNT> fpgaPolicyName =\n{{\n";
+    for (auto& name : policyName) out << "    \"" << name << "\",\n";
+    out << "}};\n";
+
+    return out.str();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// main() - Reads the definitions file and writes the header, if it has changed
+//=================================================================================================
+int main(int argc, char** argv)
+{
+    vector<reg_t> regs;
+    vector<fld_t> flds;
+
+    if (argc != 3 && argc != 4)
+    {
+        fprintf(stderr, "Usage: regdefgen <register.def> <output.h> [<output.d>]\n");
+        return 1;
+    }
+
+    // Read the register definitions and turn them into a header
+    inputName = argv[1];
+    readDefinitions(regs, flds);
+    string header = generate(regs, flds);
+
+    // Tell make which files the header was built from
+    if (argc == 4 && !writeDependencies(argv[2], argv[3]))
+    {
+        fprintf(stderr, "regdefgen: can't create %s\n", argv[3]);
+        return 1;
+    }
+
+    // If the existing header is already identical, leave it alone
+    ifstream existing(argv[2]);
+    if (existing.is_open())
+    {
+        stringstream old;
+        old << existing.rdbuf();
+        if (old.str() == header) return 0;
+    }
+
+    // Write the new header under a temporary name, then move it into place
+    string tempName = string(argv[2]) + ".tmp";
+    FILE*  file = fopen(tempName.c_str(), "w");
+    if (file == nullptr)
+    {
+        fprintf(stderr, "regdefgen: can't create %s\n", tempName.c_str());
+        return 1;
+    }
+    fputs(header.c_str(), file);
+    fclose(file);
+
+    if (rename(tempName.c_str(), argv[2]) != 0)
+    {
+        fprintf(stderr, "regdefgen: can't create %s\n", argv[2]);
+        return 1;
+    }
+
+    return 0;
+}
+//=================================================================================================